@@ -0,0 +1,460 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "action.h"
+
+extern char **environ;
+
+#define BIT_NAME(reg, bit) { reg, bit, #bit }
+
+// the status bits an action can be bound to, by the name of their macro
+static const struct {
+	int reg;
+	unsigned long mask;
+	const char *name;
+} bit_names[] = {
+	BIT_NAME(0, ALARM_CAP_UV), BIT_NAME(0, ALARM_CAP_OV), BIT_NAME(0, ALARM_GPI_UV),
+	BIT_NAME(0, ALARM_GPI_OV), BIT_NAME(0, ALARM_VIN_UV), BIT_NAME(0, ALARM_VIN_OV),
+	BIT_NAME(0, ALARM_VCAP_UV), BIT_NAME(0, ALARM_VCAP_OV), BIT_NAME(0, ALARM_VOUT_UV),
+	BIT_NAME(0, ALARM_VOUT_OV), BIT_NAME(0, ALARM_IIN_OC), BIT_NAME(0, ALARM_ICHG_UC),
+	BIT_NAME(0, ALARM_DTEMP_COLD), BIT_NAME(0, ALARM_DTEMP_HOT), BIT_NAME(0, ALARM_ESR_HI),
+	BIT_NAME(0, ALARM_CAP_LO),
+	BIT_NAME(1, MON_CAPSR_ACTIVE), BIT_NAME(1, MON_CAPESR_SCHEDULED), BIT_NAME(1, MON_CAPESR_PENDING),
+	BIT_NAME(1, MON_CAP_DONE), BIT_NAME(1, MON_ESR_DONE), BIT_NAME(1, MON_CAP_FAILED),
+	BIT_NAME(1, MON_ESR_FAILED), BIT_NAME(1, MON_POWER_FAILED), BIT_NAME(1, MON_POWER_RETURNED),
+	BIT_NAME(2, CHRG_STEPDOWN), BIT_NAME(2, CHRG_STEPUP), BIT_NAME(2, CHRG_CV), BIT_NAME(2, CHRG_UVLO),
+	BIT_NAME(2, CHRG_INPUT_ILIM), BIT_NAME(2, CHRG_CAPPG), BIT_NAME(2, CHRG_SHNT), BIT_NAME(2, CHRG_BAL),
+	BIT_NAME(2, CHRG_DIS), BIT_NAME(2, CHRG_CI), BIT_NAME(2, CHRG_PFO),
+};
+
+#define NUM_BIT_NAMES (sizeof(bit_names) / sizeof(bit_names[0]))
+
+static uint64_t monotonic_ns(void)
+{
+	return stats_start();
+}
+
+/*
+ * --action BIT[/MS]=exec:COMMAND, BIT[/MS]=fifo:PATH or
+ * BIT[/MS]=write:ATTR=VALUE, e.g. MON_POWER_FAILED/2000=exec:/sbin/poweroff.
+ * BIT is the name of the bit's macro, in any case; MS is how long the
+ * action may run. The command is split on spaces, it is not run by a
+ * shell. ATTR is an attribute of the device that raised the bit, or a
+ * sysfs path.
+ * Return: 0 on success, EINVAL if the option is not valid.
+ */
+int action_parse(struct action_pool *pool, const char *arg)
+{
+	struct action *a = &pool->actions[pool->nactions];
+	const char *eq = strchr(arg, '='), *colon, *slash;
+	char name[32], *target, *save, *tok;
+	size_t i;
+	int argc = 0;
+
+	if (pool->nactions == MAX_ACTIONS) {
+		fprintf(stderr, "await: at most %d actions\n", MAX_ACTIONS);
+		return EINVAL;
+	}
+	if (eq == NULL || (colon = strchr(eq, ':')) == NULL || colon[1] == '\0') {
+		fprintf(stderr, "await: invalid action %s\n", arg);
+		return EINVAL;
+	}
+	memset(a, 0, sizeof(*a));
+	a->timeout = -1;
+	slash = memchr(arg, '/', eq - arg);
+	snprintf(name, sizeof(name), "%.*s", (int) ((slash != NULL ? slash : eq) - arg), arg);
+	if (slash != NULL && (a->timeout = strtol(slash + 1, NULL, 10)) <= 0) {
+		fprintf(stderr, "await: invalid action timeout in %s\n", arg);
+		return EINVAL;
+	}
+	for (i = 0; i < NUM_BIT_NAMES && strcasecmp(bit_names[i].name, name) != 0; i++)
+		;
+	if (i == NUM_BIT_NAMES) {
+		fprintf(stderr, "await: %s is not a status bit\n", name);
+		return EINVAL;
+	}
+	a->reg = bit_names[i].reg;
+	a->bit = __builtin_ctzl(bit_names[i].mask);
+	a->bit_name = bit_names[i].name;
+
+	if (strncmp(eq + 1, "exec:", 5) == 0)
+		a->kind = ACTION_EXEC;
+	else if (strncmp(eq + 1, "fifo:", 5) == 0)
+		a->kind = ACTION_FIFO;
+	else if (strncmp(eq + 1, "write:", 6) == 0)
+		a->kind = ACTION_WRITE;
+	else {
+		fprintf(stderr, "await: the action of %s is not exec, fifo or write\n", name);
+		return EINVAL;
+	}
+	a->spec = strdup(eq + 1);
+	target = strchr(a->spec, ':') + 1;
+	switch (a->kind) {
+	case ACTION_EXEC:
+		// the spec is split in a copy, it is kept whole for the messages
+		target = strdup(target);
+		for (tok = strtok_r(target, " ", &save); tok != NULL && argc < ACTION_ARGS;
+				tok = strtok_r(NULL, " ", &save))
+			a->argv[argc++] = tok;
+		if (argc == 0 || tok != NULL) {
+			fprintf(stderr, "await: the command of %s has no or more than %d arguments\n", name, ACTION_ARGS);
+			return EINVAL;
+		}
+		break;
+	case ACTION_FIFO:
+		a->path = target;
+		break;
+	case ACTION_WRITE:
+		a->path = strdup(target);
+		if ((a->value = strrchr(a->path, '=')) == NULL || a->value == a->path) {
+			fprintf(stderr, "await: the write of %s is not ATTR=VALUE\n", name);
+			return EINVAL;
+		}
+		*a->value++ = '\0';
+		// resolved here: the lookup table is built on first use, not by the workers
+		a->attr = strchr(a->path, '/') == NULL ? attr_lookup(a->path) : ATTR_NONE;
+		if (strchr(a->path, '/') == NULL && a->attr == ATTR_NONE) {
+			fprintf(stderr, "await: %s is not an attribute\n", a->path);
+			return EINVAL;
+		}
+		break;
+	}
+	pool->nactions++;
+	return 0;
+}
+
+static void *worker(void *arg);
+
+/**
+ * action_start() - start the workers of the actions parsed
+ *
+ * The workers inherit the signal mask of the caller: with await's, the
+ * signals stay with the event loop.
+ * Return: 0 on success, otherwise error code
+*/
+int action_start(struct action_pool *pool)
+{
+	int err;
+
+	if (pool->timeout == 0)
+		pool->timeout = ACTION_TIMEOUT;
+	if (pool->nworkers == 0)
+		pool->nworkers = ACTION_WORKERS;
+	if (pool->size == 0)
+		pool->size = ACTION_QUEUE;
+	if (pool->timeout < 0 || pool->nworkers < 0 || pool->nworkers > ACTION_MAX_WORKERS || pool->size < 0
+			|| pool->size > ACTION_MAX_QUEUE) {
+		fprintf(stderr, "await: the action timeout must be positive, with 1 to %d workers and a queue of"
+				" 1 to %d actions\n", ACTION_MAX_WORKERS, ACTION_MAX_QUEUE);
+		return EINVAL;
+	}
+	for (int i = 0; i < pool->nactions; i++)
+		if (pool->actions[i].timeout < 0)
+			pool->actions[i].timeout = pool->timeout;
+	if ((pool->queue = calloc(pool->size, sizeof(*pool->queue))) == NULL)
+		return throw("await: cannot allocate the action queue", ENOMEM);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->ready, NULL);
+	for (; pool->started < pool->nworkers; pool->started++) {
+		if ((err = pthread_create(&pool->workers[pool->started], NULL, worker, pool))) {
+			fprintf(stderr, "await: cannot start the action workers: %s\n", strerror(err));
+			action_stop(pool);
+			return err;
+		}
+	}
+	return 0;
+}
+
+/**
+ * action_dispatch() - queue the actions of the bits raised
+ * @before: the registers before the wakeup
+ * @after: the registers after it
+ * @woke: CLOCK_MONOTONIC ns of the wakeup, the latencies are counted from it
+ *
+ * A job is a few words copied under the lock. If the queue is full the
+ * job is dropped and counted: the event loop never waits for a worker.
+*/
+void action_dispatch(struct action_pool *pool, const struct ltc_device *dev, const struct status_regs *before,
+		const struct status_regs *after, uint64_t woke)
+{
+	int b[DEBOUNCE_REGS] = { before->alarms, before->monitor, before->chrg };
+	int a[DEBOUNCE_REGS] = { after->alarms, after->monitor, after->chrg };
+	int queued = 0;
+
+	for (int i = 0; i < pool->nactions; i++) {
+		struct action *action = &pool->actions[i];
+		int full;
+
+		if (!(a[action->reg] & ~b[action->reg] & BIT(action->bit)))
+			continue;
+		pthread_mutex_lock(&pool->lock);
+		if ((full = pool->count == pool->size)) {
+			action->dropped++;
+		} else {
+			pool->queue[(pool->head + pool->count) % pool->size] = (struct action_job) {
+				.action = action, .dev = dev, .woke = woke,
+			};
+			if (++pool->count > pool->max_depth)
+				pool->max_depth = pool->count;
+			queued = 1;
+		}
+		pthread_mutex_unlock(&pool->lock);
+		if (full)
+			fprintf(stderr, "await: the action queue is full, %s %s dropped\n", action->bit_name, action->spec);
+	}
+	if (queued)
+		pthread_cond_broadcast(&pool->ready);
+}
+
+// Return: 0 if the child exited in time, ETIMEDOUT if it had to be killed
+static int wait_child(pid_t pid, long timeout, int *status)
+{
+	int fd = syscall(SYS_pidfd_open, pid, 0);
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	uint64_t deadline = monotonic_ns() + timeout * 1000000ULL;
+	int timedout = 0;
+
+	if (fd >= 0) {
+		timedout = poll(&pfd, 1, timeout) == 0;
+		close(fd);
+	} else {
+		// no pidfd before Linux 5.3
+		struct timespec tick = { 0, 5000000 };
+
+		while (waitpid(pid, status, WNOHANG) == 0) {
+			if (monotonic_ns() >= deadline) {
+				timedout = 1;
+				break;
+			}
+			nanosleep(&tick, NULL);
+		}
+		if (!timedout)
+			return 0;
+	}
+	if (timedout)
+		kill(pid, SIGKILL);
+	waitpid(pid, status, 0);
+	return timedout ? ETIMEDOUT : 0;
+}
+
+/*
+ * The command gets the device and the bit in its environment, as
+ * LTC_MONITOR_DEVICE and LTC_MONITOR_BIT.
+ */
+static int run_exec(const struct action_job *job, char *msg, size_t size)
+{
+	const struct action *a = job->action;
+	char device[64], bit[64], **envp;
+	posix_spawnattr_t attr;
+	sigset_t none;
+	size_t n = 0;
+	pid_t pid;
+	int err, status = 0;
+
+	while (environ[n] != NULL)
+		n++;
+	if ((envp = malloc((n + 3) * sizeof(*envp))) == NULL)
+		return ENOMEM;
+	memcpy(envp, environ, n * sizeof(*envp));
+	snprintf(device, sizeof(device), "LTC_MONITOR_DEVICE=%s", job->dev->name);
+	snprintf(bit, sizeof(bit), "LTC_MONITOR_BIT=%s", a->bit_name);
+	envp[n] = device;
+	envp[n + 1] = bit;
+	envp[n + 2] = NULL;
+
+	// await blocks the signals it reads from its signalfd, the command must not inherit that
+	sigemptyset(&none);
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigmask(&attr, &none);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+	err = posix_spawnp(&pid, a->argv[0], NULL, &attr, a->argv, envp);
+	posix_spawnattr_destroy(&attr);
+	free(envp);
+	if (err)
+		return err;
+	if ((err = wait_child(pid, a->timeout, &status)))
+		return err;
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+		return 0;
+	if (WIFEXITED(status))
+		snprintf(msg, size, "exit status %d", WEXITSTATUS(status));
+	else
+		snprintf(msg, size, "killed by signal %d", WTERMSIG(status));
+	return EIO;
+}
+
+/*
+ * One line: "device BIT seconds.milliseconds\n", the wall clock time. It
+ * is shorter than PIPE_BUF, readers never see it torn.
+ */
+static int run_fifo(const struct action_job *job)
+{
+	const struct action *a = job->action;
+	struct pollfd pfd = { .events = POLLOUT };
+	struct timespec now;
+	char line[128];
+	int len, err = 0;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	len = snprintf(line, sizeof(line), "%s %s %lld.%03ld\n", job->dev->name, a->bit_name,
+			(long long) now.tv_sec, now.tv_nsec / 1000000);
+	// ENXIO if nobody reads the FIFO: nothing to wait for
+	if ((pfd.fd = open(a->path, O_WRONLY | O_NONBLOCK | O_CLOEXEC)) < 0)
+		return errno;
+	while (write(pfd.fd, line, len) < 0) {
+		if (errno != EAGAIN) {
+			err = errno;
+			break;
+		}
+		// the reader is behind
+		if (poll(&pfd, 1, a->timeout) == 0) {
+			err = ETIMEDOUT;
+			break;
+		}
+	}
+	close(pfd.fd);
+	return err;
+}
+
+/*
+ * A write to sysfs cannot be interrupted: one that takes longer than the
+ * timeout only counts as timed out once it returns. The access statistics
+ * belong to the event loop, they are not updated from the workers: the
+ * write is only in the action's own.
+ */
+static int run_write(const struct action_job *job)
+{
+	const struct action *a = job->action;
+	char path[PATH_MAX];
+	size_t len = strlen(a->value);
+	uint64_t start;
+	int fd, err;
+
+	if (a->attr != ATTR_NONE)
+		snprintf(path, sizeof(path), "%s/%s", job->dev->path, a->path);
+	else
+		snprintf(path, sizeof(path), "%s", a->path);
+	if ((fd = open(path, O_WRONLY | O_CLOEXEC)) < 0)
+		return errno;
+	start = monotonic_ns();
+	err = write(fd, a->value, len) != (ssize_t) len ? errno : 0;
+	close(fd);
+	if (err == 0 && monotonic_ns() - start > a->timeout * 1000000ULL)
+		return ETIMEDOUT;
+	return err;
+}
+
+static void run(struct action_pool *pool, const struct action_job *job)
+{
+	struct action *a = job->action;
+	uint64_t start = monotonic_ns(), end;
+	char msg[64] = "";
+	int err;
+
+	switch (a->kind) {
+	case ACTION_EXEC:
+		err = run_exec(job, msg, sizeof(msg));
+		break;
+	case ACTION_FIFO:
+		err = run_fifo(job);
+		break;
+	default:
+		err = run_write(job);
+	}
+	end = monotonic_ns();
+
+	pthread_mutex_lock(&pool->lock);
+	a->runs++;
+	a->failures += err != 0 && err != ETIMEDOUT;
+	a->timeouts += err == ETIMEDOUT;
+	a->wait_total += start - job->woke;
+	a->run_total += end - start;
+	if (start - job->woke > a->wait_max)
+		a->wait_max = start - job->woke;
+	if (end - start > a->run_max)
+		a->run_max = end - start;
+	pthread_mutex_unlock(&pool->lock);
+
+	fprintf(stderr, "await: %s: %s %s started %.3f ms after the notification, ", job->dev->name, a->bit_name,
+			a->spec, (start - job->woke) / 1e6);
+	if (err == 0)
+		fprintf(stderr, "done in %.3f ms\n", (end - start) / 1e6);
+	else if (err == ETIMEDOUT)
+		fprintf(stderr, "timed out after %ld ms%s\n", a->timeout, a->kind == ACTION_EXEC ? ", killed" : "");
+	else
+		fprintf(stderr, "failed: %s\n", msg[0] ? msg : strerror(err));
+}
+
+/*
+ * The jobs are run in the order they were queued. Once stopped, a worker
+ * still runs the jobs left: an action triggered just before the end, say
+ * a shutdown, is not lost.
+ */
+static void *worker(void *arg)
+{
+	struct action_pool *pool = arg;
+	struct action_job job;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		while (pool->count == 0 && !pool->stop)
+			pthread_cond_wait(&pool->ready, &pool->lock);
+		if (pool->count == 0) {
+			pthread_mutex_unlock(&pool->lock);
+			return NULL;
+		}
+		job = pool->queue[pool->head];
+		pool->head = (pool->head + 1) % pool->size;
+		pool->count--;
+		pthread_mutex_unlock(&pool->lock);
+		run(pool, &job);
+	}
+}
+
+// wait for the actions queued and running to end
+void action_stop(struct action_pool *pool)
+{
+	if (pool->queue == NULL)
+		return;
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->ready);
+	pthread_mutex_unlock(&pool->lock);
+	for (int i = 0; i < pool->started; i++)
+		pthread_join(pool->workers[i], NULL);
+	pool->started = 0;
+	free(pool->queue);
+	pool->queue = NULL;
+}
+
+/*
+ * Per action: runs, failures, timeouts, jobs dropped, the time from the
+ * notification to the start of the action and the time it ran.
+ */
+void action_report(FILE *out, struct action_pool *pool)
+{
+	fprintf(out, "%-20s %-24s %6s %6s %8s %7s %9s %9s %9s %9s\n", "bit", "action", "runs", "failed", "timeouts",
+			"dropped", "wait ms", "max ms", "run ms", "max ms");
+	for (int i = 0; i < pool->nactions; i++) {
+		const struct action *a = &pool->actions[i];
+
+		fprintf(out, "%-20s %-24.24s %6lu %6lu %8lu %7lu %9.3f %9.3f %9.3f %9.3f\n", a->bit_name, a->spec,
+				a->runs, a->failures, a->timeouts, a->dropped,
+				a->runs ? a->wait_total / 1e6 / a->runs : 0.0, a->wait_max / 1e6,
+				a->runs ? a->run_total / 1e6 / a->runs : 0.0, a->run_max / 1e6);
+	}
+	fprintf(out, "action queue: %d workers, %d slots, %d at most in use\n", pool->nworkers, pool->size,
+			pool->max_depth);
+}
@@ -0,0 +1,83 @@
+#ifndef ACTION_H
+#define ACTION_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "ltc-monitor.h"
+
+#define MAX_ACTIONS 16
+#define ACTION_ARGS 16
+#define ACTION_TIMEOUT 5000 // ms
+#define ACTION_WORKERS 2
+#define ACTION_MAX_WORKERS 8
+#define ACTION_QUEUE 32
+#define ACTION_MAX_QUEUE 1024
+
+enum action_kind {
+	ACTION_EXEC, // run a command
+	ACTION_FIFO, // write a line to a FIFO
+	ACTION_WRITE, // write a value to a sysfs attribute
+};
+
+/*
+ * What to do when a status bit is raised. The statistics are updated by
+ * the workers, under the pool's lock.
+ */
+struct action {
+	int reg; // the register of the bit, in the order of struct status_regs
+	int bit;
+	const char *bit_name; // e.g. MON_POWER_FAILED
+	enum action_kind kind;
+	char *spec; // as given, for the messages
+	char *argv[ACTION_ARGS + 1]; // the command, split on spaces
+	char *path; // FIFO, or sysfs attribute: a name is one of the device that raised the bit
+	enum attr_id attr; // of a write to a name, ATTR_NONE for a path
+	char *value;
+	long timeout; // ms
+
+	unsigned long runs;
+	unsigned long failures;
+	unsigned long timeouts;
+	unsigned long dropped; // the queue was full
+	uint64_t wait_total, wait_max; // ns from the notification to the start of the action
+	uint64_t run_total, run_max; // ns the action ran
+};
+
+struct action_job {
+	struct action *action;
+	const struct ltc_device *dev;
+	uint64_t woke; // CLOCK_MONOTONIC ns of the wakeup that read the bit
+};
+
+/*
+ * A bounded queue of jobs, and the threads that run them. The event loop
+ * only ever adds a job, or drops it if the queue is full: it never waits
+ * for an action.
+ */
+struct action_pool {
+	struct action actions[MAX_ACTIONS];
+	int nactions;
+	long timeout; // ms, for the actions that do not give theirs
+	int nworkers;
+	int size; // of the queue
+
+	pthread_t workers[ACTION_MAX_WORKERS];
+	int started;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	struct action_job *queue;
+	int head;
+	int count;
+	int max_depth;
+	int stop;
+};
+
+int action_parse(struct action_pool *pool, const char *arg);
+int action_start(struct action_pool *pool);
+void action_dispatch(struct action_pool *pool, const struct ltc_device *dev, const struct status_regs *before,
+		const struct status_regs *after, uint64_t woke);
+void action_stop(struct action_pool *pool);
+void action_report(FILE *out, struct action_pool *pool);
+
+#endif
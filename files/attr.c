@@ -0,0 +1,246 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "attr.h"
+#include "ltc-monitor.h"
+
+#define MEAS(attr, u, f, min, max) { "meas_" #attr, ATTR_MEAS, u, f, min, max }
+#define LEVEL(attr, u, f) { #attr, ATTR_LEVEL, u, f, ATTR_NONE, ATTR_NONE }
+#define REG(attr, k) { #attr, k, UNIT_NONE, 0, ATTR_NONE, ATTR_NONE }
+
+const struct attr_desc attr_table[NUM_ATTRS] = {
+	[ATTR_ALARM_REG] = REG(alarm_reg, ATTR_STATUS),
+	[ATTR_MON_STATUS] = REG(mon_status, ATTR_STATUS),
+	[ATTR_CHRG_STATUS] = REG(chrg_status, ATTR_STATUS),
+
+	[ATTR_CLR_ALARMS] = REG(clr_alarms, ATTR_CONTROL),
+	[ATTR_MSK_ALARMS] = REG(msk_alarms, ATTR_CONTROL),
+	[ATTR_MSK_MON_STATUS] = REG(msk_mon_status, ATTR_CONTROL),
+	[ATTR_CTL_REG] = REG(ctl_reg, ATTR_CONTROL),
+	[ATTR_NUM_CAPS] = REG(num_caps, ATTR_CONTROL),
+	[ATTR_CAP_ESR_PER] = REG(cap_esr_per, ATTR_CONTROL),
+	[ATTR_VCAPFB_DAC] = REG(vcapfb_dac, ATTR_CONTROL),
+	[ATTR_VSHUNT] = { "vshunt", ATTR_CONTROL, UNIT_MV, 1835, ATTR_NONE, ATTR_NONE },
+
+	[ATTR_CAP_UV_LVL] = LEVEL(cap_uv_lvl, UNIT_MV, 1835),
+	[ATTR_CAP_OV_LVL] = LEVEL(cap_ov_lvl, UNIT_MV, 1835),
+	[ATTR_GPI_UV_LVL] = LEVEL(gpi_uv_lvl, UNIT_MV, 1835),
+	[ATTR_GPI_OV_LVL] = LEVEL(gpi_ov_lvl, UNIT_MV, 1835),
+	[ATTR_VIN_UV_LVL] = LEVEL(vin_uv_lvl, UNIT_MV, 22100),
+	[ATTR_VIN_OV_LVL] = LEVEL(vin_ov_lvl, UNIT_MV, 22100),
+	[ATTR_VCAP_UV_LVL] = LEVEL(vcap_uv_lvl, UNIT_MV, 14760),
+	[ATTR_VCAP_OV_LVL] = LEVEL(vcap_ov_lvl, UNIT_MV, 14760),
+	[ATTR_VOUT_UV_LVL] = LEVEL(vout_uv_lvl, UNIT_MV, 22100),
+	[ATTR_VOUT_OV_LVL] = LEVEL(vout_ov_lvl, UNIT_MV, 22100),
+	[ATTR_IIN_OC_LVL] = LEVEL(iin_oc_lvl, UNIT_NONE, 0),
+	[ATTR_ICHG_UC_LVL] = LEVEL(ichg_uc_lvl, UNIT_NONE, 0),
+	[ATTR_DTEMP_COLD_LVL] = LEVEL(dtemp_cold_lvl, UNIT_C, 0),
+	[ATTR_DTEMP_HOT_LVL] = LEVEL(dtemp_hot_lvl, UNIT_C, 0),
+	[ATTR_ESR_HI_LVL] = LEVEL(esr_hi_lvl, UNIT_MR, 0),
+	[ATTR_CAP_LO_LVL] = LEVEL(cap_lo_lvl, UNIT_F, 0),
+
+	[ATTR_MEAS_CAP] = MEAS(cap, UNIT_F, 0, ATTR_CAP_LO_LVL, ATTR_NONE),
+	[ATTR_MEAS_ESR] = MEAS(esr, UNIT_MR, 0, ATTR_NONE, ATTR_ESR_HI_LVL),
+	[ATTR_MEAS_VCAP1] = MEAS(vcap1, UNIT_MV, 1835, ATTR_CAP_UV_LVL, ATTR_CAP_OV_LVL),
+	[ATTR_MEAS_VCAP2] = MEAS(vcap2, UNIT_MV, 1835, ATTR_CAP_UV_LVL, ATTR_CAP_OV_LVL),
+	[ATTR_MEAS_VCAP3] = MEAS(vcap3, UNIT_MV, 1835, ATTR_CAP_UV_LVL, ATTR_CAP_OV_LVL),
+	[ATTR_MEAS_VCAP4] = MEAS(vcap4, UNIT_MV, 1835, ATTR_CAP_UV_LVL, ATTR_CAP_OV_LVL),
+	[ATTR_MEAS_GPI] = MEAS(gpi, UNIT_MV, 1835, ATTR_GPI_UV_LVL, ATTR_GPI_OV_LVL),
+	[ATTR_MEAS_VIN] = MEAS(vin, UNIT_MV, 22100, ATTR_VIN_UV_LVL, ATTR_VIN_OV_LVL),
+	[ATTR_MEAS_VCAP] = MEAS(vcap, UNIT_MV, 14760, ATTR_VCAP_UV_LVL, ATTR_VCAP_OV_LVL),
+	[ATTR_MEAS_VOUT] = MEAS(vout, UNIT_MV, 22100, ATTR_VOUT_UV_LVL, ATTR_VOUT_OV_LVL),
+	[ATTR_MEAS_IIN] = MEAS(iin, UNIT_NONE, 0, ATTR_NONE, ATTR_IIN_OC_LVL),
+	[ATTR_MEAS_ICHG] = MEAS(ichg, UNIT_NONE, 0, ATTR_ICHG_UC_LVL, ATTR_NONE),
+	[ATTR_MEAS_DTEMP] = MEAS(dtemp, UNIT_C, 0, ATTR_DTEMP_COLD_LVL, ATTR_DTEMP_HOT_LVL),
+};
+
+// indexed by alarm_reg bit number
+const struct alarm_desc alarm_table[NUM_ALARMS] = {
+	{ "Capacitor undervoltage alarm", ATTR_MEAS_VCAP1, ATTR_CAP_UV_LVL, "Measured capacitor voltage", "Capacitor Undervoltage Level" },
+	{ "Capacitor overvoltage alarm", ATTR_MEAS_VCAP1, ATTR_CAP_OV_LVL, "Measured capacitor voltage", "Capacitor Overvoltage Level" },
+	{ "General purpose Undervoltage alarm", ATTR_MEAS_GPI, ATTR_GPI_UV_LVL, "Measured GPI pin voltage", "General Purpose Input Undervoltage Level" },
+	{ "General purpose Overvoltage alarm", ATTR_MEAS_GPI, ATTR_GPI_OV_LVL, "Measured GPI pin voltage", "General Purpose Input Overvoltage Level" },
+	{ "Input Undervoltage alarm", ATTR_MEAS_VIN, ATTR_VIN_UV_LVL, "Measured VIN voltage", "VIN Undervoltage Level" },
+	{ "Input Overvoltage alarm", ATTR_MEAS_VIN, ATTR_VIN_OV_LVL, "Measured VIN voltage", "VIN Overvoltage Level" },
+	{ "Capacitor undervoltage alarm", ATTR_MEAS_VCAP, ATTR_VCAP_UV_LVL, "Measured VCAP voltage", "VCAP Undervoltage Level" },
+	{ "Capacitor overvoltage alarm", ATTR_MEAS_VCAP, ATTR_VCAP_OV_LVL, "Measured VCAP voltage", "VCAP Overvoltage Level" },
+	{ "Output Undervoltage alarm", ATTR_MEAS_VOUT, ATTR_VOUT_UV_LVL, "Measured VOUT voltage", "VOUT Undervoltage Level" },
+	{ "Output Overvoltage alarm", ATTR_MEAS_VOUT, ATTR_VOUT_OV_LVL, "Measured VOUT voltage", "VOUT Overvoltage Level" },
+	{ "Input overcurrent alarm", ATTR_MEAS_IIN, ATTR_IIN_OC_LVL, "Measured IIN current", "Input Overcurrent Level" },
+	{ "Charge Undercurrent alarm", ATTR_MEAS_ICHG, ATTR_ICHG_UC_LVL, "Measured ICHG current", "Charge Undercurrent Level" },
+	{ "Temperature Cold alarm", ATTR_MEAS_DTEMP, ATTR_DTEMP_COLD_LVL, "Measured die temperature", "Die temperature Cold level" },
+	{ "Temperature hot alarm", ATTR_MEAS_DTEMP, ATTR_DTEMP_HOT_LVL, "Measured die temperature", "Die Temperature Hot Level" },
+	{ "stack ESR high alarm", ATTR_MEAS_ESR, ATTR_ESR_HI_LVL, "Measured ESR value", "ESR High Level" },
+	{ "stack capacitance low alarm", ATTR_MEAS_CAP, ATTR_CAP_LO_LVL, "Measured capacitance value", "Capacitance Low Level" },
+};
+
+// indexed by mon_status bit number, NULL for the reserved bits
+const char *const monitor_table[NUM_STATUS_BITS] = {
+	"Capacitance/ESR measurement is in progress.",
+	"Waiting programmed time to begin a capacitance/ESR measurement.",
+	"Waiting for satisfactory conditions to begin a capacitance/ESR measurement.",
+	"Capacitance measurement has completed.",
+	"ESR Measurement has completed.",
+	"The last attempted capacitance measurement was unable to complete.",
+	"The last attempted ESR measurement was unable to complete.",
+	NULL,
+	"The device is no longer connected to power outlet.",
+	"The device is connected to power outlet.",
+};
+
+// indexed by chrg_status bit number, NULL for the reserved bits
+const char *const charger_table[NUM_STATUS_BITS] = {
+	"The synchronous controller is in step-down mode (charging)",
+	"The synchronous controller is in step-up mode (backup)",
+	"The charger is in constant voltage mode",
+	"The charger is in undervoltage lockout",
+	"The charger is in input current limit",
+	"The capacitor voltage is above power good threshold",
+	"The capacitor manager is shunting",
+	"The capacitor manager is balancing",
+	"The charger is temporarily disabled for capacitance measurement",
+	"The charger is in constant current mode",
+	NULL,
+	"Input voltage is below pfi threshold",
+};
+
+const char *const unit_names[NUM_UNITS] = {
+	[UNIT_NONE] = "",
+	[UNIT_MV] = "mV",
+	[UNIT_F] = "F",
+	[UNIT_C] = "C",
+	[UNIT_MR] = "mR",
+};
+
+/*
+ * Name lookup goes through a perfect hash: the seed is chosen, the first
+ * time a name is looked up, so that no two attributes share a slot.
+ * A lookup is then one hash and one strcmp.
+ */
+#define HASH_SLOTS 256
+
+static uint8_t hash_slots[HASH_SLOTS]; // attr_id + 1, 0 for an empty slot
+static uint32_t hash_seed;
+
+static uint32_t hash_name(const char *name, uint32_t seed)
+{
+	uint32_t h = 2166136261u ^ seed;
+
+	while (*name) {
+		h ^= (unsigned char) *name++;
+		h *= 16777619u;
+	}
+	return h ^ (h >> 15);
+}
+
+static void build_hash(void)
+{
+	for (uint32_t seed = 1; ; seed++) {
+		int i;
+
+		memset(hash_slots, 0, sizeof(hash_slots));
+		for (i = 0; i < NUM_ATTRS; i++) {
+			uint8_t *slot = &hash_slots[hash_name(attr_table[i].name, seed) % HASH_SLOTS];
+			if (*slot)
+				break;
+			*slot = i + 1;
+		}
+		if (i == NUM_ATTRS) {
+			hash_seed = seed;
+			return;
+		}
+	}
+}
+
+/**
+ * attr_lookup() - resolve an attribute name
+ * Return: the attribute id, ATTR_NONE if it is not a known attribute.
+*/
+enum attr_id attr_lookup(const char *name)
+{
+	uint8_t slot;
+
+	if (hash_seed == 0)
+		build_hash();
+	slot = hash_slots[hash_name(name, hash_seed) % HASH_SLOTS];
+	if (slot == 0 || strcmp(attr_table[slot - 1].name, name) != 0)
+		return ATTR_NONE;
+	return slot - 1;
+}
+
+enum attr_unit unit_lookup(const char *unit)
+{
+	for (int i = UNIT_MV; i < NUM_UNITS; i++)
+		if (strcmp(unit, unit_names[i]) == 0)
+			return i;
+	return UNIT_NONE;
+}
+
+/*
+ * convert a register value to the attribute's measurement unit
+ * attributes without a unit are returned unchanged
+*/
+int attr_from_LSB(enum attr_id id, long long value)
+{
+	if (id == ATTR_NONE)
+		return (int) value;
+
+	switch (attr_table[id].unit) {
+	case UNIT_MV:
+		return LSB_to_millivolts(value, attr_table[id].factor);
+	case UNIT_F:
+		return LSB_to_farads(value);
+	case UNIT_C:
+		return LSB_to_celsius(value);
+	case UNIT_MR:
+		return LSB_to_milliohms(value);
+	default:
+		return (int) value;
+	}
+}
+
+/*
+ * convert a value in the attribute's measurement unit to register units
+*/
+int attr_to_LSB(enum attr_id id, long long value)
+{
+	if (id == ATTR_NONE)
+		return (int) value;
+
+	switch (attr_table[id].unit) {
+	case UNIT_MV:
+		return millivolts_to_LSB(value, attr_table[id].factor);
+	case UNIT_F:
+		return farads_to_LSB(value);
+	case UNIT_C:
+		return celsius_to_LSB(value);
+	case UNIT_MR:
+		return milliohms_to_LSB(value);
+	default:
+		return (int) value;
+	}
+}
+
+/*
+ * convert a register value to the SI unit of the attribute: volts,
+ * farads, ohms or degrees celsius, without the rounding of attr_from_LSB()
+ * attributes without a unit are returned unchanged
+*/
+double attr_to_si(enum attr_id id, int value)
+{
+	if (id == ATTR_NONE)
+		return value;
+
+	switch (attr_table[id].unit) {
+	case UNIT_MV:
+		return value * (attr_table[id].factor / 1e7);
+	case UNIT_F:
+		return (double) value * 336 * RT / RTST / 1e6;
+	case UNIT_C:
+		return 0.028 * value - 251.4;
+	case UNIT_MR:
+		return (double) value * RSNSC / 64 / 1000;
+	default:
+		return value;
+	}
+}
@@ -0,0 +1,116 @@
+#ifndef ATTR_H
+#define ATTR_H
+
+/*
+ * Registry of the sysfs attributes exposed by the ltc3350 driver.
+ * Every attribute is resolved to an attr_id once, from then on its unit,
+ * scale and linked alarm levels are a table access away.
+ */
+
+enum attr_kind {
+	ATTR_STATUS,
+	ATTR_CONTROL,
+	ATTR_LEVEL,
+	ATTR_MEAS,
+};
+
+enum attr_unit {
+	UNIT_NONE,
+	UNIT_MV,
+	UNIT_F,
+	UNIT_C,
+	UNIT_MR,
+	NUM_UNITS
+};
+
+enum attr_id {
+	ATTR_NONE = -1,
+	// status registers
+	ATTR_ALARM_REG,
+	ATTR_MON_STATUS,
+	ATTR_CHRG_STATUS,
+	// control registers
+	ATTR_CLR_ALARMS,
+	ATTR_MSK_ALARMS,
+	ATTR_MSK_MON_STATUS,
+	ATTR_CTL_REG,
+	ATTR_NUM_CAPS,
+	ATTR_CAP_ESR_PER,
+	ATTR_VCAPFB_DAC,
+	ATTR_VSHUNT,
+	// alarm levels
+	ATTR_CAP_UV_LVL,
+	ATTR_CAP_OV_LVL,
+	ATTR_GPI_UV_LVL,
+	ATTR_GPI_OV_LVL,
+	ATTR_VIN_UV_LVL,
+	ATTR_VIN_OV_LVL,
+	ATTR_VCAP_UV_LVL,
+	ATTR_VCAP_OV_LVL,
+	ATTR_VOUT_UV_LVL,
+	ATTR_VOUT_OV_LVL,
+	ATTR_IIN_OC_LVL,
+	ATTR_ICHG_UC_LVL,
+	ATTR_DTEMP_COLD_LVL,
+	ATTR_DTEMP_HOT_LVL,
+	ATTR_ESR_HI_LVL,
+	ATTR_CAP_LO_LVL,
+	// measurements
+	ATTR_MEAS_CAP,
+	ATTR_MEAS_ESR,
+	ATTR_MEAS_VCAP1,
+	ATTR_MEAS_VCAP2,
+	ATTR_MEAS_VCAP3,
+	ATTR_MEAS_VCAP4,
+	ATTR_MEAS_GPI,
+	ATTR_MEAS_VIN,
+	ATTR_MEAS_VCAP,
+	ATTR_MEAS_VOUT,
+	ATTR_MEAS_IIN,
+	ATTR_MEAS_ICHG,
+	ATTR_MEAS_DTEMP,
+	NUM_ATTRS
+};
+
+struct attr_desc {
+	const char *name;
+	enum attr_kind kind;
+	enum attr_unit unit;
+	int factor; // LSB weight of UNIT_MV attributes, in tenths of microvolts
+	enum attr_id min_lvl; // alarm levels of a measurement, ATTR_NONE if there is none
+	enum attr_id max_lvl;
+};
+
+/*
+ * What an alarm_reg bit refers to: the measurement that raised it
+ * and the level it crossed.
+ */
+struct alarm_desc {
+	const char *description;
+	enum attr_id meas;
+	enum attr_id lvl;
+	const char *meas_desc;
+	const char *lvl_desc;
+};
+
+#define NUM_ALARMS 16
+#define NUM_STATUS_BITS 16
+
+extern const struct attr_desc attr_table[NUM_ATTRS];
+extern const struct alarm_desc alarm_table[NUM_ALARMS];
+extern const char *const monitor_table[NUM_STATUS_BITS];
+extern const char *const charger_table[NUM_STATUS_BITS];
+extern const char *const unit_names[NUM_UNITS];
+
+enum attr_id attr_lookup(const char *name);
+enum attr_unit unit_lookup(const char *unit);
+int attr_from_LSB(enum attr_id id, long long value);
+int attr_to_LSB(enum attr_id id, long long value);
+double attr_to_si(enum attr_id id, int value);
+
+static inline const char *attr_unit_name(enum attr_id id)
+{
+	return id == ATTR_NONE ? unit_names[UNIT_NONE] : unit_names[attr_table[id].unit];
+}
+
+#endif
@@ -0,0 +1,580 @@
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "action.h"
+#include "health.h"
+
+// the status registers watched on every device
+static const enum attr_id watched[] = { ATTR_ALARM_REG, ATTR_MON_STATUS, ATTR_CHRG_STATUS };
+
+#define NUM_WATCHED (sizeof(watched) / sizeof(watched[0]))
+#define MAX_EVENTS 16
+#define NSEC_PER_SEC 1000000000L
+
+/*
+ * epoll data of the descriptors that are not attributes,
+ * the attributes use their index in the fds array
+ */
+#define EVENT_SIGNAL UINT32_MAX
+#define EVENT_TIMER (UINT32_MAX - 1)
+#define EVENT_CAPTURE (UINT32_MAX - 2)
+#define EVENT_DEBOUNCE (UINT32_MAX - 3)
+
+struct await_loop {
+	int epfd;
+	int sigfd;
+	int timerfd;
+	int capfd; // capture sampling timer
+	int dbfd; // next debounced report
+	int fds[NUM_WATCHED * MAX_DEVICES];
+	int nfds;
+	sigset_t oldmask;
+};
+
+static void close_loop(struct await_loop *loop)
+{
+	for (int i = 0; i < loop->nfds; i++)
+		if (loop->fds[i] >= 0)
+			close(loop->fds[i]);
+	if (loop->timerfd >= 0)
+		close(loop->timerfd);
+	if (loop->capfd >= 0)
+		close(loop->capfd);
+	if (loop->dbfd >= 0)
+		close(loop->dbfd);
+	if (loop->sigfd >= 0)
+		close(loop->sigfd);
+	if (loop->epfd >= 0)
+		close(loop->epfd);
+	sigprocmask(SIG_SETMASK, &loop->oldmask, NULL);
+}
+
+static int watch(struct await_loop *loop, int fd, uint32_t events, uint32_t data)
+{
+	struct epoll_event ev = { .events = events, .data.u32 = data };
+
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		return throw("await: epoll_ctl", errno);
+	return 0;
+}
+
+// a periodic timer, hz times per second
+static int set_rate(int fd, long hz)
+{
+	long ns = NSEC_PER_SEC / hz;
+	struct itimerspec its = {
+		.it_interval = { ns / NSEC_PER_SEC, ns % NSEC_PER_SEC },
+		.it_value = { ns / NSEC_PER_SEC, ns % NSEC_PER_SEC },
+	};
+
+	if (timerfd_settime(fd, 0, &its, NULL) < 0)
+		return throw("await: timerfd_settime", errno);
+	return 0;
+}
+
+static long long monotonic_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// a one-shot timer at CLOCK_MONOTONIC milliseconds, disarmed if ms is -1
+static int set_deadline(int fd, long long ms)
+{
+	struct itimerspec its = { 0 };
+
+	if (ms >= 0) {
+		its.it_value.tv_sec = ms / 1000;
+		its.it_value.tv_nsec = ms % 1000 * 1000000;
+	}
+	if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		return throw("await: timerfd_settime", errno);
+	return 0;
+}
+
+/**
+ * open_loop() - set up the event loop of await
+ * @interval: telemetry period in milliseconds, 0 for none
+ * @cap: capture configuration, NULL for no capture
+ * @debounce: whether the reports are debounced
+ *
+ * SIGINT, SIGTERM and SIGUSR1 are blocked and read from a signalfd, so
+ * that shutdown and report requests are just other events of the loop.
+ * Return: 0 on success, otherwise error code
+*/
+static int open_loop(struct await_loop *loop, struct ltc_device **devs, int ndev, long interval,
+		const struct capture_config *cap, int debounce)
+{
+	sigset_t mask;
+	int err;
+
+	loop->epfd = loop->sigfd = loop->timerfd = loop->capfd = loop->dbfd = -1;
+	loop->nfds = 0;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &mask, &loop->oldmask);
+
+	if ((loop->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		return throw("await: epoll_create1", errno);
+	if ((loop->sigfd = signalfd(-1, &mask, SFD_CLOEXEC)) < 0)
+		return throw("await: signalfd", errno);
+	if ((err = watch(loop, loop->sigfd, EPOLLIN, EVENT_SIGNAL)))
+		return err;
+
+	if (interval > 0) {
+		struct itimerspec its = {
+			.it_interval = { interval / 1000, (interval % 1000) * 1000000 },
+			.it_value = { interval / 1000, (interval % 1000) * 1000000 },
+		};
+
+		if ((loop->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) < 0)
+			return throw("await: timerfd_create", errno);
+		if (timerfd_settime(loop->timerfd, 0, &its, NULL) < 0)
+			return throw("await: timerfd_settime", errno);
+		if ((err = watch(loop, loop->timerfd, EPOLLIN, EVENT_TIMER)))
+			return err;
+	}
+
+	if (cap != NULL) {
+		if ((loop->capfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) < 0)
+			return throw("await: timerfd_create", errno);
+		if ((err = set_rate(loop->capfd, cap->history_hz)))
+			return err;
+		if ((err = watch(loop, loop->capfd, EPOLLIN, EVENT_CAPTURE)))
+			return err;
+	}
+
+	if (debounce) {
+		if ((loop->dbfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) < 0)
+			return throw("await: timerfd_create", errno);
+		if ((err = watch(loop, loop->dbfd, EPOLLIN, EVENT_DEBOUNCE)))
+			return err;
+	}
+
+	for (int d = 0; d < ndev; d++) {
+		for (size_t w = 0; w < NUM_WATCHED; w++) {
+			int i = loop->nfds++;
+
+			// EPOLLPRI is how sysfs_notify() shows up
+			if ((loop->fds[i] = open_notify(devs[d], watched[w])) < 0) {
+				err = errno;
+				if (err != EOPNOTSUPP)
+					return err;
+				// off sysfs there are no notifications, but there still is telemetry
+				if (interval > 0)
+					continue;
+				fprintf(stderr, "await: %s of %s is not on sysfs, it cannot be watched\n",
+						attr_table[watched[w]].name, devs[d]->name);
+				return err;
+			}
+			if ((err = watch(loop, loop->fds[i], EPOLLPRI | EPOLLERR, i)))
+				return err;
+		}
+	}
+	return 0;
+}
+
+/*
+ * The values of the registers that notified were read from their
+ * descriptors, the others have not changed: no status register is read
+ * again to compute the difference.
+ */
+static void report_changes(const struct ltc_device *dev, int ndev, struct status_regs *last,
+		const int *values, unsigned int notified)
+{
+	struct snapshot snap;
+
+	snapshot_init(&snap, dev, 1);
+	snapshot_set(&snap, ATTR_ALARM_REG, notified & BIT(0) ? values[0] : last->alarms);
+	snapshot_set(&snap, ATTR_MON_STATUS, notified & BIT(1) ? values[1] : last->monitor);
+	snapshot_set(&snap, ATTR_CHRG_STATUS, notified & BIT(2) ? values[2] : last->chrg);
+	device_header(stdout, dev, ndev);
+	status_diff(stdout, last, &snap);
+}
+
+// the registers as debounced, with what was coalesced into them
+static void report_debounced(const struct ltc_device *dev, int ndev, struct status_regs *last,
+		struct debounce *db, const struct status_regs *regs)
+{
+	struct snapshot snap;
+
+	snapshot_init(&snap, dev, 1);
+	snapshot_set(&snap, ATTR_ALARM_REG, regs->alarms);
+	snapshot_set(&snap, ATTR_MON_STATUS, regs->monitor);
+	snapshot_set(&snap, ATTR_CHRG_STATUS, regs->chrg);
+	device_header(stdout, dev, ndev);
+	debounce_report(stdout, db);
+	status_diff(stdout, last, &snap);
+}
+
+/*
+ * With @regs, the debounced registers, the report shows them rather than
+ * the registers as read: a bit still within its delay is reported when it
+ * settles. @last is left alone when NULL.
+ */
+static void report_full(const struct ltc_device *dev, int ndev, struct status_regs *last,
+		const struct status_regs *regs)
+{
+	struct snapshot snap;
+
+	snapshot_init(&snap, dev, 1);
+	if (regs != NULL) {
+		snapshot_set(&snap, ATTR_ALARM_REG, regs->alarms);
+		snapshot_set(&snap, ATTR_MON_STATUS, regs->monitor);
+		snapshot_set(&snap, ATTR_CHRG_STATUS, regs->chrg);
+	}
+	device_header(stdout, dev, ndev);
+	status_report(stdout, &snap);
+	if (last == NULL)
+		return;
+	// the next differences are relative to this report
+	last->alarms = snapshot_get(&snap, ATTR_ALARM_REG);
+	last->monitor = snapshot_get(&snap, ATTR_MON_STATUS);
+	last->chrg = snapshot_get(&snap, ATTR_CHRG_STATUS);
+}
+
+static void set_reg(struct status_regs *regs, int w, int value)
+{
+	if (watched[w] == ATTR_ALARM_REG)
+		regs->alarms = value;
+	else if (watched[w] == ATTR_MON_STATUS)
+		regs->monitor = value;
+	else
+		regs->chrg = value;
+}
+
+static void report_telemetry(struct ltc_device **devs, int ndev, long interval)
+{
+	struct snapshot snap;
+	struct sample_row row;
+	char buf[SAMPLE_ROW_MAX];
+	int len;
+
+	for (int d = 0; d < ndev; d++) {
+		snapshot_init(&snap, devs[d], 1);
+		clock_gettime(CLOCK_REALTIME, &snap.time);
+		sample_snapshot_row(&snap, &row);
+		len = sample_format_row(buf, sizeof(buf), &row, interval < 1000 ? 1000 / interval : 1);
+		if (ndev > 1)
+			printf("%s,", devs[d]->name);
+		fwrite(buf, 1, len, stdout);
+	}
+	fflush(stdout);
+}
+
+/**
+ * await_alerts() - report the alerts of the devices as they come
+ *
+ * The alarm, monitor and charger status registers of every device, the
+ * telemetry timer and the signals are all events of one epoll loop: a
+ * device is reported once per wakeup, however many of its registers were
+ * notified, and the loop ends cleanly on SIGINT/SIGTERM.
+ * Only the status bits that changed since the last report are printed,
+ * unless --full is given; SIGUSR1 prints a full report at any time.
+ * With --interval the measurements are also printed periodically, as
+ * csv rows in the sample format. The attribute access times are printed
+ * on standard error when it ends.
+ * With --capture, the last --pretrigger seconds of measurements are kept
+ * in memory at --history-hz; when the input power fails, a burst at
+ * --capture-hz writes them to a capture file together with the next
+ * --post seconds (see capture_trigger()).
+ * With --health, every capacitance and ESR measurement completed is added
+ * to the health model of the device, saved in the file given.
+ * --debounce, --coalesce and --rate tame inputs that flap: status bits are
+ * only reported once they held their value for their debounce delays,
+ * the notifications within --coalesce milliseconds of the first one make
+ * one report, with their counts, and there are at most --rate reports per
+ * minute (see debounce_poll()). Captures and health updates still see
+ * every notification as it comes.
+ * --action binds a command, a FIFO write or a sysfs write to the raising
+ * of a status bit (see action_parse()), as reported. The actions are
+ * queued as soon as the registers are read, before anything is printed,
+ * and run by --workers threads, each for at most --action-timeout
+ * milliseconds unless it gives its own timeout: a slow action never
+ * holds up the next notification. Their latencies are printed on
+ * standard error when await ends.
+ * Return: 0 on success, otherwise error code
+*/
+int await_alerts(int argc, char *argv[], struct ltc_device **devs, int ndev)
+{
+	static const struct option options[] = {
+		{ "interval", required_argument, NULL, 'i' },
+		{ "full", no_argument, NULL, 'F' },
+		{ "capture", required_argument, NULL, 'c' },
+		{ "pretrigger", required_argument, NULL, 'p' },
+		{ "post", required_argument, NULL, 'P' },
+		{ "capture-hz", required_argument, NULL, 'b' },
+		{ "history-hz", required_argument, NULL, 'H' },
+		{ "health", required_argument, NULL, 'h' },
+		{ "debounce", required_argument, NULL, 'd' },
+		{ "coalesce", required_argument, NULL, 'w' },
+		{ "rate", required_argument, NULL, 'r' },
+		{ "action", required_argument, NULL, 'a' },
+		{ "action-timeout", required_argument, NULL, 'T' },
+		{ "workers", required_argument, NULL, 'W' },
+		{ "queue", required_argument, NULL, 'Q' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct await_loop loop;
+	struct epoll_event events[MAX_EVENTS];
+	struct status_regs last[MAX_DEVICES];
+	struct status_regs seen[MAX_DEVICES]; // the registers as last read, not debounced
+	struct debounce_config dbcfg = { .window = 0 };
+	struct debounce debouncers[MAX_DEVICES];
+	struct capture captures[MAX_DEVICES];
+	struct capture_config cap = { .pretrigger = 2, .post = 5, .burst_hz = 100 };
+	struct health_model models[MAX_DEVICES];
+	static struct action_pool actions;
+	char health_paths[MAX_DEVICES][PATH_MAX];
+	const char *health = NULL;
+	struct snapshot snap;
+	long interval = 0;
+	int opt, err, full = 0, running = 1, ncap = 0, bursting = 0, debouncing;
+
+	optind = 1;
+	while ((opt = getopt_long(argc, argv, "i:Fc:p:P:b:H:h:d:w:r:a:T:W:Q:", options, NULL)) != -1) {
+		switch (opt) {
+		case 'i':
+			interval = strtol(optarg, NULL, 10);
+			break;
+		case 'F':
+			full = 1;
+			break;
+		case 'c':
+			cap.dir = optarg;
+			break;
+		case 'p':
+			cap.pretrigger = strtol(optarg, NULL, 10);
+			break;
+		case 'P':
+			cap.post = strtol(optarg, NULL, 10);
+			break;
+		case 'b':
+			cap.burst_hz = strtol(optarg, NULL, 10);
+			break;
+		case 'H':
+			cap.history_hz = strtol(optarg, NULL, 10);
+			break;
+		case 'h':
+			health = optarg;
+			break;
+		case 'd':
+			if (debounce_parse(&dbcfg, optarg))
+				return EINVAL;
+			break;
+		case 'w':
+			dbcfg.window = strtol(optarg, NULL, 10);
+			break;
+		case 'r':
+			dbcfg.rate = strtol(optarg, NULL, 10);
+			break;
+		case 'a':
+			if (action_parse(&actions, optarg))
+				return EINVAL;
+			break;
+		case 'T':
+			actions.timeout = strtol(optarg, NULL, 10);
+			break;
+		case 'W':
+			actions.nworkers = strtol(optarg, NULL, 10);
+			break;
+		case 'Q':
+			actions.size = strtol(optarg, NULL, 10);
+			break;
+		default:
+			return EINVAL;
+		}
+	}
+	if (interval < 0 || dbcfg.window < 0 || dbcfg.rate < 0) {
+		fprintf(stderr, "await: the interval, coalescing window and rate must be positive\n");
+		return EINVAL;
+	}
+	debouncing = debounce_enabled(&dbcfg);
+	// the pre-trigger window is at full resolution unless told otherwise
+	if (cap.history_hz == 0)
+		cap.history_hz = cap.burst_hz;
+	if (cap.dir != NULL && (cap.pretrigger < 0 || cap.post <= 0 || cap.burst_hz <= 0 || cap.history_hz <= 0
+			|| cap.burst_hz > NSEC_PER_SEC || cap.history_hz > NSEC_PER_SEC)) {
+		fprintf(stderr, "await: the capture times and rates must be positive\n");
+		return EINVAL;
+	}
+
+	for (int d = 0; health != NULL && d < ndev; d++) {
+		device_filename(health_paths[d], sizeof(health_paths[d]), health, devs[d], ndev);
+		if ((err = health_load(&models[d], health_paths[d])))
+			return err;
+	}
+
+	printf("You will be notified in the event of an alarm, or a change in monitor or charger status.\n");
+	if ((err = open_loop(&loop, devs, ndev, interval, cap.dir != NULL ? &cap : NULL, debouncing))) {
+		close_loop(&loop);
+		return err;
+	}
+	// after open_loop(): the workers inherit its signal mask
+	if (actions.nactions && (err = action_start(&actions))) {
+		close_loop(&loop);
+		return err;
+	}
+	for (; cap.dir != NULL && ncap < ndev; ncap++) {
+		if ((err = capture_open(&captures[ncap], devs[ncap], &cap))) {
+			for (int d = 0; d <= ncap; d++)
+				capture_close(&captures[d]);
+			action_stop(&actions);
+			close_loop(&loop);
+			return err;
+		}
+	}
+	// the state the first differences are computed against
+	for (int d = 0; d < ndev; d++) {
+		snapshot_init(&snap, devs[d], 1);
+		last[d].alarms = snapshot_get(&snap, ATTR_ALARM_REG);
+		last[d].monitor = snapshot_get(&snap, ATTR_MON_STATUS);
+		last[d].chrg = snapshot_get(&snap, ATTR_CHRG_STATUS);
+		seen[d] = last[d];
+		debounce_init(&debouncers[d], &dbcfg, &last[d], monotonic_ms());
+	}
+	printf("Polling for alerts...\n");
+	fflush(stdout);
+
+	while (running) {
+		unsigned int notified[MAX_DEVICES] = { 0 };
+		int values[MAX_DEVICES][NUM_WATCHED];
+		struct status_regs before[MAX_DEVICES];
+		int n = epoll_wait(loop.epfd, events, MAX_EVENTS, -1);
+		long long now = monotonic_ms(), deadline = -1;
+		uint64_t woke = stats_start();
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			err = throw("await: epoll_wait", errno);
+			break;
+		}
+		memcpy(before, seen, sizeof(before));
+		for (int e = 0; e < n; e++) {
+			uint32_t data = events[e].data.u32;
+			struct signalfd_siginfo si;
+			char buf[16];
+			ssize_t len;
+
+			if (data == EVENT_SIGNAL) {
+				if (read(loop.sigfd, &si, sizeof(si)) == sizeof(si) && si.ssi_signo == SIGUSR1) {
+					for (int d = 0; d < ndev; d++) {
+						struct status_regs regs;
+
+						// debounced, the report is of the state last reported
+						if (debouncing) {
+							debounce_stable(&debouncers[d], &regs);
+							report_full(devs[d], ndev, NULL, &regs);
+						} else
+							report_full(devs[d], ndev, &last[d], NULL);
+					}
+				} else
+					running = 0;
+			} else if (data == EVENT_TIMER) {
+				read(loop.timerfd, buf, sizeof(uint64_t));
+				report_telemetry(devs, ndev, interval);
+			} else if (data == EVENT_CAPTURE) {
+				read(loop.capfd, buf, sizeof(uint64_t));
+				for (int d = 0; d < ncap; d++)
+					capture_sample(&captures[d], &cap);
+			} else if (data == EVENT_DEBOUNCE) {
+				read(loop.dbfd, buf, sizeof(uint64_t));
+			} else {
+				int d = data / NUM_WATCHED, w = data % NUM_WATCHED;
+
+				uint64_t start = stats_start();
+
+				// this is so sysfs returns new data
+				len = pread(loop.fds[data], buf, sizeof(buf) - 1, 0);
+				stats_record(watched[w], STATS_READ, start, len <= 0);
+				if (len <= 0) {
+					err = throw("await: Error in reading status register", errno);
+					running = 0;
+					break;
+				}
+				buf[len] = '\0';
+				values[d][w] = strtol(buf, NULL, 10);
+				notified[d] |= BIT(w);
+				set_reg(&seen[d], w, values[d][w]);
+				if (debouncing)
+					debounce_notify(&debouncers[d], &dbcfg, w, values[d][w], now);
+			}
+		}
+		for (int d = 0; d < ndev && running && debouncing; d++) {
+			struct status_regs regs, stable;
+
+			// the actions fire on the bits that settled since the previous report
+			debounce_stable(&debouncers[d], &stable);
+			if (debounce_poll(&debouncers[d], &dbcfg, now, &regs)) {
+				action_dispatch(&actions, devs[d], &stable, &regs, woke);
+				printf("New data ltc-monitor\n");
+				if (full) {
+					report_full(devs[d], ndev, &last[d], &regs);
+					debounce_report(stdout, &debouncers[d]);
+				} else
+					report_debounced(devs[d], ndev, &last[d], &debouncers[d], &regs);
+			}
+			if (debouncers[d].deadline >= 0 && (deadline < 0 || debouncers[d].deadline < deadline))
+				deadline = debouncers[d].deadline;
+		}
+		if (debouncing && running && (err = set_deadline(loop.dbfd, deadline)))
+			break;
+		for (int d = 0; d < ndev && running && !debouncing; d++)
+			if (notified[d])
+				action_dispatch(&actions, devs[d], &before[d], &seen[d], woke);
+		for (int d = 0; d < ndev && running && !debouncing; d++) {
+			if (!notified[d])
+				continue;
+			printf("New data ltc-monitor\n");
+			if (full)
+				report_full(devs[d], ndev, &last[d], NULL);
+			else
+				report_changes(devs[d], ndev, &last[d], values[d], notified[d]);
+		}
+		for (int d = 0; health != NULL && d < ndev && running; d++)
+			health_update(&models[d], health_paths[d], devs[d], &before[d], &seen[d]);
+		if (ncap && running) {
+			int burst = 0;
+
+			for (int d = 0; d < ncap; d++) {
+				const char *reason = capture_trigger_reason(&before[d], &seen[d]);
+
+				if (reason != NULL)
+					capture_trigger(&captures[d], &cap, reason);
+				burst |= captures[d].out != NULL;
+			}
+			// sample at the burst rate as long as one device is in a burst
+			if (burst != bursting) {
+				if ((err = set_rate(loop.capfd, burst ? cap.burst_hz : cap.history_hz)))
+					break;
+				bursting = burst;
+			}
+		}
+		fflush(stdout);
+	}
+
+	for (int d = 0; d < ncap; d++)
+		capture_close(&captures[d]);
+	action_stop(&actions);
+	close_loop(&loop);
+	printf("Polling finished\n");
+	fflush(stdout);
+	stats_print(stderr);
+	if (actions.nactions)
+		action_report(stderr, &actions);
+	return err;
+}
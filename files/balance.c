@@ -0,0 +1,156 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ltc-monitor.h"
+
+// below this a cell is not populated: the two-cell stacks read about 0 mV on vcap3 and vcap4
+#define BALANCE_EMPTY_MV 200.0f
+
+static const enum attr_id cells[BALANCE_CELLS] = {
+	ATTR_MEAS_VCAP1, ATTR_MEAS_VCAP2, ATTR_MEAS_VCAP3, ATTR_MEAS_VCAP4,
+};
+
+static float sum(v4sf v)
+{
+	return v[0] + v[1] + v[2] + v[3];
+}
+
+/**
+ * balance_init() - start the cell balance analytics of a device
+ * @cfg: limits, the time constant of the trends
+*/
+void balance_init(struct balance *b, const struct ltc_device *dev, const struct balance_config *cfg)
+{
+	memset(b, 0, sizeof(*b));
+	b->dev = dev;
+	b->cfg = *cfg;
+	for (int c = 0; c < BALANCE_CELLS; c++) {
+		b->scale[c] = attr_table[cells[c]].factor / 10000.0f;
+		b->col[c] = sample_column(cells[c]);
+	}
+}
+
+static void warn(const struct balance *b, const char *what, int raised)
+{
+	fprintf(stderr, "%s: %s %s\n", b->dev->name, what, raised ? "raised" : "cleared");
+}
+
+/*
+ * Warnings are raised above their limit and cleared below 80% of it, so
+ * that a value hovering around the limit does not flood the output.
+ */
+static int crossed(int active, float value, float limit)
+{
+	return active ? value > 0.8f * limit : value > limit;
+}
+
+/**
+ * balance_update() - analyze one sample of the cell voltages
+ *
+ * The four cells go through as one vector: their deviation from the mean
+ * of the populated cells, the spread between the highest and the lowest
+ * one, and the exponentially weighted trend of each deviation, in mV per
+ * minute. Cells that read below BALANCE_EMPTY_MV are left out, so two-cell
+ * stacks are analyzed on their two cells, and so are the cells that could
+ * not be read; when the cells analyzed change, the trends take the next
+ * sample as their new starting point.
+ * Return: 1 if a warning was raised or cleared.
+*/
+int balance_update(struct balance *b, const struct sample_row *row)
+{
+	v4sf v, mask, dev, slope;
+	float mean, hi = -1e9f, lo = 1e9f, dt, alpha;
+	unsigned int drift = 0, valid = 0, analyzed;
+	int n, spread, changed = 0;
+	char what[64];
+
+	for (int c = 0; c < BALANCE_CELLS; c++) {
+		if (row->valid & (1U << b->col[c]))
+			valid |= 1U << c;
+		v[c] = valid & (1U << c) ? row->raw[b->col[c]] : 0;
+	}
+	v *= b->scale;
+	for (int c = 0; c < BALANCE_CELLS; c++)
+		if (v[c] > BALANCE_EMPTY_MV)
+			b->populated |= 1U << c;
+	// a cell that could not be read is left out of this sample, not taken as 0 mV
+	analyzed = b->populated & valid;
+	for (int c = 0; c < BALANCE_CELLS; c++)
+		mask[c] = (analyzed >> c) & 1;
+	n = sum(mask);
+	if (analyzed != b->analyzed) {
+		// the mean moved with the cells: the deviations start over, and the trends of the cells that joined
+		for (int c = 0; c < BALANCE_CELLS; c++)
+			if ((analyzed & ~b->analyzed) & (1U << c))
+				b->trend[c] = 0;
+		b->analyzed = analyzed;
+		b->samples = 0;
+	}
+	if (n < 2)
+		return 0;
+
+	mean = sum(v * mask) / n;
+	dev = (v - mean) * mask;
+	for (int c = 0; c < BALANCE_CELLS; c++) {
+		if (!mask[c])
+			continue;
+		hi = v[c] > hi ? v[c] : hi;
+		lo = v[c] < lo ? v[c] : lo;
+	}
+	b->spread = hi - lo;
+	if (b->spread > b->max_spread)
+		b->max_spread = b->spread;
+	b->dev_mv = dev;
+
+	dt = (row->time.tv_sec - b->time.tv_sec) + (row->time.tv_nsec - b->time.tv_nsec) / 1e9f;
+	if (b->samples > 0 && dt > 0) {
+		// mV per minute, weighted over the time constant whatever the sampling rate
+		slope = (dev - b->last_dev) * (60.0f / dt);
+		alpha = 1.0f - expf(-dt / b->cfg.tau);
+		b->trend += (slope - b->trend) * alpha;
+		b->elapsed += dt;
+	}
+	b->last_dev = dev;
+	b->time = row->time;
+	b->samples++;
+	// the trends need a time constant to settle
+	if (b->elapsed < b->cfg.tau)
+		return 0;
+
+	spread = crossed(b->imbalance, b->spread, b->cfg.spread_mv);
+	if (spread != b->imbalance) {
+		snprintf(what, sizeof(what), "cell imbalance (spread %.0f mV)", b->spread);
+		warn(b, what, spread);
+		b->imbalance = spread;
+		changed = 1;
+	}
+	for (int c = 0; c < BALANCE_CELLS; c++)
+		if (mask[c] && crossed(b->drifting & (1U << c), fabsf(b->trend[c]), b->cfg.drift_mv_min))
+			drift |= 1U << c;
+	for (int c = 0; c < BALANCE_CELLS; c++) {
+		if (!((drift ^ b->drifting) & (1U << c)))
+			continue;
+		snprintf(what, sizeof(what), "%s drift (%+.1f mV/min from the mean)",
+				attr_table[cells[c]].name + strlen("meas_"), b->trend[c]);
+		warn(b, what, drift & (1U << c));
+		changed = 1;
+	}
+	b->drifting = drift;
+	return changed;
+}
+
+// what was seen, when sampling ends
+void balance_summary(FILE *out, const struct balance *b)
+{
+	fprintf(out, "%s: %u populated cells, spread %.0f mV, max spread %.0f mV, deviations", b->dev->name,
+			__builtin_popcount(b->populated), b->spread, b->max_spread);
+	for (int c = 0; c < BALANCE_CELLS; c++)
+		if (b->populated & (1U << c))
+			fprintf(out, " %+.1f", b->dev_mv[c]);
+	fprintf(out, " mV, trends");
+	for (int c = 0; c < BALANCE_CELLS; c++)
+		if (b->populated & (1U << c))
+			fprintf(out, " %+.2f", b->trend[c]);
+	fprintf(out, " mV/min\n");
+}
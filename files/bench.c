@@ -0,0 +1,396 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ltc-monitor.h"
+
+#define BENCH_ITERATIONS 1000
+#define BENCH_CONVERSIONS 10000000L
+#define BENCH_BATCH 4096
+
+/*
+ * Values written in the fake tree, in register units: a charged stack of
+ * four capacitors on mains power. The attributes not listed are 0.
+ */
+static const struct {
+	enum attr_id id;
+	int value;
+} fake_values[] = {
+	{ ATTR_MON_STATUS, MON_POWER_RETURNED },
+	{ ATTR_CHRG_STATUS, CHRG_CAPPG },
+	{ ATTR_NUM_CAPS, 3 },
+	{ ATTR_VCAPFB_DAC, 15 },
+	{ ATTR_VSHUNT, 14750 },
+	{ ATTR_CAP_UV_LVL, 8000 },
+	{ ATTR_CAP_OV_LVL, 14750 },
+	{ ATTR_VIN_UV_LVL, 1800 },
+	{ ATTR_VIN_OV_LVL, 2600 },
+	{ ATTR_VCAP_UV_LVL, 2700 },
+	{ ATTR_VCAP_OV_LVL, 3800 },
+	{ ATTR_VOUT_UV_LVL, 1800 },
+	{ ATTR_VOUT_OV_LVL, 2600 },
+	{ ATTR_DTEMP_COLD_LVL, 8800 },
+	{ ATTR_DTEMP_HOT_LVL, 12200 },
+	{ ATTR_ESR_HI_LVL, 200 },
+	{ ATTR_CAP_LO_LVL, 1000 },
+	{ ATTR_MEAS_CAP, 2000 },
+	{ ATTR_MEAS_ESR, 50 },
+	{ ATTR_MEAS_VCAP1, 12403 },
+	{ ATTR_MEAS_VCAP2, 12376 },
+	{ ATTR_MEAS_VCAP3, 12390 },
+	{ ATTR_MEAS_VCAP4, 12388 },
+	{ ATTR_MEAS_VIN, 2241 },
+	{ ATTR_MEAS_VCAP, 3077 },
+	{ ATTR_MEAS_VOUT, 2220 },
+	{ ATTR_MEAS_IIN, 100 },
+	{ ATTR_MEAS_ICHG, 50 },
+	{ ATTR_MEAS_DTEMP, 10800 },
+};
+
+// one benchmarked operation, run on the fake device
+struct bench_op {
+	const char *name;
+	void (*run)(struct ltc_device *dev);
+};
+
+static FILE *null_out;
+static int column_fds[SAMPLE_COLUMNS];
+
+static void op_read_integer_value(struct ltc_device *dev)
+{
+	read_integer_value(dev, "meas_vcap");
+}
+
+static void op_snapshot_read(struct ltc_device *dev)
+{
+	struct snapshot snap;
+
+	snapshot_init(&snap, dev, 0);
+	snapshot_read(&snap);
+}
+
+static void op_show(struct ltc_device *dev)
+{
+	struct snapshot snap;
+
+	snapshot_init(&snap, dev, 1);
+	show(null_out, &snap);
+	fflush(null_out);
+}
+
+static void op_status_report(struct ltc_device *dev)
+{
+	struct snapshot snap;
+
+	snapshot_init(&snap, dev, 1);
+	status_report(null_out, &snap);
+	fflush(null_out);
+}
+
+/*
+ * The sample strategy: descriptors opened once, one pread() per column,
+ * here on as many measurements as there are sample columns.
+ */
+static void op_pread_columns(struct ltc_device *dev)
+{
+	char buf[16];
+
+	// the descriptors were opened on it before the timing
+	(void) dev;
+	for (int i = 0; i < SAMPLE_COLUMNS; i++)
+		pread(column_fds[i], buf, sizeof(buf), 0);
+}
+
+static const struct bench_op bench_ops[] = {
+	{ "read_integer_value", op_read_integer_value },
+	{ "snapshot_read", op_snapshot_read },
+	{ "show", op_show },
+	{ "status_report", op_status_report },
+	{ "pread columns", op_pread_columns },
+};
+
+static int write_attr(const char *dir, const char *name, const char *value)
+{
+	char path[PATH_MAX];
+	FILE *file;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	if ((file = fopen(path, "w")) == NULL)
+		return errno;
+	fprintf(file, "%s\n", value);
+	fclose(file);
+	return 0;
+}
+
+/**
+ * fake_device_create() - write a fake ltc3350 in a hwmon class directory
+ * @n: the device is root/hwmon<n>
+ *
+ * The device has every attribute of the registry, as the driver exposes them.
+ * Return: 0 on success, otherwise error code
+*/
+int fake_device_create(const char *root, int n, struct ltc_device *dev)
+{
+	char value[16];
+	int err;
+
+	memset(dev, 0, sizeof(*dev));
+	snprintf(dev->path, sizeof(dev->path), "%s/hwmon%d", root, n);
+	snprintf(dev->name, sizeof(dev->name), "hwmon%d", n);
+	if (mkdir(dev->path, 0755) < 0)
+		return throw("fake_device_create: cannot create the device", errno);
+	if ((err = write_attr(dev->path, "name", LTC_DRIVER_NAME)))
+		return err;
+	for (int id = 0; id < NUM_ATTRS; id++) {
+		int raw = 0;
+
+		for (size_t i = 0; i < sizeof(fake_values) / sizeof(fake_values[0]); i++)
+			if (fake_values[i].id == id)
+				raw = fake_values[i].value;
+		snprintf(value, sizeof(value), "%d", raw);
+		if ((err = write_attr(dev->path, attr_table[id].name, value)))
+			return err;
+	}
+	return 0;
+}
+
+void fake_device_remove(const struct ltc_device *dev)
+{
+	char path[PATH_MAX];
+
+	for (int id = 0; id < NUM_ATTRS; id++) {
+		snprintf(path, sizeof(path), "%s/%s", dev->path, attr_table[id].name);
+		unlink(path);
+	}
+	snprintf(path, sizeof(path), "%s/name", dev->path);
+	unlink(path);
+	rmdir(dev->path);
+}
+
+// a fake hwmon class directory with one ltc3350, root/hwmon0
+static int make_tree(const char *base, char *root, size_t size, struct ltc_device *dev)
+{
+	snprintf(root, size, "%s/ltc-bench.XXXXXX", base);
+	if (mkdtemp(root) == NULL)
+		return throw("bench: cannot create the fake tree", errno);
+	return fake_device_create(root, 0, dev);
+}
+
+static void remove_tree(const char *root, const struct ltc_device *dev)
+{
+	fake_device_remove(dev);
+	rmdir(root);
+}
+
+/*
+ * Read and write system calls of the process so far, from /proc/self/io.
+ * The read of the file itself is counted the next time.
+ */
+static int syscall_counts(int fd, long *reads, long *writes)
+{
+	char buf[256];
+	char *p;
+	ssize_t len = pread(fd, buf, sizeof(buf) - 1, 0);
+
+	if (len <= 0)
+		return -1;
+	buf[len] = '\0';
+	if ((p = strstr(buf, "syscr:")) == NULL)
+		return -1;
+	*reads = strtol(p + 6, NULL, 10);
+	if ((p = strstr(buf, "syscw:")) == NULL)
+		return -1;
+	*writes = strtol(p + 6, NULL, 10);
+	return 0;
+}
+
+static long elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000000L + end->tv_nsec - start->tv_nsec;
+}
+
+static int compare_long(const void *a, const void *b)
+{
+	long x = *(const long *) a, y = *(const long *) b;
+
+	return (x > y) - (x < y);
+}
+
+static void run_op(const struct bench_op *op, struct ltc_device *dev, long *lat, int iterations, int iofd)
+{
+	struct timespec start, end;
+	long reads0 = 0, writes0 = 0, reads = 0, writes = 0;
+	int counted;
+
+	// warm up the page cache and the attribute hash
+	op->run(dev);
+	counted = syscall_counts(iofd, &reads0, &writes0) == 0;
+	for (int i = 0; i < iterations; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		op->run(dev);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		lat[i] = elapsed_ns(&start, &end);
+	}
+	counted = counted && syscall_counts(iofd, &reads, &writes) == 0;
+	qsort(lat, iterations, sizeof(*lat), compare_long);
+
+	printf("%-20s %9.1f %9.1f %9.1f %9.1f", op->name, lat[iterations / 2] / 1000.0,
+			lat[iterations * 90 / 100] / 1000.0, lat[iterations * 99 / 100] / 1000.0,
+			lat[iterations - 1] / 1000.0);
+	if (counted)
+		printf(" %9.2f %9.2f\n", (double) (reads - reads0 - 1) / iterations,
+				(double) (writes - writes0) / iterations);
+	else
+		printf(" %9s %9s\n", "-", "-");
+}
+
+/*
+ * Conversions of every attribute from register units, and back, over a
+ * sweep of register values: one at a time, then in batches.
+ */
+static void run_conversions(long count)
+{
+	static int32_t in[BENCH_BATCH], out[BENCH_BATCH];
+	struct timespec start, end;
+	volatile long sink = 0;
+	long ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (long i = 0; i < count; i++) {
+		enum attr_id id = i % NUM_ATTRS;
+
+		sink += attr_from_LSB(id, i & 0xffff);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ns = elapsed_ns(&start, &end);
+	printf("%-20s %9ld conversions in %ld ms, %.1f ns each, %.1f M/s\n", "attr_from_LSB", count,
+			ns / 1000000, (double) ns / count, count * 1000.0 / ns);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (long i = 0; i < count; i++) {
+		enum attr_id id = i % NUM_ATTRS;
+
+		sink += attr_to_LSB(id, i & 0xffff);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ns = elapsed_ns(&start, &end);
+	printf("%-20s %9ld conversions in %ld ms, %.1f ns each, %.1f M/s\n", "attr_to_LSB", count,
+			ns / 1000000, (double) ns / count, count * 1000.0 / ns);
+
+	// the same sweep, BENCH_BATCH values at a time
+	for (int i = 0; i < BENCH_BATCH; i++)
+		in[i] = i;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (long i = 0; i < count; i += BENCH_BATCH) {
+		attr_from_LSB_n((i / BENCH_BATCH) % NUM_ATTRS, in, out, BENCH_BATCH);
+		sink += out[i % BENCH_BATCH];
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ns = elapsed_ns(&start, &end);
+	printf("%-20s %9ld conversions in %ld ms, %.1f ns each, %.1f M/s\n", "attr_from_LSB_n", count,
+			ns / 1000000, (double) ns / count, count * 1000.0 / ns);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (long i = 0; i < count; i += BENCH_BATCH) {
+		attr_to_LSB_n((i / BENCH_BATCH) % NUM_ATTRS, in, out, BENCH_BATCH);
+		sink += out[i % BENCH_BATCH];
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ns = elapsed_ns(&start, &end);
+	printf("%-20s %9ld conversions in %ld ms, %.1f ns each, %.1f M/s\n", "attr_to_LSB_n", count,
+			ns / 1000000, (double) ns / count, count * 1000.0 / ns);
+}
+
+/**
+ * bench() - measure the cost of the main operations on a fake device
+ *
+ * A fake hwmon tree is written in tmpfs, with the attribute names of the
+ * driver, and every operation is run on it: latency percentiles come from
+ * CLOCK_MONOTONIC around each call, read/write system calls per call from
+ * /proc/self/io. Real sysfs attributes cost an SMBus transfer each, so
+ * the numbers tell the software overhead, and the syscall counts tell
+ * how many transfers an operation would cost on the target.
+ * With --keep the tree is left in place, to be used through
+ * LTC_MONITOR_HWMON_ROOT.
+ * Return: 0 on success, otherwise error code
+*/
+int bench(int argc, char *argv[])
+{
+	static const struct option options[] = {
+		{ "iterations", required_argument, NULL, 'n' },
+		{ "dir", required_argument, NULL, 'D' },
+		{ "keep", no_argument, NULL, 'k' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct ltc_device dev;
+	char root[PATH_MAX];
+	const char *base = access("/dev/shm", W_OK) == 0 ? "/dev/shm" : "/tmp";
+	long *lat;
+	int iterations = BENCH_ITERATIONS, keep = 0;
+	int opt, err, iofd;
+
+	optind = 1;
+	while ((opt = getopt_long(argc, argv, "n:D:k", options, NULL)) != -1) {
+		switch (opt) {
+		case 'n':
+			iterations = strtol(optarg, NULL, 10);
+			break;
+		case 'D':
+			base = optarg;
+			break;
+		case 'k':
+			keep = 1;
+			break;
+		default:
+			return EINVAL;
+		}
+	}
+	if (iterations <= 0) {
+		fprintf(stderr, "bench: the iterations must be positive\n");
+		return EINVAL;
+	}
+
+	if ((err = make_tree(base, root, sizeof(root), &dev)))
+		return err;
+	if ((lat = calloc(iterations, sizeof(*lat))) == NULL) {
+		err = throw("bench", ENOMEM);
+		goto out;
+	}
+	if ((null_out = fopen("/dev/null", "w")) == NULL) {
+		err = throw("bench: /dev/null", errno);
+		goto out;
+	}
+	iofd = open("/proc/self/io", O_RDONLY);
+	for (int i = 0; i < SAMPLE_COLUMNS; i++) {
+		char path[PATH_MAX];
+
+		snprintf(path, sizeof(path), "%s/%s", dev.path, attr_table[ATTR_MEAS_CAP + i].name);
+		column_fds[i] = open(path, O_RDONLY);
+	}
+
+	printf("fake device %s, %d iterations\n", dev.path, iterations);
+	printf("%-20s %9s %9s %9s %9s %9s %9s\n", "operation", "p50 us", "p90 us", "p99 us", "max us",
+			"reads", "writes");
+	for (size_t i = 0; i < sizeof(bench_ops) / sizeof(bench_ops[0]); i++)
+		run_op(&bench_ops[i], &dev, lat, iterations, iofd);
+	run_conversions(BENCH_CONVERSIONS);
+
+	for (int i = 0; i < SAMPLE_COLUMNS; i++)
+		close(column_fds[i]);
+	if (iofd >= 0)
+		close(iofd);
+	fclose(null_out);
+out:
+	free(lat);
+	if (keep)
+		printf("LTC_MONITOR_HWMON_ROOT=%s\n", root);
+	else
+		remove_tree(root, &dev);
+	return err;
+}
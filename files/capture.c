@@ -0,0 +1,139 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ltc-monitor.h"
+
+/**
+ * capture_open() - start keeping the pre-trigger window of a device
+ *
+ * The window holds the last cfg->pretrigger seconds of samples, at the
+ * history rate. It is allocated here, once.
+ * Return: 0 on success, otherwise error code
+*/
+int capture_open(struct capture *c, const struct ltc_device *dev, const struct capture_config *cfg)
+{
+	memset(c, 0, sizeof(*c));
+	c->dev = dev;
+	for (int i = 0; i < SAMPLE_COLUMNS; i++)
+		c->fds[i] = -1;
+	c->capacity = cfg->pretrigger * cfg->history_hz;
+	if (c->capacity == 0)
+		c->capacity = 1;
+	if ((c->history = calloc(c->capacity, sizeof(*c->history))) == NULL)
+		return throw("capture: cannot allocate the pre-trigger window", ENOMEM);
+	if (sample_open_columns(dev, c->fds) == 0) {
+		fprintf(stderr, "capture: no measurement of %s can be read\n", dev->name);
+		return ENOENT;
+	}
+	return 0;
+}
+
+void capture_close(struct capture *c)
+{
+	if (c->out != NULL)
+		fclose(c->out);
+	c->out = NULL;
+	sample_close_columns(c->fds);
+	free(c->history);
+	c->history = NULL;
+}
+
+static void write_row(struct capture *c, const struct sample_row *row, long hz)
+{
+	char buf[SAMPLE_ROW_MAX];
+
+	fwrite(buf, 1, sample_format_row(buf, sizeof(buf), row, hz), c->out);
+}
+
+/**
+ * capture_sample() - take one sample of the device
+ *
+ * Out of a burst the sample goes in the pre-trigger window, overwriting the
+ * oldest one; during a burst it goes in the capture file, and the burst
+ * ends when its post-trigger time is over.
+ * Return: 1 if the device is still in a burst.
+*/
+int capture_sample(struct capture *c, const struct capture_config *cfg)
+{
+	struct sample_row row;
+	struct timespec now;
+
+	sample_read_columns(c->fds, &row);
+	clock_gettime(CLOCK_REALTIME, &row.time);
+	if (c->out == NULL) {
+		c->history[c->head] = row;
+		c->head = (c->head + 1) % c->capacity;
+		if (c->count < c->capacity)
+			c->count++;
+		return 0;
+	}
+
+	write_row(c, &row, cfg->burst_hz);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (now.tv_sec > c->until.tv_sec || (now.tv_sec == c->until.tv_sec && now.tv_nsec >= c->until.tv_nsec)) {
+		fclose(c->out);
+		c->out = NULL;
+		printf("Capture of %s done\n", c->dev->name);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Return: what a change of the status registers is a power failure for,
+ * NULL if it is not: the device lost its input power or started backing
+ * up the output from the capacitors.
+*/
+const char *capture_trigger_reason(const struct status_regs *before, const struct status_regs *after)
+{
+	int monitor = after->monitor & ~before->monitor;
+	int chrg = after->chrg & ~before->chrg;
+
+	if (after->monitor == -1 || after->chrg == -1)
+		return NULL;
+	if (monitor & MON_POWER_FAILED)
+		return "power_failed";
+	if (chrg & CHRG_PFO)
+		return "pfo";
+	if (chrg & CHRG_STEPUP)
+		return "stepup";
+	return NULL;
+}
+
+/**
+ * capture_trigger() - start a burst capture
+ *
+ * The capture file is named after the device, the time and the reason.
+ * It starts with the pre-trigger window, oldest sample first; the
+ * following samples are added until cfg->post seconds from now. A trigger
+ * during a burst extends it.
+ * Return: 0 on success, otherwise error code
+*/
+int capture_trigger(struct capture *c, const struct capture_config *cfg, const char *reason)
+{
+	char path[PATH_MAX], stamp[32], buf[SAMPLE_ROW_MAX];
+	struct timespec now;
+	struct tm tm;
+
+	clock_gettime(CLOCK_MONOTONIC, &c->until);
+	c->until.tv_sec += cfg->post;
+	if (c->out != NULL)
+		return 0;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	gmtime_r(&now.tv_sec, &tm);
+	strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+	snprintf(path, sizeof(path), "%s/capture-%s-%s-%s.csv", cfg->dir, c->dev->name, stamp, reason);
+	if ((c->out = fopen(path, "w")) == NULL)
+		return throw("capture: cannot create the capture file", errno);
+	printf("Capturing %s (%s) in %s\n", c->dev->name, reason, path);
+
+	fwrite(buf, 1, sample_format_header(buf, sizeof(buf)), c->out);
+	for (size_t i = 0; i < c->count; i++)
+		write_row(c, &c->history[(c->head + c->capacity - c->count + i) % c->capacity], cfg->burst_hz);
+	c->count = 0;
+	return 0;
+}
@@ -0,0 +1,273 @@
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ltc-monitor.h"
+
+/*
+ * Array-at-a-time conversions, for the bulk of archived register values.
+ * Each kernel gives exactly the result of its scalar function in main.c,
+ * meas_trunc() rounding included, but is written as a plain loop without
+ * calls or 64-bit intermediates, so that the compiler turns it into
+ * vector code: the constants are reduced so that every product of a
+ * 16-bit register value fits in 32 bits. The inverse kernels keep the
+ * 64-bit arithmetic of their scalar functions, their inputs being user
+ * values of any size.
+ */
+
+// meas_trunc() without the branch
+static inline int32_t trunc9(int32_t q)
+{
+	return q + (q % 10 == 9);
+}
+
+void LSB_to_millivolts_n(const int32_t *restrict raw, int32_t *restrict out, size_t n, int factor)
+{
+	for (size_t i = 0; i < n; i++)
+		out[i] = trunc9(raw[i] * factor / 10000);
+}
+
+void LSB_to_celsius_n(const int32_t *restrict raw, int32_t *restrict out, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		out[i] = trunc9((28 * raw[i] - 251400) / 1000);
+}
+
+// 336 * RT / RTST / 1000000, reduced by their common factor 1600
+#define FARADS_NUM 18186
+#define FARADS_DEN 75625
+
+void LSB_to_farads_n(const int32_t *restrict raw, int32_t *restrict out, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		out[i] = trunc9(raw[i] * FARADS_NUM / FARADS_DEN);
+}
+
+void LSB_to_milliohms_n(const int32_t *restrict raw, int32_t *restrict out, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		out[i] = trunc9(raw[i] * RSNSC / 64);
+}
+
+void millivolts_to_LSB_n(const int32_t *restrict value, int32_t *restrict out, size_t n, int factor)
+{
+	for (size_t i = 0; i < n; i++)
+		out[i] = trunc9((int64_t) value[i] * 10000 / factor);
+}
+
+void celsius_to_LSB_n(const int32_t *restrict value, int32_t *restrict out, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		out[i] = trunc9(((int64_t) value[i] * 1000 + 251400) / 28);
+}
+
+// farads_to_LSB() does not round
+void farads_to_LSB_n(const int32_t *restrict value, int32_t *restrict out, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		out[i] = (int64_t) value[i] * FARADS_DEN / FARADS_NUM;
+}
+
+void milliohms_to_LSB_n(const int32_t *restrict value, int32_t *restrict out, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		out[i] = trunc9((int64_t) value[i] * 64 / RSNSC);
+}
+
+/**
+ * attr_from_LSB_n() - convert register values of an attribute, as attr_from_LSB()
+ * @raw: register values, 0 to 65535
+ * @out: n converted values, may not overlap @raw
+*/
+void attr_from_LSB_n(enum attr_id id, const int32_t *raw, int32_t *out, size_t n)
+{
+	switch (id == ATTR_NONE ? UNIT_NONE : attr_table[id].unit) {
+	case UNIT_MV:
+		LSB_to_millivolts_n(raw, out, n, attr_table[id].factor);
+		break;
+	case UNIT_F:
+		LSB_to_farads_n(raw, out, n);
+		break;
+	case UNIT_C:
+		LSB_to_celsius_n(raw, out, n);
+		break;
+	case UNIT_MR:
+		LSB_to_milliohms_n(raw, out, n);
+		break;
+	default:
+		for (size_t i = 0; i < n; i++)
+			out[i] = raw[i];
+	}
+}
+
+/**
+ * attr_to_LSB_n() - convert values of an attribute to register units, as attr_to_LSB()
+ * @out: n register values, may not overlap @value
+*/
+void attr_to_LSB_n(enum attr_id id, const int32_t *value, int32_t *out, size_t n)
+{
+	switch (id == ATTR_NONE ? UNIT_NONE : attr_table[id].unit) {
+	case UNIT_MV:
+		millivolts_to_LSB_n(value, out, n, attr_table[id].factor);
+		break;
+	case UNIT_F:
+		farads_to_LSB_n(value, out, n);
+		break;
+	case UNIT_C:
+		celsius_to_LSB_n(value, out, n);
+		break;
+	case UNIT_MR:
+		milliohms_to_LSB_n(value, out, n);
+		break;
+	default:
+		for (size_t i = 0; i < n; i++)
+			out[i] = value[i];
+	}
+}
+
+#define VERIFY_VALUES 65536
+
+// the exact conversion of a register value, in the unit of attr_from_LSB()
+static long double exact_from_LSB(enum attr_id id, int32_t raw)
+{
+	switch (attr_table[id].unit) {
+	case UNIT_MV:
+		return raw * (long double) attr_table[id].factor / 10000;
+	case UNIT_F:
+		return raw * 336.0L * RT / RTST / 1000000;
+	case UNIT_C:
+		return raw * 0.028L - 251.4L;
+	case UNIT_MR:
+		return raw * (long double) RSNSC / 64;
+	default:
+		return raw;
+	}
+}
+
+// the exact conversion of a value back to register units
+static long double exact_to_LSB(enum attr_id id, int32_t value)
+{
+	if (attr_table[id].unit == UNIT_C)
+		return (value + 251.4L) / 0.028L;
+	return value / exact_from_LSB(id, 1);
+}
+
+struct verify_result {
+	long mismatches; // batch results that differ from the scalar ones
+	int32_t first; // input of the first mismatch
+	long double max_error; // largest distance from the exact conversion
+	int32_t worst; // input where it is reached
+};
+
+static void check(struct verify_result *r, const int32_t *in, const int32_t *batch,
+		const int32_t *scalar, const long double *exact, size_t n)
+{
+	memset(r, 0, sizeof(*r));
+	for (size_t i = 0; i < n; i++) {
+		long double error = fabsl(scalar[i] - exact[i]);
+
+		if (batch[i] != scalar[i] && r->mismatches++ == 0)
+			r->first = in[i];
+		if (error > r->max_error) {
+			r->max_error = error;
+			r->worst = in[i];
+		}
+	}
+}
+
+static void print_result(const char *name, const char *direction, const char *unit,
+		const struct verify_result *r, size_t n)
+{
+	printf("%-16s %-8s %7zu values %6ld mismatches", name, direction, n, r->mismatches);
+	if (r->mismatches)
+		printf(" (first at %d)", r->first);
+	printf(", max error %.3Lf %s at %d\n", r->max_error, unit, r->worst);
+}
+
+/*
+ * Every register value through attr_from_LSB_n() and attr_from_LSB(), then
+ * every value of the unit in the range they give through attr_to_LSB_n()
+ * and attr_to_LSB(). The errors are measured against the exact
+ * conversions.
+ * Return: number of mismatches.
+ */
+static long verify_attr(enum attr_id id, int32_t *in, int32_t *batch, int32_t *scalar, long double *exact)
+{
+	struct verify_result r;
+	int32_t lo, hi;
+	size_t n;
+	long mismatches;
+
+	for (int32_t v = 0; v < VERIFY_VALUES; v++) {
+		in[v] = v;
+		scalar[v] = attr_from_LSB(id, v);
+		exact[v] = exact_from_LSB(id, v);
+	}
+	attr_from_LSB_n(id, in, batch, VERIFY_VALUES);
+	check(&r, in, batch, scalar, exact, VERIFY_VALUES);
+	print_result(attr_table[id].name, "from LSB", attr_unit_name(id), &r, VERIFY_VALUES);
+	mismatches = r.mismatches;
+
+	lo = scalar[0];
+	hi = scalar[VERIFY_VALUES - 1];
+	n = hi - lo + 1;
+	for (size_t i = 0; i < n; i++) {
+		in[i] = lo + i;
+		scalar[i] = attr_to_LSB(id, in[i]);
+		exact[i] = exact_to_LSB(id, in[i]);
+	}
+	attr_to_LSB_n(id, in, batch, n);
+	check(&r, in, batch, scalar, exact, n);
+	print_result(attr_table[id].name, "to LSB", "LSB", &r, n);
+	return mismatches + r.mismatches;
+}
+
+/**
+ * convert_verify() - check the batch conversions against the scalar ones
+ *
+ * ltc-monitor verify
+ * For one attribute of each unit and conversion factor, every 16-bit
+ * register value is converted to the unit, and every value of the unit
+ * in the range they cover is converted back.
+ * The batch results must be the scalar ones; the largest error of the
+ * scalar results against the exact conversions is reported.
+ * Return: 0 if the results match, otherwise EINVAL
+*/
+int convert_verify(int argc, char *argv[])
+{
+	static const enum attr_id ids[] = {
+		ATTR_MEAS_VCAP1, ATTR_MEAS_VCAP, ATTR_MEAS_VIN, ATTR_MEAS_DTEMP, ATTR_MEAS_CAP, ATTR_MEAS_ESR,
+	};
+	// the widest range of a unit: vin, 2.21 mV per LSB
+	size_t size = (size_t) 65535 * 22100 / 10000 + 1;
+	int32_t *in, *batch, *scalar;
+	long double *exact;
+	long mismatches = 0;
+
+	(void) argc;
+	(void) argv;
+	in = malloc(size * sizeof(*in));
+	batch = malloc(size * sizeof(*batch));
+	scalar = malloc(size * sizeof(*scalar));
+	exact = malloc(size * sizeof(*exact));
+	if (in == NULL || batch == NULL || scalar == NULL || exact == NULL) {
+		free(in);
+		free(batch);
+		free(scalar);
+		free(exact);
+		return throw("verify: cannot allocate the buffers", ENOMEM);
+	}
+
+	for (size_t i = 0; i < sizeof(ids) / sizeof(ids[0]); i++)
+		mismatches += verify_attr(ids[i], in, batch, scalar, exact);
+	printf("%ld mismatches between the batch and the scalar conversions\n", mismatches);
+
+	free(in);
+	free(batch);
+	free(scalar);
+	free(exact);
+	return mismatches ? EINVAL : 0;
+}
@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "ltc-monitor.h"
+
+static void start_learning(struct cycle *c, int64_t now)
+{
+	c->state = CYCLE_LEARNING;
+	c->learn_end = now + c->learn_time;
+	c->poll = now;
+	c->prev_start = 0;
+	c->resolution = 0;
+	memset(c->nchanges, 0, sizeof(c->nchanges));
+	c->misses = 0;
+	c->refresh = 0;
+}
+
+/**
+ * cycle_init() - start learning the measurement cycle of a device
+ * @now: CLOCK_MONOTONIC ns
+ * @learn: ns the rows are read for, every CYCLE_LEARN_STEP ms, to learn it
+*/
+void cycle_init(struct cycle *c, int64_t now, int64_t learn)
+{
+	memset(c, 0, sizeof(*c));
+	c->learn_time = learn;
+	start_learning(c, now);
+}
+
+/*
+ * The intervals between the changes of a register are whole numbers of
+ * cycles, as long as its value differs from one cycle to the next: the
+ * shortest one is taken as one cycle, and the period is the total time
+ * over the total number of cycles.
+ * Return: the period in ns, 0 if there are not enough changes.
+ */
+static int64_t estimate_period(const int64_t *changes, int n, int64_t resolution)
+{
+	int64_t shortest = INT64_MAX, total = 0;
+	long cycles = 0;
+
+	for (int i = 1; i < n; i++)
+		if (changes[i] - changes[i - 1] < shortest)
+			shortest = changes[i] - changes[i - 1];
+	if (n < 3 || shortest <= resolution)
+		return 0;
+	for (int i = 1; i < n; i++) {
+		int64_t d = changes[i] - changes[i - 1];
+
+		total += d;
+		cycles += (d + shortest / 2) / shortest;
+	}
+	return total / cycles;
+}
+
+/**
+ * cycle_learn() - take in a row read while learning
+ * @start: when the read of the row started
+ * @end: when it ended
+ * @hz: sampling rate, the rows are taken every so many cycles not to exceed it
+ *      by more than the jitter of the updates
+ *
+ * A column that changed from the previous row changed between the start
+ * of that read and the end of this one: the middle is taken, within
+ * half the time between two reads. Once the learning time is over, the
+ * column that changed most often is the sentinel, and the period and
+ * phase of its changes are the cycle. If no column changed often enough
+ * to tell, the device is left free running, and forgets any cycle it
+ * had learned before.
+ * Return: 1 once the cycle is learned, 0 otherwise.
+*/
+int cycle_learn(struct cycle *c, const struct sample_row *row, int64_t start, int64_t end, long hz)
+{
+	int sentinel = 0;
+	int64_t period;
+
+	if (c->prev_start > 0) {
+		for (int i = 0; i < SAMPLE_COLUMNS; i++) {
+			if (!(row->valid & c->prev.valid & (1U << i)) || row->raw[i] == c->prev.raw[i])
+				continue;
+			if (c->nchanges[i] < CYCLE_LEARN_MAX)
+				c->changes[i][c->nchanges[i]++] = c->prev_start + (end - c->prev_start) / 2;
+		}
+		if (end - c->prev_start > c->resolution)
+			c->resolution = end - c->prev_start;
+	}
+	c->prev = *row;
+	c->prev_start = start;
+	c->poll = start + CYCLE_LEARN_STEP * 1000000LL;
+	if (c->poll < end)
+		c->poll = end;
+	if (end < c->learn_end)
+		return 0;
+
+	for (int i = 1; i < SAMPLE_COLUMNS; i++)
+		if (c->nchanges[i] > c->nchanges[sentinel])
+			sentinel = i;
+	period = estimate_period(c->changes[sentinel], c->nchanges[sentinel], c->resolution);
+	if (period == 0) {
+		// a cycle learned before is gone
+		c->state = CYCLE_FREE;
+		c->learned = c->period = 0;
+		return 0;
+	}
+
+	c->sentinel = sentinel;
+	c->last = row->raw[sentinel];
+	c->period = c->learned = period;
+	c->next = c->changes[sentinel][c->nchanges[sentinel] - 1] + period;
+	c->guard = period / 16 > c->resolution ? period / 16 : c->resolution;
+	if (c->guard > period / 4)
+		c->guard = period / 4;
+	c->every = (1000000000 / hz - c->guard + period - 1) / period;
+	if (c->every < 1)
+		c->every = 1;
+	c->state = CYCLE_LOCKED;
+	while (c->next - c->guard <= end)
+		c->next += period;
+	c->poll = c->next - c->guard;
+	return 1;
+}
+
+/*
+ * An update seen at @when, about: the phase moves half way to it, and the
+ * period an eighth of the way per cycle, within a factor 2 of the period
+ * learned.
+ */
+static void correct(struct cycle *c, int64_t when)
+{
+	int64_t err = when - c->next;
+
+	c->next += err / 2;
+	c->period += err / (8 * c->every);
+	if (c->period < c->learned / 2)
+		c->period = c->learned / 2;
+	if (c->period > c->learned * 2)
+		c->period = c->learned * 2;
+}
+
+/**
+ * cycle_poll() - take in a poll of the sentinel
+ * @when: when it was read
+ *
+ * The sentinel is polled every half guard time, from a guard time before
+ * the update expected: the first poll where it changed tells when the
+ * update came, within half a guard time, and the phase follows it. If it
+ * changed at the first poll, the update came early. If it did not change
+ * within twice the guard time after the update expected, it came late, or
+ * the value did not change. When rows are taken every few cycles, the
+ * sentinel is read once half a cycle before, for its value after the
+ * updates skipped.
+ * Return: 1 when the row is to be read, c->poll is the next poll otherwise.
+*/
+int cycle_poll(struct cycle *c, long value, int64_t when)
+{
+	int first = c->poll == c->next - c->guard;
+
+	if (c->refresh) {
+		c->refresh = 0;
+		c->last = value;
+		c->poll = c->next - c->guard > when ? c->next - c->guard : when;
+		return 0;
+	}
+	if (value != c->last) {
+		c->last = value;
+		if (first) {
+			c->early++;
+			c->misses++;
+			correct(c, when - c->guard);
+		} else {
+			correct(c, when - c->guard / 4);
+			c->misses = 0;
+		}
+		return 1;
+	}
+	if (when >= c->next + 2 * c->guard) {
+		c->missed++;
+		c->misses++;
+		return 1;
+	}
+	c->poll += c->guard / 2;
+	if (c->poll < when)
+		c->poll = when;
+	return 0;
+}
+
+/**
+ * cycle_check() - check that a row was read within one cycle
+ * @before: the sentinel, polled before the row
+ * @after: the sentinel, read after it
+ * @start: when @before was read
+ * @end: when @after was read
+ *
+ * A sentinel that changed while the row was read means some columns come
+ * from one cycle and some from the next.
+ * Return: 1 if the row straddles an update.
+*/
+int cycle_check(struct cycle *c, long before, long after, int64_t start, int64_t end)
+{
+	if (before != after) {
+		c->straddles++;
+		c->misses++;
+		correct(c, start + (end - start) / 2);
+	}
+	c->last = after;
+	return before != after;
+}
+
+/*
+ * On to the update of the next row. Updates that went by while the
+ * sampler was late are skipped. After CYCLE_MISSES rows in a row off the
+ * cycle, it is learned again.
+ */
+void cycle_advance(struct cycle *c, int64_t now)
+{
+	c->rows++;
+	c->next += c->every * c->period;
+	while (c->next - c->guard <= now)
+		c->next += c->period;
+	c->poll = c->next - c->guard;
+	if (c->every > 1 && c->next - c->period / 2 > now) {
+		c->poll = c->next - c->period / 2;
+		c->refresh = 1;
+	}
+	if (c->misses >= CYCLE_MISSES) {
+		c->relearns++;
+		start_learning(c, now);
+	}
+}
+
+void cycle_summary(FILE *out, const struct ltc_device *dev, const struct cycle *c)
+{
+	if (c->learned == 0) {
+		fprintf(out, "%s: no measurement cycle found, the registers did not change often enough\n", dev->name);
+		return;
+	}
+	fprintf(out, "%s: measurement cycle %.3f ms (%s), one row every %d cycles, %llu rows, %.1f reads per row,"
+			" %llu updates early, %llu late, %llu rows straddled an update, %llu still did when read again,"
+			" learned %llu times\n", dev->name, c->period / 1e6, attr_table[sample_column_id(c->sentinel)].name,
+			c->every, (unsigned long long) c->rows, c->rows ? (double) c->reads / c->rows : 0.0,
+			(unsigned long long) c->early, (unsigned long long) c->missed, (unsigned long long) c->straddles,
+			(unsigned long long) c->incoherent, (unsigned long long) c->relearns + 1);
+}
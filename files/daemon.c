@@ -0,0 +1,563 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ltc-monitor.h"
+#include "shm.h"
+
+#define DAEMON_SOCKET "/run/ltc-monitor.sock"
+// anyone may read, only root may write or clear (see handle_command())
+#define DAEMON_SOCKET_MODE 0666
+#define DAEMON_INTERVAL 1000
+#define MAX_CLIENTS 16
+#define REQUEST_MAX 256
+#define MAX_ARGS 8
+#define REPLY_MAX (OUTPUT_MAX * MAX_DEVICES)
+// a client that has not sent its request or taken its reply by then is dropped
+#define CLIENT_TIMEOUT 5000 // ms
+
+/*
+ * Protocol: the client sends one line with the command and its arguments,
+ * as they are given on the command line (e.g. "read -c meas_vcap\n").
+ * The daemon answers with a line holding the command's return value,
+ * followed by the command's output, and closes the connection.
+ */
+
+struct client {
+	int fd;
+	size_t len;
+	char buf[REQUEST_MAX];
+	char *out; // what is left of the reply, the socket did not take it all at once
+	size_t out_len;
+	size_t out_sent;
+	long long since; // CLOCK_MONOTONIC ms of the connection
+};
+
+static volatile sig_atomic_t stop_daemon;
+
+static void daemon_stop(int sig)
+{
+	(void) sig;
+	stop_daemon = 1;
+}
+
+static int socket_address(struct sockaddr_un *addr)
+{
+	const char *path = getenv("LTC_MONITOR_SOCKET");
+
+	if (path == NULL || *path == '\0')
+		path = DAEMON_SOCKET;
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path))
+		return ENAMETOOLONG;
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+static int connect_daemon(void)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (socket_address(&addr))
+		return -1;
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/**
+ * daemon_request() - run a command through the daemon
+ *
+ * The device selectors are sent along with the command.
+ * The command's output is copied on standard output.
+ * Return: the command's return value, -1 if the daemon is not running.
+*/
+int daemon_request(int argc, char *argv[], const char **selectors, int nsel)
+{
+	char buf[4096];
+	char *newline = NULL;
+	size_t len = 0;
+	ssize_t n;
+	int fd, res;
+
+	if ((fd = connect_daemon()) < 0)
+		return -1;
+
+	for (int i = 0; i < nsel && len < REQUEST_MAX; i++)
+		len += snprintf(buf + len, sizeof(buf) - len, "--device %s ", selectors[i]);
+	for (int i = 1; i < argc && len < REQUEST_MAX; i++)
+		len += snprintf(buf + len, sizeof(buf) - len, "%s%s", argv[i], i + 1 < argc ? " " : "\n");
+	if (len >= REQUEST_MAX) {
+		close(fd);
+		fprintf(stderr, "daemon_request: command too long\n");
+		return E2BIG;
+	}
+	if (write(fd, buf, len) != (ssize_t) len) {
+		res = throw("daemon_request: cannot send the request", errno);
+		close(fd);
+		return res;
+	}
+
+	// the first line is the return value
+	len = 0;
+	while (newline == NULL && len < sizeof(buf) - 1 && (n = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0) {
+		len += n;
+		buf[len] = '\0';
+		newline = strchr(buf, '\n');
+	}
+	if (newline == NULL) {
+		close(fd);
+		fprintf(stderr, "daemon_request: no answer from the daemon\n");
+		return EIO;
+	}
+	res = atoi(buf);
+	newline++;
+	fwrite(newline, 1, len - (newline - buf), stdout);
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		fwrite(buf, 1, n, stdout);
+	close(fd);
+	return res;
+}
+
+/*
+ * @root: the client runs as root. The daemon does, and writes whatever it
+ * is asked to: only root clients may change the devices.
+ */
+static int handle_command(struct snapshot *snap, int argc, char **args, FILE *out, int root)
+{
+	int res;
+
+	if (strcmp(args[0], "show") == 0)
+		return show(out, snap);
+	if (strcmp(args[0], "status") == 0)
+		return status(out, snap);
+	if (strcmp(args[0], "read") == 0 && argc == 2)
+		return read_attr(out, snap, args[1], 0);
+	if (strcmp(args[0], "read") == 0 && argc == 3 && strcmp(args[1], "-c") == 0)
+		return read_attr(out, snap, args[2], 1);
+	if ((strcmp(args[0], "write") == 0 || strcmp(args[0], "clear") == 0) && !root) {
+		fprintf(out, "Only root can %s\n", args[0]);
+		return EPERM;
+	}
+	/*
+	 * writes are serialized here, and followed by a read of what they can
+	 * change: the attribute written and the status registers
+	 */
+	if (strcmp(args[0], "write") == 0 && (argc == 3 || argc == 4)) {
+		// only the attributes of the registry, not any file the name leads to
+		if (attr_lookup(args[1]) == ATTR_NONE || strchr(args[1], '/') != NULL) {
+			fprintf(out, "Unknown attribute %s\n", args[1]);
+			return EINVAL;
+		}
+		res = write_value(out, snap->dev, args[1], args[2], argc == 4 ? args[3] : "");
+		snapshot_update(snap, attr_lookup(args[1]));
+		for (int id = ATTR_ALARM_REG; id <= ATTR_CHRG_STATUS; id++)
+			snapshot_update(snap, id);
+		return res;
+	}
+	if (strcmp(args[0], "clear") == 0) {
+		res = clear_all(out, snap);
+		snapshot_update(snap, ATTR_ALARM_REG);
+		return res;
+	}
+	fprintf(out, "Unknown request %s\n", args[0]);
+	return EINVAL;
+}
+
+/*
+ * The request can start with --device options, as on the command line,
+ * but it can only select devices the daemon is serving.
+ */
+static int handle_request(struct snapshot *snaps, int nsnaps, char *line, FILE *out, int root)
+{
+	const char *selectors[MAX_DEVICES];
+	char *tokens[MAX_ARGS + 1];
+	char **args = tokens;
+	char *saveptr;
+	int argc = 1, nsel, ndev = 0, res = 0;
+	int selected[MAX_DEVICES];
+
+	// tokens[0] stands for the program name
+	tokens[0] = "ltc-monitor";
+	for (char *tok = strtok_r(line, " \t\r\n", &saveptr); tok != NULL && argc <= MAX_ARGS;
+			tok = strtok_r(NULL, " \t\r\n", &saveptr))
+		tokens[argc++] = tok;
+	nsel = device_options(&argc, &args, selectors);
+	if (nsel < 0 || argc < 2)
+		return EINVAL;
+	// the access times are kept for the whole daemon, not per device
+	if (strcmp(args[1], "stats") == 0) {
+		stats_print(out);
+		return 0;
+	}
+
+	for (int i = 0; i < nsnaps; i++)
+		if (nsel == 0 || device_selected(snaps[i].dev, i, selectors, nsel))
+			selected[ndev++] = i;
+	if (ndev == 0) {
+		fprintf(out, "No ltc3350 device matches the selection\n");
+		return ENODEV;
+	}
+	if (nsel == 0 && ndev > 1 && (strcmp(args[1], "write") == 0 || strcmp(args[1], "clear") == 0)) {
+		fprintf(out, "%d ltc3350 devices found: select the ones to %s with --device, or --device all\n", ndev, args[1]);
+		return EINVAL;
+	}
+
+	for (int i = 0; i < ndev; i++) {
+		device_header(out, snaps[selected[i]].dev, ndev);
+		res |= handle_command(&snaps[selected[i]], argc - 1, args + 1, out, root);
+	}
+	return res;
+}
+
+/*
+ * The replies are written in the same buffer, through a stream opened
+ * once: answering does not allocate, unless the client is slow to read.
+ */
+static char reply[REPLY_MAX];
+static FILE *reply_stream;
+
+/*
+ * The sockets of the clients do not block: what a client does not take
+ * at once is kept, and sent as it reads it.
+ * Return: 1 once the reply is sent, or cannot be
+ */
+static int answer(struct client *client, struct snapshot *snaps, int nsnaps)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	struct iovec iov[2];
+	char header[16];
+	ssize_t sent;
+	long size;
+	int res, root;
+
+	if (reply_stream == NULL && (reply_stream = fmemopen(reply, sizeof(reply), "w")) == NULL) {
+		perror("daemon: fmemopen");
+		return 1;
+	}
+	root = getsockopt(client->fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == 0;
+	rewind(reply_stream);
+	res = handle_request(snaps, nsnaps, client->buf, reply_stream, root);
+	fflush(reply_stream);
+	size = ftell(reply_stream);
+
+	iov[0].iov_base = header;
+	iov[0].iov_len = snprintf(header, sizeof(header), "%d\n", res);
+	iov[1].iov_base = reply;
+	iov[1].iov_len = size;
+	if ((sent = writev(client->fd, iov, 2)) < 0 && errno != EAGAIN) {
+		perror("daemon: cannot answer");
+		return 1;
+	}
+	if (sent < 0)
+		sent = 0;
+	if ((size_t) sent == iov[0].iov_len + iov[1].iov_len)
+		return 1;
+
+	client->out_len = iov[0].iov_len + iov[1].iov_len - sent;
+	client->out_sent = 0;
+	if ((client->out = malloc(client->out_len)) == NULL) {
+		perror("daemon: cannot keep the reply");
+		return 1;
+	}
+	if ((size_t) sent < iov[0].iov_len) {
+		memcpy(client->out, header + sent, iov[0].iov_len - sent);
+		memcpy(client->out + iov[0].iov_len - sent, reply, size);
+	} else {
+		memcpy(client->out, reply + sent - iov[0].iov_len, client->out_len);
+	}
+	return 0;
+}
+
+// Return: 1 once the rest of the reply is sent, or cannot be
+static int flush_client(struct client *client)
+{
+	ssize_t n = write(client->fd, client->out + client->out_sent, client->out_len - client->out_sent);
+
+	if (n < 0)
+		return errno != EAGAIN;
+	client->out_sent += n;
+	return client->out_sent == client->out_len;
+}
+
+static void drop_client(struct client *client)
+{
+	close(client->fd);
+	free(client->out);
+	client->out = NULL;
+	client->fd = -1;
+	client->len = 0;
+}
+
+/*
+ * Return: 1 once the request is complete and answered
+*/
+static int serve_client(struct client *client, struct snapshot *snaps, int nsnaps)
+{
+	ssize_t n;
+
+	if (client->out != NULL)
+		return flush_client(client);
+	n = read(client->fd, client->buf + client->len, sizeof(client->buf) - 1 - client->len);
+
+	if (n <= 0) {
+		if (n < 0 && errno == EAGAIN)
+			return 0;
+		return 1;
+	}
+	client->len += n;
+	client->buf[client->len] = '\0';
+	if (strchr(client->buf, '\n') == NULL) {
+		// too long to be a request
+		return client->len == sizeof(client->buf) - 1;
+	}
+	return answer(client, snaps, nsnaps);
+}
+
+static int listen_socket(void)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (socket_address(&addr))
+		return -ENAMETOOLONG;
+	// a socket nobody answers on is left over from a previous run
+	if ((fd = connect_daemon()) >= 0) {
+		close(fd);
+		fprintf(stderr, "daemon: already running on %s\n", addr.sun_path);
+		return -EADDRINUSE;
+	}
+	unlink(addr.sun_path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -throw("daemon: socket", errno);
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || chmod(addr.sun_path, DAEMON_SOCKET_MODE) < 0
+			|| listen(fd, MAX_CLIENTS) < 0) {
+		int err = throw("daemon: cannot listen on socket", errno);
+		close(fd);
+		return -err;
+	}
+	return fd;
+}
+
+/*
+ * The scheduler that refreshes the snapshots: too big for the stack, and
+ * there is one daemon per process.
+ */
+static struct scheduler sched;
+
+static long long monotonic_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/**
+ * run_daemon() - serve cached attribute values on a Unix socket
+ *
+ * ltc-monitor daemon [--interval MS] [--max-interval MS] [--slope-mv MV] [--slope-c C]
+ * Every attribute is read on its own schedule (see sched_init()): the
+ * status registers every interval, the measurements every interval while
+ * they move faster than --slope-mv millivolts or --slope-c degrees per
+ * second or an alarm points at them, and less and less often, down to
+ * --max-interval, while they do not. The levels and control registers are
+ * read at startup and after they are written. The alarm and monitor
+ * status registers are also read as soon as they notify a change, they
+ * are then only polled every --max-interval. Clients are answered from
+ * the snapshots, only writes reach the device.
+ * The socket is LTC_MONITOR_SOCKET, or /run/ltc-monitor.sock.
+ * The snapshots are also published in shared memory after every read
+ * (see shm_publish()), where peek and other readers copy them without
+ * asking the daemon.
+ * Return: 0 when stopped by SIGINT/SIGTERM, otherwise error code
+*/
+int run_daemon(int argc, char *argv[], struct ltc_device **devs, int ndev)
+{
+	static const struct option options[] = {
+		{ "interval", required_argument, NULL, 'i' },
+		{ "max-interval", required_argument, NULL, 'm' },
+		{ "slope-mv", required_argument, NULL, 'v' },
+		{ "slope-c", required_argument, NULL, 'c' },
+		{ NULL, 0, NULL, 0 }
+	};
+	static const enum attr_id notify_attrs[] = { ATTR_ALARM_REG, ATTR_MON_STATUS };
+	struct pollfd ufds[1 + 2 * MAX_DEVICES + MAX_CLIENTS];
+	struct client clients[MAX_CLIENTS];
+	struct sigaction sa = { .sa_handler = daemon_stop };
+	struct snapshot snaps[MAX_DEVICES];
+	struct sockaddr_un addr;
+	struct shm shm = { 0 };
+	uint64_t published;
+	struct sched_config cfg = { .min_period = DAEMON_INTERVAL };
+	long long next, now, start;
+	char data[8];
+	int notify_fds[2 * MAX_DEVICES];
+	int nnotify = 2 * ndev;
+	int listen_fd, opt;
+
+	memcpy(cfg.slope, sched_default_slope, sizeof(cfg.slope));
+	optind = 1;
+	while ((opt = getopt_long(argc, argv, "i:m:v:c:", options, NULL)) != -1) {
+		switch (opt) {
+		case 'i':
+			cfg.min_period = strtol(optarg, NULL, 10);
+			break;
+		case 'm':
+			cfg.max_period = strtol(optarg, NULL, 10);
+			break;
+		case 'v':
+			cfg.slope[UNIT_MV] = strtod(optarg, NULL) / 1000;
+			break;
+		case 'c':
+			cfg.slope[UNIT_C] = strtod(optarg, NULL);
+			break;
+		default:
+			return EINVAL;
+		}
+	}
+	if (cfg.max_period == 0)
+		cfg.max_period = 16 * cfg.min_period;
+	if (cfg.min_period <= 0 || cfg.max_period < cfg.min_period) {
+		fprintf(stderr, "daemon: interval must be positive, and at most max-interval\n");
+		return EINVAL;
+	}
+
+	if ((listen_fd = listen_socket()) < 0)
+		return -listen_fd;
+
+	for (int i = 0; i < nnotify; i++) {
+		notify_fds[i] = open_notify(devs[i / 2], notify_attrs[i % 2]);
+	}
+	for (int i = 0; i < MAX_CLIENTS; i++) {
+		clients[i].fd = -1;
+		clients[i].out = NULL;
+	}
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	for (int d = 0; d < ndev; d++)
+		snapshot_init(&snaps[d], devs[d], 0);
+	start = monotonic_ms();
+	sched_init(&sched, &cfg, snaps, ndev, start);
+	for (int i = 0; i < nnotify; i++)
+		if (notify_fds[i] >= 0)
+			sched_set_period(&sched, i / 2, notify_attrs[i % 2], cfg.max_period);
+	// the daemon serves without it
+	shm_publish_open(&shm, snaps, ndev);
+	published = sched.reads;
+
+	while (!stop_daemon) {
+		int nfds = 1 + nnotify, served = 0;
+
+		ufds[0].fd = listen_fd;
+		ufds[0].events = POLLIN;
+		for (int i = 0; i < nnotify; i++) {
+			ufds[1 + i].fd = notify_fds[i];
+			ufds[1 + i].events = POLLPRI | POLLERR;
+		}
+		for (int i = 0; i < MAX_CLIENTS; i++) {
+			if (clients[i].fd < 0)
+				continue;
+			ufds[nfds].fd = clients[i].fd;
+			ufds[nfds++].events = clients[i].out != NULL ? POLLOUT : POLLIN;
+		}
+
+		now = monotonic_ms();
+		next = sched_next(&sched);
+		if (poll(ufds, nfds, next < 0 ? -1 : next > now ? next - now : 0) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("daemon: poll");
+			break;
+		}
+
+		now = monotonic_ms();
+		for (int i = 0; i < nnotify; i++) {
+			if (ufds[1 + i].revents & (POLLPRI | POLLERR)) {
+				pread(notify_fds[i], data, sizeof(data), 0);
+				sched_read(&sched, i / 2, notify_attrs[i % 2], now);
+			}
+		}
+		sched_run(&sched, now);
+
+		for (int i = 1 + nnotify; i < nfds; i++) {
+			if (!(ufds[i].revents & (POLLIN | POLLOUT | POLLHUP | POLLERR)))
+				continue;
+			for (int c = 0; c < MAX_CLIENTS; c++) {
+				if (clients[c].fd == ufds[i].fd) {
+					served |= clients[c].out == NULL;
+					if (serve_client(&clients[c], snaps, ndev))
+						drop_client(&clients[c]);
+					break;
+				}
+			}
+		}
+		for (int c = 0; c < MAX_CLIENTS; c++) {
+			if (clients[c].fd >= 0 && now - clients[c].since > CLIENT_TIMEOUT) {
+				fprintf(stderr, "daemon: dropped a client stalled for %d ms\n", CLIENT_TIMEOUT);
+				drop_client(&clients[c]);
+			}
+		}
+		// a write reads back what it changed
+		if (served || published != sched.reads) {
+			shm_publish(&shm, snaps, ndev);
+			published = sched.reads;
+		}
+
+		if (ufds[0].revents & POLLIN) {
+			int fd;
+			while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+				int c;
+				for (c = 0; c < MAX_CLIENTS && clients[c].fd >= 0; c++)
+					;
+				if (c == MAX_CLIENTS) {
+					close(fd);
+					continue;
+				}
+				clients[c].fd = fd;
+				clients[c].len = 0;
+				clients[c].since = now;
+			}
+		}
+	}
+
+	for (int i = 0; i < MAX_CLIENTS; i++)
+		if (clients[i].fd >= 0)
+			drop_client(&clients[i]);
+	for (int i = 0; i < nnotify; i++)
+		if (notify_fds[i] >= 0)
+			close(notify_fds[i]);
+	close(listen_fd);
+	shm_publish_close(&shm);
+	if (socket_address(&addr) == 0)
+		unlink(addr.sun_path);
+	now = monotonic_ms();
+	fprintf(stderr, "daemon: %llu attribute reads in %.1f s, %.1f per second\n", (unsigned long long) sched.reads,
+			(now - start) / 1000.0, now > start ? sched.reads * 1000.0 / (now - start) : 0.0);
+	stats_print(stderr);
+	return 0;
+}
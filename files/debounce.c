@@ -0,0 +1,266 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ltc-monitor.h"
+
+static const char *const reg_names[DEBOUNCE_REGS] = { "alarm_reg", "mon_status", "chrg_status" };
+
+static void to_array(const struct status_regs *regs, int *v)
+{
+	v[0] = regs->alarms;
+	v[1] = regs->monitor;
+	v[2] = regs->chrg;
+}
+
+static void from_array(const int *v, struct status_regs *regs)
+{
+	regs->alarms = v[0];
+	regs->monitor = v[1];
+	regs->chrg = v[2];
+}
+
+/*
+ * --debounce MS[:MS] sets the delays of every bit, --debounce LVL=MS[:MS]
+ * the ones of the alarm of a level, e.g. gpi_ov_lvl=200:2000: the first
+ * delay is how long a bit must stay set before it is reported raised, the
+ * second how long it must stay clear before it is reported cleared, the
+ * first one if it is not given.
+ * Return: 0 on success, EINVAL if the option is not valid.
+ */
+int debounce_parse(struct debounce_config *cfg, const char *arg)
+{
+	const char *eq = strchr(arg, '=');
+	const char *delays = eq != NULL ? eq + 1 : arg;
+	long raise, clear;
+	char *end;
+	int bit = -1;
+
+	if (eq != NULL) {
+		char name[32];
+
+		snprintf(name, sizeof(name), "%.*s", (int) (eq - arg), arg);
+		for (int b = 0; b < NUM_ALARMS; b++)
+			if (strcmp(attr_table[alarm_table[b].lvl].name, name) == 0)
+				bit = b;
+		if (bit < 0) {
+			fprintf(stderr, "await: %s is not an alarm level\n", name);
+			return EINVAL;
+		}
+	}
+	raise = clear = strtol(delays, &end, 10);
+	if (*end == ':')
+		clear = strtol(end + 1, &end, 10);
+	if (end == delays || *end != '\0' || raise < 0 || clear < 0) {
+		fprintf(stderr, "await: invalid debounce delays %s\n", delays);
+		return EINVAL;
+	}
+
+	for (int r = 0; r < DEBOUNCE_REGS; r++) {
+		for (int b = 0; b < DEBOUNCE_BITS; b++) {
+			if (bit >= 0 && (r != 0 || b != bit))
+				continue;
+			cfg->raise[r][b] = raise;
+			cfg->clear[r][b] = clear;
+		}
+	}
+	return 0;
+}
+
+int debounce_enabled(const struct debounce_config *cfg)
+{
+	if (cfg->window > 0 || cfg->rate > 0)
+		return 1;
+	for (int r = 0; r < DEBOUNCE_REGS; r++)
+		for (int b = 0; b < DEBOUNCE_BITS; b++)
+			if (cfg->raise[r][b] || cfg->clear[r][b])
+				return 1;
+	return 0;
+}
+
+void debounce_init(struct debounce *db, const struct debounce_config *cfg, const struct status_regs *initial,
+		long long now)
+{
+	memset(db, 0, sizeof(*db));
+	to_array(initial, db->raw);
+	to_array(initial, db->stable);
+	db->tokens = cfg->rate;
+	db->refill = now;
+	db->deadline = -1;
+}
+
+/**
+ * debounce_notify() - take in the value of a status register that notified
+ * @reg: index of the register, in the order of struct status_regs
+ * @now: CLOCK_MONOTONIC milliseconds
+ *
+ * Nothing is read or printed here: a flapping input costs the read of the
+ * register that notified, and the bit operations below.
+*/
+void debounce_notify(struct debounce *db, const struct debounce_config *cfg, int reg, int value, long long now)
+{
+	int changed = (value ^ db->raw[reg]) & (int) (BIT(DEBOUNCE_BITS) - 1);
+
+	for (int b = 0; b < DEBOUNCE_BITS; b++) {
+		if (!(changed & BIT(b)))
+			continue;
+		db->since[reg][b] = now;
+		db->changes[reg][b]++;
+	}
+	db->raw[reg] = value;
+	if (db->notifications[0] + db->notifications[1] + db->notifications[2] == 0) {
+		clock_gettime(CLOCK_REALTIME, &db->first);
+		db->window_end = now + cfg->window;
+	}
+	clock_gettime(CLOCK_REALTIME, &db->last);
+	db->notifications[reg]++;
+}
+
+/*
+ * The state to report: the bits that held their new value for their delay.
+ * Return: CLOCK_MONOTONIC milliseconds when a bit still pending settles,
+ * -1 if none is pending.
+ */
+static long long settle(const struct debounce *db, const struct debounce_config *cfg, long long now, int *state)
+{
+	long long next = -1;
+
+	for (int r = 0; r < DEBOUNCE_REGS; r++) {
+		int diff = db->raw[r] ^ db->stable[r];
+
+		state[r] = db->stable[r];
+		for (int b = 0; b < DEBOUNCE_BITS; b++) {
+			long long due;
+
+			if (!(diff & BIT(b)))
+				continue;
+			due = db->since[r][b] + (db->raw[r] & BIT(b) ? cfg->raise[r][b] : cfg->clear[r][b]);
+			if (due <= now)
+				state[r] ^= BIT(b);
+			else if (next < 0 || due < next)
+				next = due;
+		}
+		// bits beyond DEBOUNCE_BITS are not debounced
+		state[r] = (state[r] & (int) (BIT(DEBOUNCE_BITS) - 1)) | (db->raw[r] & ~(int) (BIT(DEBOUNCE_BITS) - 1));
+	}
+	return next;
+}
+
+// the counts start over, and the window with the next notification
+static void close_window(struct debounce *db)
+{
+	memset(db->changes, 0, sizeof(db->changes));
+	memset(db->notifications, 0, sizeof(db->notifications));
+	db->held = 0;
+}
+
+/**
+ * debounce_poll() - tell whether a report is due
+ * @now: CLOCK_MONOTONIC milliseconds
+ * @regs: the debounced registers to report, filled in when a report is due
+ *
+ * A report is due once the coalescing window of the first notification
+ * has passed, if a bit settled to a new value or, with a window, if the
+ * notifications flapped a bit back and forth. The rate limit holds
+ * reports back: the notifications keep adding up to the next report. A
+ * window that passes with nothing to report is closed all the same.
+ * db->deadline is set to when a report may become due.
+ * Return: 1 if a report is due, 0 otherwise.
+*/
+int debounce_poll(struct debounce *db, const struct debounce_config *cfg, long long now, struct status_regs *regs)
+{
+	int state[DEBOUNCE_REGS], notifications, flapped = 0;
+	long long pending;
+
+	notifications = db->notifications[0] + db->notifications[1] + db->notifications[2];
+	if (notifications > 0 && now < db->window_end) {
+		db->deadline = db->window_end;
+		return 0;
+	}
+	pending = settle(db, cfg, now, state);
+	for (int r = 0; r < DEBOUNCE_REGS; r++)
+		for (int b = 0; b < DEBOUNCE_BITS; b++)
+			flapped |= db->changes[r][b] > 1;
+	if (memcmp(state, db->stable, sizeof(state)) == 0 && !(flapped && cfg->window > 0)) {
+		// nothing to report: the window closes, the next notification opens a new one
+		if (notifications > 0)
+			close_window(db);
+		db->deadline = pending;
+		return 0;
+	}
+
+	if (cfg->rate > 0) {
+		db->tokens += (now - db->refill) * cfg->rate / 60000.0;
+		if (db->tokens > cfg->rate)
+			db->tokens = cfg->rate;
+		db->refill = now;
+		if (db->tokens < 1) {
+			db->deadline = now + (long long) ((1 - db->tokens) * 60000 / cfg->rate) + 1;
+			db->held = 1;
+			return 0;
+		}
+		db->tokens -= 1;
+	}
+	memcpy(db->stable, state, sizeof(state));
+	from_array(state, regs);
+	db->deadline = pending;
+	return 1;
+}
+
+// the registers as last reported
+void debounce_stable(const struct debounce *db, struct status_regs *regs)
+{
+	from_array(db->stable, regs);
+}
+
+static void print_time(FILE *out, const struct timespec *ts)
+{
+	struct tm tm;
+	char buf[16];
+
+	gmtime_r(&ts->tv_sec, &tm);
+	strftime(buf, sizeof(buf), "%H:%M:%S", &tm);
+	fprintf(out, "%s.%03ld", buf, ts->tv_nsec / 1000000);
+}
+
+static const char *bit_name(int reg, int bit)
+{
+	if (reg == 0)
+		return alarm_table[bit].description;
+	return reg == 1 ? monitor_table[bit] : charger_table[bit];
+}
+
+/**
+ * debounce_report() - print what was coalesced in the report that is due
+ *
+ * One notification that changed one bit needs no summary. Otherwise the
+ * number of notifications of each register, their time span and the bits
+ * that changed more than once are printed; the counts start over.
+*/
+void debounce_report(FILE *out, struct debounce *db)
+{
+	int notifications = db->notifications[0] + db->notifications[1] + db->notifications[2];
+
+	if (notifications > 1) {
+		const char *sep = " (";
+
+		fprintf(out, "Coalesced %d notifications from ", notifications);
+		print_time(out, &db->first);
+		fprintf(out, " to ");
+		print_time(out, &db->last);
+		for (int r = 0; r < DEBOUNCE_REGS; r++) {
+			if (db->notifications[r]) {
+				fprintf(out, "%s%s %u", sep, reg_names[r], db->notifications[r]);
+				sep = ", ";
+			}
+		}
+		fprintf(out, ")%s\n", db->held ? ", held back by the rate limit" : "");
+		for (int r = 0; r < DEBOUNCE_REGS; r++)
+			for (int b = 0; b < DEBOUNCE_BITS; b++)
+				if (db->changes[r][b] > 1 && bit_name(r, b) != NULL)
+					fprintf(out, "Changed %u times: %s\n", db->changes[r][b], bit_name(r, b));
+	}
+	close_window(db);
+}
@@ -0,0 +1,277 @@
+#include <dirent.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <linux/magic.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+#include "ltc-monitor.h"
+
+struct ltc_device devices[MAX_DEVICES];
+int num_devices;
+
+static int read_line(const char *path, char *buf, size_t size)
+{
+	FILE *file = fopen(path, "r");
+
+	if (file == NULL)
+		return errno;
+	if (fgets(buf, size, file) == NULL) {
+		fclose(file);
+		return EIO;
+	}
+	fclose(file);
+	buf[strcspn(buf, "\n")] = '\0';
+	return 0;
+}
+
+static const char *basename_of(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+
+	return slash != NULL ? slash + 1 : path;
+}
+
+static struct ltc_device *add_device(const char *path)
+{
+	struct ltc_device *dev;
+	char link[PATH_MAX], target[PATH_MAX];
+	ssize_t len;
+
+	for (int i = 0; i < num_devices; i++)
+		if (strcmp(devices[i].path, path) == 0)
+			return &devices[i];
+	if (num_devices == MAX_DEVICES)
+		return NULL;
+
+	dev = &devices[num_devices++];
+	snprintf(dev->path, sizeof(dev->path), "%s", path);
+	snprintf(dev->name, sizeof(dev->name), "%s", basename_of(path));
+	// the i2c client the hwmon device belongs to, e.g. 2-0009
+	snprintf(link, sizeof(link), "%s/device", path);
+	len = readlink(link, target, sizeof(target) - 1);
+	if (len > 0) {
+		target[len] = '\0';
+		snprintf(dev->bus, sizeof(dev->bus), "%s", basename_of(target));
+	} else {
+		dev->bus[0] = '\0';
+	}
+	return dev;
+}
+
+static int hwmon_index(const char *name)
+{
+	return strncmp(name, "hwmon", 5) == 0 ? atoi(name + 5) : -1;
+}
+
+/*
+ * The hwmon class directory, LTC_MONITOR_HWMON_ROOT points to another one,
+ * such as a fake tree written by bench.
+ */
+const char *hwmon_root(void)
+{
+	const char *root = getenv("LTC_MONITOR_HWMON_ROOT");
+
+	return root != NULL && root[0] ? root : HWMON_ROOT;
+}
+
+/**
+ * discover_devices() - find the hwmon devices bound to the ltc3350 driver
+ *
+ * Devices are sorted by hwmon index. If there is none, the compiled-in
+ * SYSFS_PATH is used, when it exists and the hwmon root is the default one.
+ * Return: number of devices found.
+*/
+int discover_devices(void)
+{
+	int found[MAX_DEVICES];
+	int count = 0;
+	struct dirent *entry;
+	const char *root = hwmon_root();
+	char path[PATH_MAX], name[32];
+	DIR *dir;
+
+	num_devices = 0;
+	dir = opendir(root);
+	if (dir != NULL) {
+		while ((entry = readdir(dir)) != NULL && count < MAX_DEVICES) {
+			int index = hwmon_index(entry->d_name);
+			int i;
+
+			if (index < 0)
+				continue;
+			snprintf(path, sizeof(path), "%s/%s/name", root, entry->d_name);
+			if (read_line(path, name, sizeof(name)) || strcmp(name, LTC_DRIVER_NAME) != 0)
+				continue;
+			// insertion sort, there are only a few of them
+			for (i = count; i > 0 && found[i - 1] > index; i--)
+				found[i] = found[i - 1];
+			found[i] = index;
+			count++;
+		}
+		closedir(dir);
+	}
+
+	for (int i = 0; i < count; i++) {
+		snprintf(path, sizeof(path), "%s/hwmon%d", root, found[i]);
+		add_device(path);
+	}
+	if (num_devices == 0 && strcmp(root, HWMON_ROOT) == 0 && access(SYSFS_PATH, F_OK) == 0)
+		add_device(SYSFS_PATH);
+	return num_devices;
+}
+
+/**
+ * device_options() - parse the --device options in front of the command
+ * @selectors: filled with the selectors given, at most MAX_DEVICES
+ *
+ * On return argv[1] is the command.
+ * Return: number of selectors, -1 on a malformed option.
+*/
+int device_options(int *argc, char ***argv, const char **selectors)
+{
+	char **args = *argv;
+	int n = 0, i = 1;
+
+	while (i < *argc && args[i][0] == '-') {
+		const char *sel;
+
+		if (strncmp(args[i], "--device=", 9) == 0) {
+			sel = args[i] + 9;
+			i++;
+		} else if ((strcmp(args[i], "--device") == 0 || strcmp(args[i], "-d") == 0) && i + 1 < *argc) {
+			sel = args[i + 1];
+			i += 2;
+		} else {
+			return -1;
+		}
+		if (n == MAX_DEVICES)
+			return -1;
+		selectors[n++] = sel;
+	}
+
+	// keep the program name in argv[0]
+	args[i - 1] = args[0];
+	*argc -= i - 1;
+	*argv = args + i - 1;
+	return n;
+}
+
+/**
+ * device_matches() - tell whether a selector designates a device
+ * @index: of the device, in discovery order
+ *
+ * The one matcher of the --device selectors, see select_devices().
+ * Return: 1 if it does, 0 otherwise.
+*/
+int device_matches(const struct ltc_device *dev, int index, const char *selector)
+{
+	char *endptr;
+	long n;
+
+	if (strcmp(selector, "all") == 0 || strcmp(selector, dev->name) == 0
+			|| strcmp(selector, dev->path) == 0 || (dev->bus[0] && strcmp(selector, dev->bus) == 0))
+		return 1;
+	n = strtol(selector, &endptr, 10);
+	return *endptr == '\0' && endptr != selector && n == index;
+}
+
+// Return: 1 if one of the selectors designates the device
+int device_selected(const struct ltc_device *dev, int index, const char **selectors, int nsel)
+{
+	for (int s = 0; s < nsel; s++)
+		if (device_matches(dev, index, selectors[s]))
+			return 1;
+	return 0;
+}
+
+/**
+ * select_devices() - resolve selectors to devices
+ *
+ * A selector is the hwmon name (hwmon4), the i2c device (2-0009), the index
+ * in discovery order, the path of an hwmon directory, or "all".
+ * With no selectors, every device is selected.
+ * Return: number of devices selected, -ENODEV if a selector matches nothing.
+*/
+int select_devices(const char **selectors, int nsel, struct ltc_device **selected)
+{
+	int count = 0;
+
+	discover_devices();
+	if (nsel == 0) {
+		for (int i = 0; i < num_devices; i++)
+			selected[count++] = &devices[i];
+		return count;
+	}
+
+	for (int s = 0; s < nsel; s++) {
+		int matched = 0;
+
+		// a path can point to a device that was not discovered
+		if (selectors[s][0] == '/' && add_device(selectors[s]) == NULL)
+			return -ENOSPC;
+		for (int i = 0; i < num_devices; i++) {
+			int dup = 0;
+
+			if (!device_matches(&devices[i], i, selectors[s]))
+				continue;
+			matched = 1;
+			for (int j = 0; j < count; j++)
+				dup |= selected[j] == &devices[i];
+			if (!dup)
+				selected[count++] = &devices[i];
+		}
+		if (!matched) {
+			fprintf(stderr, "No ltc3350 device matches %s\n", selectors[s]);
+			return -ENODEV;
+		}
+	}
+	return count;
+}
+
+/**
+ * open_notify() - open an attribute to wait for its sysfs notifications
+ *
+ * The attribute is read once, so that poll() does not return at once.
+ * Notifications only exist on sysfs: on any other file system (a test
+ * tree, for instance) the attribute is not opened.
+ * Return: file descriptor, -1 on error.
+*/
+int open_notify(const struct ltc_device *dev, enum attr_id id)
+{
+	char path[PATH_MAX], data[8];
+	struct statfs st;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dev->path, attr_table[id].name);
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+		fprintf(stderr, "Cannot watch %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (fstatfs(fd, &st) < 0 || st.f_type != SYSFS_MAGIC) {
+		close(fd);
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	pread(fd, data, sizeof(data), 0);
+	return fd;
+}
+
+/*
+ * With more than one device each one gets its own file:
+ * report.csv becomes report-hwmon4.csv
+ */
+void device_filename(char *buf, size_t size, const char *name, const struct ltc_device *dev, int ndev)
+{
+	const char *dot = strrchr(name, '.');
+	const char *slash = strrchr(name, '/');
+
+	if (ndev == 1)
+		snprintf(buf, size, "%s", name);
+	else if (dot == NULL || (slash != NULL && dot < slash))
+		snprintf(buf, size, "%s-%s", name, dev->name);
+	else
+		snprintf(buf, size, "%.*s-%s%s", (int) (dot - name), name, dev->name, dot);
+}
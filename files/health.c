@@ -0,0 +1,255 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "health.h"
+
+#define SECONDS_PER_DAY 86400.0
+
+static void new_model(struct health_model *model)
+{
+	memset(model, 0, sizeof(*model));
+	memcpy(model->magic, HEALTH_MAGIC, 4);
+	model->version = HEALTH_VERSION;
+}
+
+/**
+ * health_load() - read the model of a device
+ *
+ * A model file that does not exist yet is a model without measurements.
+ * Return: 0 on success, otherwise error code
+*/
+int health_load(struct health_model *model, const char *path)
+{
+	ssize_t len;
+	int fd;
+
+	new_model(model);
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return errno == ENOENT ? 0 : throw("health: cannot open the model file", errno);
+	len = read(fd, model, sizeof(*model));
+	close(fd);
+	if (len != sizeof(*model) || memcmp(model->magic, HEALTH_MAGIC, 4) != 0 || model->version != HEALTH_VERSION) {
+		fprintf(stderr, "health: %s is not a model file\n", path);
+		return EINVAL;
+	}
+	return 0;
+}
+
+/**
+ * health_save() - write the model of a device
+ *
+ * The model is written next to the file and renamed over it, so that a
+ * crash leaves either the old model or the new one.
+ * Return: 0 on success, otherwise error code
+*/
+int health_save(const struct health_model *model, const char *path)
+{
+	char tmp[PATH_MAX];
+	int fd, err = 0;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp))
+		return ENAMETOOLONG;
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+		return throw("health: cannot create the model file", errno);
+	if (write(fd, model, sizeof(*model)) != sizeof(*model))
+		err = throw("health: cannot write the model", errno ? errno : EIO);
+	if (!err && fsync(fd) < 0)
+		err = throw("health: cannot write the model", errno);
+	if (close(fd) < 0 && !err)
+		err = throw("health: cannot write the model", errno);
+	if (!err && rename(tmp, path) < 0)
+		err = throw("health: cannot rename the model file", errno);
+	if (err)
+		unlink(tmp);
+	return err;
+}
+
+/**
+ * health_record() - add a measurement to a series of the model
+ * @when: CLOCK_REALTIME seconds of the measurement
+*/
+void health_record(struct health_model *model, struct health_series *series, double value, int64_t when)
+{
+	struct health_stats *st = &series->stats;
+	struct health_fit *fit = &series->fit;
+	double t, dt, dy;
+
+	if (model->cap.stats.count == 0 && model->esr.stats.count == 0)
+		model->origin = when;
+	t = (when - model->origin) / SECONDS_PER_DAY;
+
+	st->count++;
+	dy = value - st->mean;
+	st->mean += dy / st->count;
+	st->m2 += dy * (value - st->mean);
+	if (st->count == 1 || value < st->min)
+		st->min = value;
+	if (st->count == 1 || value > st->max)
+		st->max = value;
+
+	fit->count++;
+	dt = t - fit->mean_t;
+	fit->mean_t += dt / fit->count;
+	fit->mean_y += (value - fit->mean_y) / fit->count;
+	fit->m2_t += dt * (t - fit->mean_t);
+	fit->c_ty += dt * (value - fit->mean_y);
+
+	series->last = value;
+	series->last_time = when;
+}
+
+/*
+ * A measurement is new when its done bit goes active: the bit is cleared
+ * when the next measurement starts.
+ */
+static int record_done(struct health_model *model, struct health_series *series, const struct ltc_device *dev,
+		enum attr_id meas, int64_t when)
+{
+	struct snapshot snap;
+	int raw;
+
+	snapshot_init(&snap, dev, 1);
+	if ((raw = snapshot_get(&snap, meas)) == -1)
+		return 0;
+	health_record(model, series, attr_to_si(meas, raw), when);
+	return 1;
+}
+
+/**
+ * health_update() - record the measurements completed since the last report
+ * @before: status registers at the last report
+ * @after: status registers now
+ *
+ * The model is saved whenever it changes.
+ * Return: 0 on success, otherwise error code
+*/
+int health_update(struct health_model *model, const char *path, const struct ltc_device *dev,
+		const struct status_regs *before, const struct status_regs *after)
+{
+	int done = after->monitor & ~before->monitor, changed = 0;
+	struct timespec now;
+
+	if (after->monitor == -1)
+		return 0;
+	clock_gettime(CLOCK_REALTIME, &now);
+	if (done & MON_CAP_DONE)
+		changed |= record_done(model, &model->cap, dev, ATTR_MEAS_CAP, now.tv_sec);
+	if (done & MON_ESR_DONE)
+		changed |= record_done(model, &model->esr, dev, ATTR_MEAS_ESR, now.tv_sec);
+	return changed ? health_save(model, path) : 0;
+}
+
+/*
+ * Projection of the fitted line to a level: the number of days from now
+ * until it is crossed, in the direction the measurement degrades.
+ * Return: 1 if it is projected, 0 if the series does not degrade (yet).
+ */
+static int project(const struct health_model *model, const struct health_series *series, double level,
+		int falling, double *days)
+{
+	const struct health_fit *fit = &series->fit;
+	double slope, t;
+
+	if (fit->count < 2 || fit->m2_t <= 0)
+		return 0;
+	slope = fit->c_ty / fit->m2_t;
+	if (falling ? slope >= 0 : slope <= 0)
+		return 0;
+	t = fit->mean_t + (level - fit->mean_y) / slope;
+	*days = t - (time(NULL) - model->origin) / SECONDS_PER_DAY;
+	return 1;
+}
+
+static void report_series(FILE *out, const struct health_model *model, const struct health_series *series,
+		const char *what, const char *unit, struct snapshot *snap, enum attr_id lvl, int falling)
+{
+	const struct health_stats *st = &series->stats;
+	char date[16];
+	double days;
+	time_t when;
+	int raw;
+
+	if (st->count == 0) {
+		fprintf(out, "%s: no measurement yet\n", what);
+		return;
+	}
+	fprintf(out, "%s: %llu measurements, last %.4g %s, mean %.4g %s, sd %.3g %s, min %.4g %s, max %.4g %s\n",
+			what, (unsigned long long) st->count, series->last, unit, st->mean, unit,
+			st->count > 1 ? sqrt(st->m2 / (st->count - 1)) : 0.0, unit, st->min, unit, st->max, unit);
+	if (series->fit.count < 2 || series->fit.m2_t <= 0) {
+		fprintf(out, "%s trend: not enough measurements\n", what);
+		return;
+	}
+	fprintf(out, "%s trend: %+.4g %s/day", what, series->fit.c_ty / series->fit.m2_t, unit);
+	if ((raw = snapshot_get(snap, lvl)) == -1 || raw == 0) {
+		fprintf(out, ", %s not set\n", attr_table[lvl].name);
+		return;
+	}
+	if (!project(model, series, attr_to_si(lvl, raw), falling, &days)) {
+		fprintf(out, ", not heading for %s\n", attr_table[lvl].name);
+		return;
+	}
+	when = time(NULL) + (time_t) (days * SECONDS_PER_DAY);
+	strftime(date, sizeof(date), "%Y-%m-%d", gmtime(&when));
+	if (days <= 0)
+		fprintf(out, ", past %s (%.4g %s) since %s\n", attr_table[lvl].name, attr_to_si(lvl, raw), unit, date);
+	else
+		fprintf(out, ", reaches %s (%.4g %s) in %.0f days, on %s\n", attr_table[lvl].name,
+				attr_to_si(lvl, raw), unit, days, date);
+}
+
+/**
+ * health_report() - print the state of the capacitors and their end of life
+ *
+ * The capacitance fade and the ESR growth are the slopes of the fitted
+ * lines, projected to cap_lo_lvl and esr_hi_lvl.
+*/
+void health_report(FILE *out, const struct health_model *model, struct snapshot *snap)
+{
+	report_series(out, model, &model->cap, "Capacitance", "F", snap, ATTR_CAP_LO_LVL, 1);
+	report_series(out, model, &model->esr, "ESR", "ohm", snap, ATTR_ESR_HI_LVL, 0);
+}
+
+/**
+ * health_command() - print the capacitor health model of the devices
+ *
+ * The models are recorded by await --health; --file is the same file
+ * (one per device with more than one device, see device_filename()).
+ * Return: 0 on success, otherwise error code
+*/
+int health_command(int argc, char *argv[], struct ltc_device **devs, int ndev)
+{
+	static const struct option options[] = {
+		{ "file", required_argument, NULL, 'f' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct health_model model;
+	struct snapshot snap;
+	char path[PATH_MAX];
+	const char *file = HEALTH_FILE;
+	int opt, err;
+
+	optind = 1;
+	while ((opt = getopt_long(argc, argv, "f:", options, NULL)) != -1) {
+		if (opt != 'f')
+			return EINVAL;
+		file = optarg;
+	}
+
+	for (int d = 0; d < ndev; d++) {
+		device_filename(path, sizeof(path), file, devs[d], ndev);
+		if ((err = health_load(&model, path)))
+			return err;
+		snapshot_init(&snap, devs[d], 1);
+		device_header(stdout, devs[d], ndev);
+		health_report(stdout, &model, &snap);
+	}
+	return 0;
+}
@@ -0,0 +1,64 @@
+#ifndef HEALTH_H
+#define HEALTH_H
+
+#include <stdint.h>
+
+#include "ltc-monitor.h"
+
+#define HEALTH_MAGIC "LTCH"
+#define HEALTH_VERSION 1
+#define HEALTH_FILE "/var/lib/ltc-monitor/health"
+
+/*
+ * Running statistics of a measurement (Welford): the mean and the sum of
+ * squared differences from it are updated one measurement at a time.
+ */
+struct health_stats {
+	uint64_t count;
+	double mean;
+	double m2;
+	double min;
+	double max;
+};
+
+/*
+ * Least squares line of a measurement against time, kept as the means and
+ * co-moments of time and value, so that it is updated in constant time and
+ * memory. Time is in days since the model's origin.
+ */
+struct health_fit {
+	uint64_t count;
+	double mean_t;
+	double mean_y;
+	double m2_t; // sum of squared differences of t from its mean
+	double c_ty; // sum of products of the differences of t and y
+};
+
+struct health_series {
+	struct health_stats stats;
+	struct health_fit fit;
+	double last; // last measurement
+	int64_t last_time; // CLOCK_REALTIME seconds of the last measurement
+};
+
+/*
+ * Model file: all it takes to carry on after a restart, without going
+ * through the logs again. All fields are in host byte order.
+ */
+struct health_model {
+	char magic[4];
+	uint16_t version;
+	uint16_t reserved;
+	int64_t origin; // CLOCK_REALTIME seconds of the first measurement
+	struct health_series cap; // farads
+	struct health_series esr; // ohms
+};
+
+int health_load(struct health_model *model, const char *path);
+int health_save(const struct health_model *model, const char *path);
+void health_record(struct health_model *model, struct health_series *series, double value, int64_t when);
+int health_update(struct health_model *model, const char *path, const struct ltc_device *dev,
+		const struct status_regs *before, const struct status_regs *after);
+void health_report(FILE *out, const struct health_model *model, struct snapshot *snap);
+
+#endif
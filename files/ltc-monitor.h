@@ -0,0 +1,425 @@
+#ifndef LTC_MONITOR_H
+#define LTC_MONITOR_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "attr.h"
+
+#define BIT(nr) (1UL << (nr))
+
+// alarm_reg bits
+#define ALARM_CAP_UV BIT(0) //capacitor undervoltage alarm
+#define ALARM_CAP_OV BIT(1) //capacitor overvoltage alarm
+#define ALARM_GPI_UV BIT(2) //gpi undervoltage alarm
+#define ALARM_GPI_OV BIT(3) //gpi overvoltage alarm
+#define ALARM_VIN_UV BIT(4) //vin undervoltage alarm
+#define ALARM_VIN_OV BIT(5) //vin overvoltage alarm
+#define ALARM_VCAP_UV BIT(6) //vcap undervoltage alarm
+#define ALARM_VCAP_OV BIT(7) //vcap overvoltage alarm
+#define ALARM_VOUT_UV BIT(8) //vout undervoltage alarm
+#define ALARM_VOUT_OV BIT(9) //vout overvoltage alarm
+#define ALARM_IIN_OC BIT(10) //input overcurrent alarm
+#define ALARM_ICHG_UC BIT(11) //charge undercurrent alarm
+#define ALARM_DTEMP_COLD BIT(12) //die temperature cold alarm
+#define ALARM_DTEMP_HOT BIT(13) //die temperature hot alarm
+#define ALARM_ESR_HI BIT(14) //esr high alarm
+#define ALARM_CAP_LO BIT(15) //capacitance low alarm
+
+// mon status bits
+#define MON_CAPSR_ACTIVE BIT(0)
+#define MON_CAPESR_SCHEDULED BIT(1)
+#define MON_CAPESR_PENDING BIT(2)
+#define MON_CAP_DONE BIT(3)
+#define MON_ESR_DONE BIT(4)
+#define MON_CAP_FAILED BIT(5)
+#define MON_ESR_FAILED BIT(6)
+#define MON_POWER_FAILED BIT(8)
+#define MON_POWER_RETURNED BIT(9)
+
+// charger status bits
+#define CHRG_STEPDOWN BIT(0)
+#define CHRG_STEPUP BIT(1)
+#define CHRG_CV BIT(2)
+#define CHRG_UVLO BIT(3)
+#define CHRG_INPUT_ILIM BIT(4)
+#define CHRG_CAPPG BIT(5)
+#define CHRG_SHNT BIT(6)
+#define CHRG_BAL BIT(7)
+#define CHRG_DIS BIT(8)
+#define CHRG_CI BIT(9)
+#define CHRG_PFO BIT(11)
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+//ohms
+#define RT 86600
+#define RTST 121
+// microohms
+#define RSNSC 5
+
+// used when no device is found through HWMON_ROOT
+#ifndef SYSFS_PATH
+#define SYSFS_PATH "/sys/bus/i2c/devices/i2c-2/2-0009/hwmon/hwmon4"
+#endif
+#ifndef HWMON_ROOT
+#define HWMON_ROOT "/sys/class/hwmon"
+#endif
+#define LTC_DRIVER_NAME "ltc3350"
+#define MAX_DEVICES 8
+
+struct ltc_device {
+	char path[256]; // hwmon directory
+	char name[32]; // e.g. hwmon4
+	char bus[32]; // i2c device, e.g. 2-0009
+};
+
+/*
+ * Values of the attributes of a device.
+ * A live snapshot reads missing attributes from sysfs the first time they are
+ * asked for, otherwise only the values already in it are available.
+ */
+struct snapshot {
+	struct timespec time; // CLOCK_REALTIME of the newest read, full or of one attribute
+	uint64_t valid; // bitmask of the attributes in raw
+	int live;
+	const struct ltc_device *dev;
+	int raw[NUM_ATTRS];
+	int conv[NUM_ATTRS]; // raw converted to the attribute's unit, once
+};
+
+// the status registers last reported, status_diff() prints what changed
+struct status_regs {
+	int alarms;
+	int monitor;
+	int chrg;
+};
+
+// main.c
+#define SHOW_LINE_MAX 64 // one attribute in show()
+#define OUTPUT_MAX 16384
+int show(FILE *out, struct snapshot *snap);
+int status(FILE *out, struct snapshot *snap);
+int read_attr(FILE *out, struct snapshot *snap, const char *name, int convert);
+void device_header(FILE *out, const struct ltc_device *dev, int ndev);
+int await_alerts(int argc, char *argv[], struct ltc_device **devs, int ndev);
+int write_value(FILE *out, const struct ltc_device *dev, char *name, char *value, char *unit);
+int read_file(const struct ltc_device *dev, const char *attr_name, char *buf);
+int read_integer_value(const struct ltc_device *dev, const char *attr_name);
+int status_report(FILE *out, struct snapshot *snap);
+int status_diff(FILE *out, struct status_regs *last, struct snapshot *snap);
+int clear_all(FILE *out, struct snapshot *snap);
+int convert_to_LSB(long value, char *unit, char *attr, int *lsb);
+int convert_from_LSB(const char *buf, const char *attr_name, char *conv, size_t size);
+int LSB_to_celsius(long long meas_dtemp);
+int LSB_to_farads(int units);
+int LSB_to_milliohms(int units);
+int LSB_to_millivolts(int units, int conversion_factor);
+int celsius_to_LSB(int degrees);
+int farads_to_LSB(long long cap);
+int meas_trunc(long long number);
+int milliohms_to_LSB(long long esr);
+int millivolts_to_LSB(long long voltage_millivolts, int conversion_factor);
+
+// sample.c
+#define SAMPLE_COLUMNS 10
+#define SAMPLE_ROW_MAX 256
+
+struct sample_row {
+	struct timespec time; // CLOCK_REALTIME
+	long raw[SAMPLE_COLUMNS];
+	unsigned int valid; // bitmask of the columns that were read
+};
+
+// in sample_row.valid: the columns may come from two measurement cycles
+#define SAMPLE_STRADDLED (1U << 15)
+
+int sample(int argc, char *argv[], struct ltc_device **devs, int ndev);
+int sample_format_header(char *buf, size_t size);
+int sample_format_row(char *buf, size_t size, const struct sample_row *row, int hz);
+int sample_parse_row(const char *line, struct sample_row *row);
+void sample_snapshot_row(struct snapshot *snap, struct sample_row *row);
+int sample_open_columns(const struct ltc_device *dev, int *fds);
+int sample_read_column(const int *fds, int column, long *value);
+void sample_read_columns(const int *fds, struct sample_row *row);
+void sample_close_columns(int *fds);
+int sample_column(enum attr_id id);
+enum attr_id sample_column_id(int column);
+double sample_column_value(int column, double raw);
+
+// snapshot.c
+void snapshot_init(struct snapshot *snap, const struct ltc_device *dev, int live);
+int snapshot_read(struct snapshot *snap);
+int snapshot_has(struct snapshot *snap, enum attr_id id);
+int snapshot_get(struct snapshot *snap, enum attr_id id);
+void snapshot_set(struct snapshot *snap, enum attr_id id, int value);
+int snapshot_update(struct snapshot *snap, enum attr_id id);
+
+// device.c
+extern struct ltc_device devices[MAX_DEVICES];
+extern int num_devices;
+
+const char *hwmon_root(void);
+int discover_devices(void);
+int device_options(int *argc, char ***argv, const char **selectors);
+int device_matches(const struct ltc_device *dev, int index, const char *selector);
+int device_selected(const struct ltc_device *dev, int index, const char **selectors, int nsel);
+int select_devices(const char **selectors, int nsel, struct ltc_device **selected);
+int open_notify(const struct ltc_device *dev, enum attr_id id);
+void device_filename(char *buf, size_t size, const char *name, const struct ltc_device *dev, int ndev);
+
+// daemon.c
+int run_daemon(int argc, char *argv[], struct ltc_device **devs, int ndev);
+int daemon_request(int argc, char *argv[], const char **selectors, int nsel);
+
+// balance.c
+#define BALANCE_CELLS 4
+
+// one lane per cell: NEON or SSE registers where the target has them
+typedef float v4sf __attribute__((vector_size(16)));
+
+struct balance_config {
+	float spread_mv; // imbalance warning above this spread between the cells
+	float drift_mv_min; // drift warning above this trend of a cell's deviation
+	float tau; // time constant of the trends, in seconds
+};
+
+struct balance {
+	const struct ltc_device *dev;
+	struct balance_config cfg;
+	int col[BALANCE_CELLS]; // sample columns of the cells
+	v4sf scale; // mV per LSB of each cell
+	v4sf dev_mv; // deviation of each cell from the mean, mV
+	v4sf last_dev;
+	v4sf trend; // of the deviations, mV/min
+	float spread;
+	float max_spread;
+	float elapsed; // seconds analyzed
+	struct timespec time; // of the last sample
+	uint64_t samples;
+	unsigned int populated; // bitmask of the cells
+	unsigned int analyzed; // bitmask of the cells of the last sample: the deviations are from their mean
+	unsigned int drifting; // bitmask of the cells
+	int imbalance;
+};
+
+void balance_init(struct balance *b, const struct ltc_device *dev, const struct balance_config *cfg);
+int balance_update(struct balance *b, const struct sample_row *row);
+void balance_summary(FILE *out, const struct balance *b);
+
+// sched.c
+struct sched_config {
+	long min_period; // ms, status registers and measurements on the move
+	long max_period; // ms, measurements that do not move
+	double slope[NUM_UNITS]; // per second: a measurement moving faster is read every min_period
+};
+
+struct sched_entry {
+	long long deadline; // CLOCK_MONOTONIC ms
+	uint8_t dev;
+	uint8_t id;
+};
+
+struct sched_attr {
+	long period; // ms, 0 if the attribute is only read on demand
+	long long last_time; // CLOCK_MONOTONIC ms of the last read
+	int pos; // index in the heap, -1 if it is not scheduled
+};
+
+// min-heap of the next read of every scheduled attribute
+struct scheduler {
+	struct sched_config cfg;
+	struct snapshot *snaps;
+	int ndev;
+	struct sched_entry heap[MAX_DEVICES * NUM_ATTRS];
+	int size;
+	struct sched_attr attrs[MAX_DEVICES][NUM_ATTRS];
+	uint64_t reads;
+};
+
+extern const double sched_default_slope[NUM_UNITS];
+
+void sched_init(struct scheduler *s, const struct sched_config *cfg, struct snapshot *snaps, int ndev, long long now);
+void sched_set_period(struct scheduler *s, int dev, enum attr_id id, long period);
+long long sched_next(const struct scheduler *s);
+int sched_run(struct scheduler *s, long long now);
+void sched_read(struct scheduler *s, int dev, enum attr_id id, long long now);
+
+// cycle.c
+#define CYCLE_LEARN 2000 // ms the cycle is learned for, at least
+#define CYCLE_LEARN_MAX 256 // changes kept while learning
+#define CYCLE_LEARN_STEP 1 // ms between the reads of the rows while learning
+#define CYCLE_MISSES 8 // rows in a row off the cycle before it is learned again
+
+enum cycle_state {
+	CYCLE_LEARNING,
+	CYCLE_LOCKED, // the sentinel is polled around the update expected
+	CYCLE_FREE, // no cycle found: the rows are read at the sampling rate
+};
+
+/*
+ * The measurement cycle of a device, as learned from the changes of its
+ * meas_* registers, and the phase the sampler is locked to. Times are
+ * CLOCK_MONOTONIC ns.
+ */
+struct cycle {
+	enum cycle_state state;
+	int64_t learn_time;
+	int64_t learn_end;
+	struct sample_row prev; // last row read while learning
+	int64_t prev_start;
+	int nchanges[SAMPLE_COLUMNS];
+	int64_t changes[SAMPLE_COLUMNS][CYCLE_LEARN_MAX]; // when each column changed, about
+	int64_t resolution; // of those times: the longest time between two row reads
+
+	int sentinel; // the column that changes most often, it tells when the registers update
+	long last; // its value last read
+	int64_t period;
+	int64_t learned; // the period as learned, the tracking stays within a factor 2 of it
+	int64_t next; // the next update expected
+	int64_t guard; // the sentinel is polled from this long before it to twice as long after it
+	int64_t poll; // the next poll, or the next read of a row while learning
+	int refresh; // the next poll is between two updates, it only reads the sentinel's value
+	int every; // cycles per row, so that the rows do not come faster than the sampling rate
+	int misses; // rows in a row off the cycle: the update came early or late, or straddled the row
+
+	uint64_t rows;
+	uint64_t reads;
+	uint64_t early; // the update came before the first poll
+	uint64_t missed; // no update within the polls
+	uint64_t straddles; // the update came while the row was read
+	uint64_t incoherent; // straddled again when read again
+	uint64_t relearns;
+};
+
+void cycle_init(struct cycle *c, int64_t now, int64_t learn);
+int cycle_learn(struct cycle *c, const struct sample_row *row, int64_t start, int64_t end, long hz);
+int cycle_poll(struct cycle *c, long value, int64_t when);
+int cycle_check(struct cycle *c, long before, long after, int64_t start, int64_t end);
+void cycle_advance(struct cycle *c, int64_t now);
+void cycle_summary(FILE *out, const struct ltc_device *dev, const struct cycle *c);
+
+// ring.c
+int export_ring(int argc, char *argv[]);
+
+// store.c
+int store_command(int argc, char *argv[]);
+
+// rollup.c
+int rollup_command(int argc, char *argv[]);
+
+// bench.c
+int bench(int argc, char *argv[]);
+int fake_device_create(const char *root, int n, struct ltc_device *dev);
+void fake_device_remove(const struct ltc_device *dev);
+
+// convert.c
+void LSB_to_millivolts_n(const int32_t *restrict raw, int32_t *restrict out, size_t n, int factor);
+void LSB_to_celsius_n(const int32_t *restrict raw, int32_t *restrict out, size_t n);
+void LSB_to_farads_n(const int32_t *restrict raw, int32_t *restrict out, size_t n);
+void LSB_to_milliohms_n(const int32_t *restrict raw, int32_t *restrict out, size_t n);
+void millivolts_to_LSB_n(const int32_t *restrict value, int32_t *restrict out, size_t n, int factor);
+void celsius_to_LSB_n(const int32_t *restrict value, int32_t *restrict out, size_t n);
+void farads_to_LSB_n(const int32_t *restrict value, int32_t *restrict out, size_t n);
+void milliohms_to_LSB_n(const int32_t *restrict value, int32_t *restrict out, size_t n);
+void attr_from_LSB_n(enum attr_id id, const int32_t *raw, int32_t *out, size_t n);
+void attr_to_LSB_n(enum attr_id id, const int32_t *value, int32_t *out, size_t n);
+int convert_verify(int argc, char *argv[]);
+
+// simulate.c
+int simulate(int argc, char *argv[]);
+
+// profile.c
+int profile_command(int argc, char *argv[], struct ltc_device **devs, int ndev);
+
+// metrics.c
+int export_metrics(int argc, char *argv[], struct ltc_device **devs, int ndev);
+
+// capture.c
+struct capture_config {
+	const char *dir; // where the capture files are written
+	long pretrigger; // seconds kept before a trigger
+	long post; // seconds captured after it
+	long history_hz; // sampling rate out of a burst
+	long burst_hz; // sampling rate during a burst
+};
+
+struct capture {
+	const struct ltc_device *dev;
+	int fds[SAMPLE_COLUMNS];
+	struct sample_row *history; // pre-trigger window, a ring of capacity rows
+	size_t capacity;
+	size_t head; // next row written
+	size_t count;
+	FILE *out; // capture file, NULL out of a burst
+	struct timespec until; // CLOCK_MONOTONIC end of the burst
+};
+
+int capture_open(struct capture *c, const struct ltc_device *dev, const struct capture_config *cfg);
+void capture_close(struct capture *c);
+int capture_sample(struct capture *c, const struct capture_config *cfg);
+const char *capture_trigger_reason(const struct status_regs *before, const struct status_regs *after);
+int capture_trigger(struct capture *c, const struct capture_config *cfg, const char *reason);
+
+// debounce.c
+#define DEBOUNCE_REGS 3 // the registers of struct status_regs
+#define DEBOUNCE_BITS 16
+
+struct debounce_config {
+	long raise[DEBOUNCE_REGS][DEBOUNCE_BITS]; // ms a bit must stay set before it is reported
+	long clear[DEBOUNCE_REGS][DEBOUNCE_BITS]; // ms it must stay clear
+	long window; // ms notifications are coalesced over, 0 for none
+	int rate; // reports per minute, 0 for no limit
+};
+
+struct debounce {
+	int raw[DEBOUNCE_REGS]; // the values last read
+	int stable[DEBOUNCE_REGS]; // the values last reported
+	long long since[DEBOUNCE_REGS][DEBOUNCE_BITS]; // CLOCK_MONOTONIC ms of the last change of each bit
+	unsigned int changes[DEBOUNCE_REGS][DEBOUNCE_BITS]; // since the last report
+	unsigned int notifications[DEBOUNCE_REGS];
+	struct timespec first, last; // CLOCK_REALTIME of the first and last of them
+	long long window_end;
+	double tokens; // reports the rate limit allows right now
+	long long refill;
+	int held; // a report is held back by the rate limit
+	long long deadline; // CLOCK_MONOTONIC ms when a report may be due, -1 for none
+};
+
+int debounce_parse(struct debounce_config *cfg, const char *arg);
+int debounce_enabled(const struct debounce_config *cfg);
+void debounce_init(struct debounce *db, const struct debounce_config *cfg, const struct status_regs *initial,
+		long long now);
+void debounce_notify(struct debounce *db, const struct debounce_config *cfg, int reg, int value, long long now);
+int debounce_poll(struct debounce *db, const struct debounce_config *cfg, long long now, struct status_regs *regs);
+void debounce_stable(const struct debounce *db, struct status_regs *regs);
+void debounce_report(FILE *out, struct debounce *db);
+
+// health.c
+int health_command(int argc, char *argv[], struct ltc_device **devs, int ndev);
+
+// stats.c
+#define STATS_RETRIES 1 // further attempts after a transient error
+
+enum stats_op {
+	STATS_READ,
+	STATS_WRITE,
+	STATS_OPS
+};
+
+uint64_t stats_start(void);
+void stats_record(enum attr_id id, enum stats_op op, uint64_t start, int err);
+void stats_retry(enum attr_id id, enum stats_op op);
+int stats_transient(int err);
+void stats_print(FILE *out);
+int stats_command(int argc, char *argv[], struct ltc_device **devs, int ndev);
+
+static inline int throw(const char *message, int error)
+{
+	perror(message);
+	return error;
+}
+
+#endif
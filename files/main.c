@@ -1,8 +1,6 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <poll.h>
-#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,56 +8,10 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "attr.h"
+#include "ltc-monitor.h"
+#include "shm.h"
 
-#define BIT(nr) (1UL << (nr))
-
-// alarm_reg bits
-#define ALARM_CAP_UV BIT(0) //capacitor undervoltage alarm
-#define ALARM_CAP_OV BIT(1) //capacitor overvoltage alarm
-#define ALARM_GPI_UV BIT(2) //gpi undervoltage alarm
-#define ALARM_GPI_OV BIT(3) //gpi overvoltage alarm
-#define ALARM_VIN_UV BIT(4) //vin undervoltage alarm
-#define ALARM_VIN_OV BIT(5) //vin overvoltage alarm
-#define ALARM_VCAP_UV BIT(6) //vcap undervoltage alarm
-#define ALARM_VCAP_OV BIT(7) //vcap overvoltage alarm
-#define ALARM_VOUT_UV BIT(8) //vout undervoltage alarm
-#define ALARM_VOUT_OV BIT(9) //vout overvoltage alarm
-#define ALARM_IIN_OC BIT(10) //input overcurrent alarm
-#define ALARM_ICHG_UC BIT(11) //charge undercurrent alarm
-#define ALARM_DTEMP_COLD BIT(12) //die temperature cold alarm
-#define ALARM_DTEMP_HOT BIT(13) //die temperature hot alarm
-#define ALARM_ESR_HI BIT(14) //esr high alarm
-#define ALARM_CAP_LO BIT(15) //capacitance low alarm
-
-// mon status bits
-#define MON_CAPSR_ACTIVE BIT(0)
-#define MON_CAPESR_SCHEDULED BIT(1)
-#define MON_CAPESR_PENDING BIT(2)
-#define MON_CAP_DONE BIT(3)
-#define MON_ESR_DONE BIT(4)
-#define MON_CAP_FAILED BIT(5)
-#define MON_ESR_FAILED BIT(6)
-#define MON_POWER_FAILED BIT(8)
-#define MON_POWER_RETURNED BIT(9)
-
-// charger status bits
-#define CHRG_STEPDOWN BIT(0)
-#define CHRG_STEPUP BIT(1)
-#define CHRG_CV BIT(2)
-#define CHRG_UVLO BIT(3)
-#define CHRG_INPUT_ILIM BIT(4)
-#define CHRG_CAPPG BIT(5)
-#define CHRG_SHNT BIT(6)
-#define CHRG_BAL BIT(7)
-#define CHRG_DIS BIT(8)
-#define CHRG_CI BIT(9)
-#define CHRG_PFO BIT(11)
-
-
-#define log_monitor(alert_name, description) \
-	if (monitor & alert_name) { \
-		printf(#description "\n"); \
-	}
 
 /*
 #define log_alarm(alert_name, reg1, reg2, description) \
@@ -74,207 +26,223 @@
   }
 */
 
-#define PATH_MAX 4096
-//ohms
-#define RT 86600
-#define RTST 121
-// microohms
-#define RSNSC 5
-
-static int fds[3] = {-1, -1, -1};
-
-int show();
-int await_alerts();
-int write_value(char *name, char *value, char *unit);
-int read_file(char *attr_name, char *buf);
-int read_integer_value(char *attr_name);
-int status_report();
-int clear_all();
 int sensors();
-void signal_handler(int sig);
-int convert_to_LSB(long value, char *unit, char *attr);
-char * convert_from_LSB(char * buf, char * attr_name);
-int LSB_to_celsius(long long meas_dtemp);
-int LSB_to_farads(int units);
-int LSB_to_milliohms(int units);
-int LSB_to_millivolts(int units, int conversion_factor);
-int celsius_to_LSB(int degrees);
-int farads_to_LSB(long long cap);
-int meas_trunc(long long number);
-int milliohms_to_LSB(long long esr);
-int millivolts_to_LSB(long long voltage_millivolts, int conversion_factor);
-int starts_with(const char *str, const char *prefix);
-static inline int throw(const char *message, int error);
-static inline void log_chrg(int chrg, int bit, const char *description);
-static void log_alarm(int alarms, int alarm_num, char *alarm_desc, char *reg1, char *reg2, char *desc1, char *desc2);
+static void log_bits(FILE *out, int reg, const char *const *table);
+static void log_alarm(FILE *out, struct snapshot *snap, int alarms, int bit);
+static void log_alarm_values(FILE *out, struct snapshot *snap, int bit);
 char * description(char *reg);
 
-#define SYSFS_PATH "/sys/bus/i2c/devices/i2c-2/2-0009/hwmon/hwmon4"
-#define usage "Usage: %s <command>\nAccepted commands:\n\tshow\n\tawait\n\twrite file value [measurement unit]\n\tread [-c] file\n\tclear\n\tstatus\n"
+#define usage "Usage: %s [--device device]... <command>\nAccepted commands:\n\tshow\n\tawait [--interval MS] [--full] [--capture DIR [--pretrigger S] [--post S] [--capture-hz N] [--history-hz N]] [--health F] [--debounce [LVL=]MS[:MS]]... [--coalesce MS] [--rate N] [--action BIT[/MS]=exec:CMD|fifo:PATH|write:ATTR=VALUE]... [--action-timeout MS] [--workers N] [--queue N]\n\twrite file value [measurement unit]\n\tread [-c] file\n\tclear\n\tstatus\n\tdaemon [--interval MS] [--max-interval MS] [--slope-mv MV] [--slope-c C]\n\tpeek [--watch MS] [show | status | read [-c] file]\n\tsample [--hz N] [--duration S] [--file F] [--ring R [--ring-size N]] [--store S] [--rollup R] [--balance [--spread-limit MV] [--drift-limit MV] [--balance-tau S]] [--queue N] [--flush MS] [--fsync never|batch|MS] [--lock [--learn MS]]\n\texport ring [--from T] [--to T] [--last N] [--file F]\n\tstore import --store S [--date YYYY-MM-DD] [--hz N] csv...\n\tstore export S [--from T] [--to T] [--file F]\n\tstore info S\n\trollup query R [--from T] [--to T] [--tier 1m|1h] [--format csv|json] [--file F]\n\trollup info R\n\trollup import R store...\n\tbench [--iterations N] [--dir D] [--keep]\n\tverify\n\tsimulate [--speed X] [--devices N] [--dir D] [--loop] [--keep] csv...\n\tstats [--rounds N]\n\texport-metrics [--file F] [--interval MS] [--once]\n\thealth [--file F]\n\tprofile save F\n\tprofile apply [--dry-run] F\ndevice is the hwmon name, the i2c device, the index or the path of an ltc3350, or all (default)\n"
+
 
+// stdout buffer of the one-shot commands, so that stdio does not allocate one
+static char outbuf[OUTPUT_MAX];
 
 int main(int argc, char* argv[]){ 
-	signal(SIGINT, signal_handler);
-	
-	if(argc < 2){
-		printf(usage, argv[0]);
+	struct ltc_device *devs[MAX_DEVICES];
+	const char *selectors[MAX_DEVICES];
+	struct snapshot snap;
+	char *program = argv[0];
+	int nsel, ndev, res = 0;
+
+	nsel = device_options(&argc, &argv, selectors);
+	if(argc < 2 || nsel < 0){
+		printf(usage, program);
 		return 1;
 	}
-	if(strcmp("show", argv[1]) == 0) {
-		return show();
+	if(strcmp("show", argv[1]) == 0 || strcmp("status", argv[1]) == 0 || strcmp("read", argv[1]) == 0
+			|| strcmp("write", argv[1]) == 0 || strcmp("clear", argv[1]) == 0
+			|| strcmp("stats", argv[1]) == 0) {
+		// let the daemon answer, if it is running
+		res = daemon_request(argc, argv, selectors, nsel);
+		if(res >= 0)
+			return res;
+		res = 0;
+	}
+	if(strcmp("export", argv[1]) == 0) {
+		return export_ring(argc - 1, argv + 1);
+	}
+	if(strcmp("store", argv[1]) == 0) {
+		return store_command(argc - 1, argv + 1);
+	}
+	if(strcmp("rollup", argv[1]) == 0) {
+		return rollup_command(argc - 1, argv + 1);
+	}
+	if(strcmp("bench", argv[1]) == 0) {
+		return bench(argc - 1, argv + 1);
+	}
+	if(strcmp("verify", argv[1]) == 0) {
+		return convert_verify(argc - 1, argv + 1);
+	}
+	if(strcmp("simulate", argv[1]) == 0) {
+		return simulate(argc - 1, argv + 1);
 	}
+	if(strcmp("peek", argv[1]) == 0) {
+		return peek(argc - 1, argv + 1, selectors, nsel);
+	}
+
+	ndev = select_devices(selectors, nsel, devs);
+	if(ndev < 0)
+		return -ndev;
+	if(ndev == 0){
+		fprintf(stderr, "No ltc3350 device found\n");
+		return ENODEV;
+	}
+	// one write must not reprogram every controller on the board by accident
+	if(nsel == 0 && ndev > 1 && (strcmp("write", argv[1]) == 0 || strcmp("clear", argv[1]) == 0)){
+		fprintf(stderr, "%d ltc3350 devices found: select the ones to %s with --device, or --device all\n", ndev, argv[1]);
+		return EINVAL;
+	}
+
 	if(strcmp("await", argv[1]) == 0) {
-		return await_alerts();
+		return await_alerts(argc - 1, argv + 1, devs, ndev);
 	}
-	if(strcmp("write", argv[1]) == 0 && argc > 3) {
-		if(argc == 4){
-			return write_value(argv[2], argv[3], "");
-		} else if(argc == 5){
-			return write_value(argv[2], argv[3], argv[4]);
-		}
-		return 1;
+	if(strcmp("daemon", argv[1]) == 0) {
+		return run_daemon(argc - 1, argv + 1, devs, ndev);
 	}
-	if(strcmp("read", argv[1]) == 0 && argc > 2) {
-		if (argc == 3) {
-			printf("%d\n", read_integer_value(argv[2]));
-			return 0;
-		}
-		else if (argc == 4 && strcmp("-c", argv[2]) == 0) {
-			char buf[10];
-			if (read_file(argv[3], buf))
-				return 1;
-			char *result = convert_from_LSB(buf, argv[3]);
-			if(result != NULL)
-				printf("%s\n", result);
-			else
-				printf("Error in main\n");
-		}
-		return 1;
+	if(strcmp("sample", argv[1]) == 0) {
+		return sample(argc - 1, argv + 1, devs, ndev);
 	}
-	if(strcmp("clear", argv[1]) == 0) {
-		return clear_all();
+	if(strcmp("stats", argv[1]) == 0) {
+		return stats_command(argc - 1, argv + 1, devs, ndev);
 	}
-	if(strcmp("status", argv[1]) == 0) {
-		printf("SUPERCAPACITORS STATUS REPORT\n");
-		printf("-----------------------------\n\n");
-		status_report();
-		printf("REGISTERS VALUES:\n");
-		show();
-		return 0;
+	if(strcmp("export-metrics", argv[1]) == 0) {
+		return export_metrics(argc - 1, argv + 1, devs, ndev);
+	}
+	if(strcmp("health", argv[1]) == 0) {
+		return health_command(argc - 1, argv + 1, devs, ndev);
+	}
+	if(strcmp("profile", argv[1]) == 0) {
+		return profile_command(argc - 1, argv + 1, devs, ndev);
 	}
-	return 0;
-}
 
-/**
- * await_alerts() - poll for alerts
- * Return: on success is closed by SIGINT, returns errno on error.
-*/
-int await_alerts(){
-	// we will check for alarms and monitor status alerts
-	struct pollfd ufds[3];
-	char paths[2][128];
-	char data[6];
-
-	printf("You will be notified in the event of an alarm, or a change in monitor status.\n");
-
-	sprintf(paths[0], "%s/alarm_reg", SYSFS_PATH);
-	sprintf(paths[1], "%s/mon_status", SYSFS_PATH);
-
-	for(int i = 0; i<2; i++){
-		if((fds[i] = open(paths[i], O_RDONLY)) < 0){
-			int err = errno;
-			fprintf(stderr, "await_alerts() Failed to open %s %s\n", paths[i], strerror(errno));
-			return err;
+	// the output of a command goes out in one write
+	setvbuf(stdout, outbuf, _IOFBF, sizeof(outbuf));
+	for(int i = 0; i < ndev; i++) {
+		snapshot_init(&snap, devs[i], 1);
+		if(strcmp("show", argv[1]) == 0) {
+			device_header(stdout, devs[i], ndev);
+			res |= show(stdout, &snap);
 		}
-		ufds[i].fd = fds[i];
-		ufds[i].revents = 0;
-		// POLLPRI means there is some exceptional condition on the file descriptor
-		// in this case, the sysfs_notify
-		ufds[i].events = POLLPRI | POLLERR;
-	}
-	printf("Polling for alerts...\n");
-	// these are dummy reads, so that we won't instantly get a notification
-	read(fds[0], data, 6);
-	read(fds[1], data, 6);
-	// start waiting for a notification
-	while(poll(ufds, 2, -1) >= 0){
-		// this is so sysfs returns new data
-		if((lseek(fds[0], 0, SEEK_SET) < 0) | (lseek(fds[1], 0, SEEK_SET) < 0))
-			return throw("await_alerts Failure in lseek", -1);
-
-		printf("New data ltc-monitor\n");
-		if(ufds[0].revents & POLLPRI){
-			if(read(fds[0], data, 6) <= 0)
-				return throw("await_alerts: Error in reading alarm register", errno);
+		else if(strcmp("status", argv[1]) == 0) {
+			device_header(stdout, devs[i], ndev);
+			res |= status(stdout, &snap);
 		}
-		if(ufds[1].revents & POLLPRI){
-			if(read(fds[1], data, 6) <= 0)
-				return throw("await_alerts: Error in reading monitor status", errno);
+		else if(strcmp("write", argv[1]) == 0 && (argc == 4 || argc == 5)) {
+			device_header(stdout, devs[i], ndev);
+			res |= write_value(stdout, devs[i], argv[2], argv[3], argc == 5 ? argv[4] : "");
+		}
+		else if(strcmp("read", argv[1]) == 0 && argc == 3) {
+			device_header(stdout, devs[i], ndev);
+			res |= read_attr(stdout, &snap, argv[2], 0);
+		}
+		else if(strcmp("read", argv[1]) == 0 && argc == 4 && strcmp("-c", argv[2]) == 0) {
+			device_header(stdout, devs[i], ndev);
+			res |= read_attr(stdout, &snap, argv[3], 1);
+		}
+		else if(strcmp("clear", argv[1]) == 0) {
+			device_header(stdout, devs[i], ndev);
+			res |= clear_all(stdout, &snap);
+		}
+		else {
+			printf(usage, program);
+			return 1;
 		}
-		status_report();
 	}
-	// this shouldn't happen
-	printf("Polling finished\n");
-	return 0;
+	return res;
+}
+
+/*
+ * When more than one device is selected, the output of each one
+ * starts with its name.
+*/
+void device_header(FILE *out, const struct ltc_device *dev, int ndev){
+	if(ndev < 2)
+		return;
+	if(dev->bus[0])
+		fprintf(out, "%s (%s):\n", dev->name, dev->bus);
+	else
+		fprintf(out, "%s:\n", dev->name);
 }
 
 /**
- * show() - print sysfs directory contents
+ * show() - print the values of the sysfs attributes
  *
- * Open directory, ignore uninteresting files, only read sysfs entries
- * Print file name, unconverted value, converted value
+ * Attributes the device does not expose are skipped.
+ * Print attribute name, unconverted value, converted value
  * Return: 0 on success, otherwise error code
 */
-int show(){
-	DIR *dir;
-	struct dirent *entry;
+int show(FILE *out, struct snapshot *snap){
+	// the whole table is rendered here and written at once
+	char buf[SHOW_LINE_MAX * NUM_ATTRS + 1];
+	size_t len = 0;
 	int i = 0;
 
-	//open directory
-	dir = opendir(SYSFS_PATH);
-	if(dir == NULL)
-		return throw("Error in opening directory", errno);
-
-	while ((entry = readdir(dir)) != NULL) {
-		struct stat statbuf;
+	for(int id = 0; id < NUM_ATTRS; id++) {
+		int n;
 
-		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 || strcmp(entry->d_name, "name") == 0
-				|| strcmp(entry->d_name, "uevent") == 0){	
+		if (!snapshot_has(snap, id))
 			continue;
-		}
+		len += snprintf(buf + len, SHOW_LINE_MAX, "%-20s: %-7d", attr_table[id].name, snap->raw[id]);
+		n = snprintf(buf + len, SHOW_LINE_MAX - 32, "%d %s", snap->conv[id], attr_unit_name(id));
+		len += n;
+		for(; n < 7; n++)
+			buf[len++] = ' ';
+		// print in two columns
+		buf[len++] = i%2 == 0 ? '\t' : '\n';
+		i++;
+	}
+	buf[len++] = '\n';
+	fwrite(buf, 1, len, out);
+	return 0;
+}
 
-		char full_path[PATH_MAX];
-		snprintf(full_path, sizeof(full_path), "%s/%s", SYSFS_PATH, entry->d_name);
-		
-		if (stat(full_path, &statbuf) == -1) {
-			perror("Error getting file stat");
-			continue;
+/**
+ * status() - print a complete status report
+ *
+ * Status registers, active alarms and the values of all the attributes.
+*/
+int status(FILE *out, struct snapshot *snap){
+	fprintf(out, "SUPERCAPACITORS STATUS REPORT\n");
+	fprintf(out, "-----------------------------\n\n");
+	status_report(out, snap);
+	fprintf(out, "REGISTERS VALUES:\n");
+	return show(out, snap);
+}
+
+/**
+ * read_attr() - print the value of one attribute
+ * @convert: print it in the attribute's measurement unit
+ *
+ * Attributes that are not in the registry can only be read from sysfs.
+ * Return: 0 on success, otherwise error code
+*/
+int read_attr(FILE *out, struct snapshot *snap, const char *name, int convert){
+	enum attr_id id = attr_lookup(name);
+	int value;
+
+	if (id != ATTR_NONE) {
+		// on out: the client of the daemon gets it, and errno says nothing here
+		if (!snapshot_has(snap, id)) {
+			fprintf(out, "read_attr: %s is not available: %s\n", name, strerror(ENOENT));
+			return ENOENT;
 		}
-		
-		// sysfs files are considered regular files.
-		if (S_ISREG(statbuf.st_mode)) {
-			char buf[10];
-			char *buf2;
-			printf("%-20s: ", entry->d_name);
-			
-			if (read_file(entry->d_name, buf))
-				continue;
-			buf[strlen(buf)-1] = '\0';
-			printf("%-7s", buf);
-			buf2 = convert_from_LSB(buf, entry->d_name);
-			if (buf2 != NULL) {
-				printf("%-7s", buf2);
-				free(buf2);
-			}
-			// print in two columns
-			if(i%2 == 0)
-				printf("\t");
-			else
-				printf("\n");
-			i++;
+		if (convert) {
+			fprintf(out, "%d %s\n", snap->conv[id], attr_unit_name(id));
+			return 0;
 		}
-	}
-	printf("\n");
+		value = snap->raw[id];
+	} else if (snap->live) {
+		value = read_integer_value(snap->dev, name);
+	} else {
+		fprintf(out, "Unknown attribute %s\n", name);
+		return EINVAL;
+	}
+
+	if (convert)
+		fprintf(out, "%d %s\n", attr_from_LSB(id, value), attr_unit_name(id));
+	else
+		fprintf(out, "%d\n", value);
 	return 0;
 }
 
@@ -282,19 +250,24 @@ int show(){
  * 
  * Return: errno on failure, 0 on success.
 */
-int read_file(char *attr_name, char *buf)
+int read_file(const struct ltc_device *dev, const char *attr_name, char *buf)
 {
 	char full_path[PATH_MAX];
-	snprintf(full_path, sizeof(full_path), "%s/%s", SYSFS_PATH, attr_name);
+	snprintf(full_path, sizeof(full_path), "%s/%s", dev->path, attr_name);
 	FILE *file = fopen(full_path, "r");
+	uint64_t start;
+	char *line;
 
 	if (file == NULL) 
 		return throw("read_file Failed to open sysfs file", errno);
 
-	if(fgets(buf, sizeof(buf), file) == NULL)
-		return throw("read_file Failed to read from sysfs file", errno);
-
+	start = stats_start();
+	line = fgets(buf, sizeof(buf), file);
+	stats_record(attr_lookup(attr_name), STATS_READ, start, line == NULL);
 	fclose(file);
+	if(line == NULL)
+		return throw("read_file Failed to read from sysfs file", EIO);
+
 	return 0;
 }
 
@@ -302,12 +275,12 @@ int read_file(char *attr_name, char *buf)
  * Return: value read on success, -1 on failure
  * Since -1 can be a valid return value, it only causes a warning.
 */
-int read_integer_value(char *attr_name){
+int read_integer_value(const struct ltc_device *dev, const char *attr_name){
 	// Construct full path to the file
 	char buf[10];
 	int value;
 	char *endptr;
-	if (read_file(attr_name, buf)) 
+	if (read_file(dev, attr_name, buf)) 
 		return throw("read_integer_value ", -1);
 
 	value = strtol(buf, &endptr, 10);
@@ -319,107 +292,89 @@ int read_integer_value(char *attr_name){
 	return value;
 }
 	
-int write_value(char *name, char *value_string, char *unit)
+int write_value(FILE *out, const struct ltc_device *dev, char *name, char *value_string, char *unit)
 {
 	char full_path[PATH_MAX];
 	FILE *file;
 	long value;
 	char *endptr;
-	int val;
+	uint64_t start;
+	int val, res;
 
-	snprintf(full_path, sizeof(full_path), "%s/%s", SYSFS_PATH, name);
+	snprintf(full_path, sizeof(full_path), "%s/%s", dev->path, name);
 	file = fopen(full_path,"r+");
 
 	if(file == NULL)
 		return throw("write_value Failed to open sysfs file", errno);
 
 	if(strcmp(unit, "") == 0){
-		if(fprintf(file, "%s", value_string) > 0){
-			printf("Wrote %s on %s\n", value_string, name);
-			return 0;
-		}
-		else {
+		// the value only reaches the attribute when the stream is flushed
+		start = stats_start();
+		res = fprintf(file, "%s", value_string) <= 0;
+		res |= fclose(file) != 0;
+		stats_record(attr_lookup(name), STATS_WRITE, start, res);
+		if(res)
 			return throw("Could not write on file", errno);
-		}
+		fprintf(out, "Wrote %s on %s\n", value_string, name);
+		return 0;
 	}
 
 	value = strtol(value_string, &endptr, 10);
-	if(value == 0 && endptr == value_string)
+	if(value == 0 && endptr == value_string) {
+		fclose(file);
 		return throw("Value is not valid", EINVAL);
+	}
 
-	val = convert_to_LSB(value, unit, name);
-
-	if(fprintf(file, "%d", val)){
-		printf("Wrote %d on %s\n", val, name);
-		return 0;
+	if(convert_to_LSB(value, unit, name, &val)) {
+		fclose(file);
+		return EINVAL;
 	}
-	return 1;
+
+	start = stats_start();
+	res = fprintf(file, "%d", val) <= 0;
+	res |= fclose(file) != 0;
+	stats_record(attr_lookup(name), STATS_WRITE, start, res);
+	if(res)
+		return throw("Could not write on file", errno);
+	fprintf(out, "Wrote %d on %s\n", val, name);
+	return 0;
 }
 
-int clear_all(){
+int clear_all(FILE *out, struct snapshot *snap){
 	char buf[7];
 	int res;
-	int active_alarms = read_integer_value("alarm_reg");
+	int active_alarms = snapshot_get(snap, ATTR_ALARM_REG);
 	snprintf(buf, sizeof(buf), "%d", active_alarms);
-	res = write_value("clr_alarms", buf, "");
+	res = write_value(out, snap->dev, "clr_alarms", buf, "");
 	if (res)
 		return throw("Error in clearing alarms", res);
 	return 0;
 }
 
-void signal_handler(int sig){
-	for(int i = 0; i<3; i++){
-		if(fds[i] >= 0){
-			close(fds[0]);
-		}
-	}
-	exit(0);
-}
-
-static inline int throw(const char *message, int error)
-{
-	perror(message);
-	return error;
-}
-
-static inline void log_chrg(int chrg, int bit, const char *description){
-	if(chrg & bit) {
-		printf("%s\n", description);
+// print the description of every bit set in a status register
+static void log_bits(FILE *out, int reg, const char *const *table){
+	for(int bit = 0; bit < NUM_STATUS_BITS; bit++) {
+		if(reg & BIT(bit) && table[bit] != NULL)
+			fprintf(out, "%s\n", table[bit]);
 	}
 }
 
 // UTILITY FUNCTIONS
 
-int convert_to_LSB(long value, char *unit, char *attr_name)
+/*
+ * convert a value in the given measurement unit to register units
+ * the unit must be the one of the attribute
+ * Return: 0 on success, EINVAL if the unit does not apply to the attribute
+*/
+int convert_to_LSB(long value, char *unit, char *attr_name, int *lsb)
 {
-	if(strcmp(unit, "mV") == 0){
-		if(starts_with(attr_name, "vcap1") || starts_with(attr_name, "vcap2") || 
-					starts_with(attr_name, "vcap3") || starts_with(attr_name, "vcap4") || 
-					starts_with(attr_name, "gpi") || starts_with(attr_name, "vshunt") || 
-					starts_with(attr_name, "cap_ov") || starts_with(attr_name, "cap_uv") ||
-					starts_with(attr_name, "meas_vcap1") || starts_with(attr_name, "meas_vcap2") || 
-					starts_with(attr_name, "meas_vcap3") || starts_with(attr_name, "meas_vcap4") || 
-					starts_with(attr_name, "meas_gpi")) {
-			return millivolts_to_LSB(value, 1835);
-		}
-		else if (starts_with(attr_name, "vcap") || starts_with(attr_name, "meas_vcap")) {
-			return millivolts_to_LSB(value, 14760);
-		}
-		else if (starts_with(attr_name, "vin") || starts_with(attr_name, "vout") || 
-				starts_with(attr_name, "meas_vin") || starts_with(attr_name, "meas_vout")) {
-			return millivolts_to_LSB(value, 22100);
-		}
-	}
-	else if(strcmp(unit, "F") == 0){
-		return farads_to_LSB(value);
-	} 
-	else if (strcmp(unit, "C") == 0){
-		return celsius_to_LSB(value);
-	}
-	else if (strcmp(unit, "mR") == 0){
-		return milliohms_to_LSB(value);
-	}
-	return throw("convert_to_lsb: not a valid measurement unit", EINVAL);
+	enum attr_id id = attr_lookup(attr_name);
+	enum attr_unit u = unit_lookup(unit);
+
+	if (id == ATTR_NONE || u == UNIT_NONE || attr_table[id].unit != u)
+		return throw("convert_to_lsb: not a valid measurement unit", EINVAL);
+	*lsb = attr_to_LSB(id, value);
+	return 0;
 }
 
 int meas_trunc(long long number)
@@ -438,11 +393,6 @@ int meas_trunc(long long number)
 */
 int LSB_to_celsius(long long meas_dtemp)
 {
-	long long scaled_result = 28 * meas_dtemp - 251400;
-	// this is to adjust for rounding errors
-	// if the last decimal digit is 9 then we round up
-	if(((scaled_result + 100) / 1000) != (scaled_result / 1000))
-		scaled_result += 100;
 	return meas_trunc((28 * meas_dtemp - 251400) / 1000);
 }
 
@@ -504,163 +454,143 @@ int LSB_to_milliohms(int units)
 	return meas_trunc(result);
 }
 
-char * convert_from_LSB(char * buf, char * attr_name)
+/**
+ * convert_from_LSB() - convert a value read from sysfs to its measurement unit
+ * @conv: output buffer, the value and the unit
+ * Return: 0 on success, otherwise error code
+*/
+int convert_from_LSB(const char *buf, const char *attr_name, char *conv, size_t size)
 {
 	long long value;
-	char *buf2 = malloc(sizeof(char)*15);
-	char unit[4];
 	char *endptr;
-	int val;
+	enum attr_id id;
 
-	if (buf == NULL) {
-		return NULL;
-	}
-	
 	value = strtoll(buf, &endptr, 10);
 	if(value == 0 && endptr == buf) {
 		printf("Value is %lld	\n", value);
-		throw("convert_from_LSB: Error in conversion", -1);
-		return NULL;
+		return throw("convert_from_LSB: Error in conversion", EINVAL);
 	}
 
-
-	if(starts_with(attr_name, "vcap1") || starts_with(attr_name, "vcap2") 
-			|| starts_with(attr_name, "vcap3") || starts_with(attr_name, "vcap4") 
-			|| starts_with(attr_name, "gpi") || starts_with(attr_name, "vshunt") 
-			|| starts_with(attr_name, "cap_ov") || starts_with(attr_name, "cap_uv")
-			|| starts_with(attr_name, "meas_vcap1") || starts_with(attr_name, "meas_vcap2") 
-			|| starts_with(attr_name, "meas_vcap3") || starts_with(attr_name, "meas_vcap4") 
-			|| starts_with(attr_name, "meas_gpi")) {
-		val = LSB_to_millivolts(value, 1835);
-		strcpy(unit, "mV");
-	}
-	else if (starts_with(attr_name, "vcap_") || starts_with(attr_name, "meas_vcap")) {
-		val = LSB_to_millivolts(value, 14760);
-		strcpy(unit, "mV");
-	}
-	else if (starts_with(attr_name, "vin") || starts_with(attr_name, "vout")
-				|| starts_with(attr_name, "meas_vin") || starts_with(attr_name, "meas_vout")) {
-		val = LSB_to_millivolts(value, 22100);
-		strcpy(unit, "mV");
-	}
-	else if (!starts_with(attr_name, "cap_esr") && (starts_with(attr_name, "cap") || starts_with(attr_name, "meas_cap"))) {
-		val = LSB_to_farads(value);
-		strcpy(unit, "F");
-	}
-	else if (starts_with(attr_name, "dtemp") || starts_with(attr_name, "meas_dtemp")) {
-		val = LSB_to_celsius(value);
-		strcpy(unit, "C");
-	}
-	else if (starts_with(attr_name, "esr") || starts_with(attr_name, "meas_esr")) {
-		val = LSB_to_milliohms(value);
-		strcpy(unit, "mR");
-	}
-	//else if (starts_with(attr_name, "msk_alarms") || starts_with(attr_name, "alarm_reg") || starts_with(attr_name, "clr_alarms") {
-	else{
-		val = (int) value;
-		strcpy(unit, "");
-	}
-	snprintf(buf2, 15, "%d %s", val, unit);
-
-	return buf2;
-}
-
-// true is 1
-int starts_with(const char *str, const char *prefix)
-{
-	size_t str_len = strlen(str);
-	size_t prefix_len = strlen(prefix);
-
-	if (prefix_len > str_len)
-			return 0;
-
-	return strncmp(str, prefix, prefix_len) == 0;
+	id = attr_lookup(attr_name);
+	snprintf(conv, size, "%d %s", attr_from_LSB(id, value), attr_unit_name(id));
+	return 0;
 }
 
-int status_report(void)
+int status_report(FILE *out, struct snapshot *snap)
 {
-	int alarms = read_integer_value("alarm_reg");
-	int monitor = read_integer_value("mon_status");
-	int chrg = read_integer_value("chrg_status");
+	int alarms = snapshot_get(snap, ATTR_ALARM_REG);
+	int monitor = snapshot_get(snap, ATTR_MON_STATUS);
+	int chrg = snapshot_get(snap, ATTR_CHRG_STATUS);
 	if(alarms == -1 || monitor == -1 || chrg == -1)
-		printf("Warning: alarms/monitor/charger status value may be wrong.");
+		fprintf(out, "Warning: alarms/monitor/charger status value may be wrong.");
 
 
-	printf("MONITOR STATUS:\n");;
+	fprintf(out, "MONITOR STATUS:\n");;
 
-	log_monitor(MON_CAPSR_ACTIVE, Capacitance/ESR measurement is in progress.)
-	log_monitor(MON_CAPESR_SCHEDULED, Waiting programmed time to begin a capacitance/ESR measurement.)
-	log_monitor(MON_CAPESR_PENDING, Waiting for satisfactory conditions to begin a capacitance/ESR measurement.)
-	log_monitor(MON_CAP_DONE, Capacitance measurement has completed.)
-	log_monitor(MON_ESR_DONE, ESR Measurement has completed.)
-	log_monitor(MON_CAP_FAILED, The last attempted capacitance measurement was unable to complete.)
-	log_monitor(MON_ESR_FAILED, The last attempted ESR measurement was unable to complete.)
-	log_monitor(MON_POWER_FAILED, The device is no longer connected to power outlet.)
-	log_monitor(MON_POWER_RETURNED, The device is connected to power outlet.)
+	log_bits(out, monitor, monitor_table);
 
-	printf("ALARMS:\n");
+	fprintf(out, "ALARMS:\n");
 	
 
 	// lavora di più su questo
 	if(alarms & ALARM_CAP_UV || alarms & ALARM_CAP_OV) {
-		int lvl, cap1, cap2, cap3, cap4;
-		if(alarms & ALARM_CAP_UV) {
-			printf("%s\n", "Capacitor undervoltage alarm");
-			lvl = read_integer_value("cap_uv_lvl");
-		} else {
-			printf("%s\n", "Capacitor overvoltage alarm");
-			lvl = read_integer_value("cap_ov_lvl");
-		}
-		cap1 = read_integer_value("meas_vcap1");
-		cap2 = read_integer_value("meas_vcap2");
-		cap3 = read_integer_value("meas_vcap3");
-		cap4 = read_integer_value("meas_vcap4");
-		printf("Alarm level: %d. vcap1: %d. vcap2: %d. vcap3: %d. vcap4: %d.\n", lvl, cap1, cap2, cap3, cap4);
-	}
-	log_alarm(alarms, ALARM_GPI_UV, "General purpose Undervoltage alarm", "meas_gpi", "gpi_uv_lvl", "Measured GPI pin voltage", "General Purpose Input Undervoltage Level");
-	log_alarm(alarms, ALARM_GPI_OV, "General purpose Overvoltage alarm", "meas_gpi", "gpi_ov_lvl", "Measured GPI pin voltage", "General Purpose Input Overvoltage Level");
-	log_alarm(alarms, ALARM_VIN_UV, "Input Undervoltage alarm", "meas_vin", "vin_uv_lvl", "Measured VIN voltage", "General Purpose Input Undervoltage Level");
-	log_alarm(alarms, ALARM_VIN_OV, "Input Overvoltage alarm", "meas_vin", "vin_ov_lvl", "Measured VIN voltage", "General Purpose Input Overvoltage Level");
-	log_alarm(alarms, ALARM_VCAP_UV, "Capacitor undervoltage alarm", "meas_vcap", "vcap_uv_lvl", "Measured VCAP voltage", "VCAP Undervoltage Level");
-	log_alarm(alarms, ALARM_VCAP_OV, "Capacitor overvoltage alarm", "meas_vcap", "vcap_ov_lvl", "Measured VCAP voltage", "VCAP Overvoltage Level");
-	log_alarm(alarms, ALARM_VOUT_UV, "Output Undervoltage alarm", "meas_vout", "vout_uv_lvl", "Measured VOUT voltage", "VOUT Undervoltage Level");
-	log_alarm(alarms, ALARM_VOUT_OV, "Output Overvoltage alarm", "meas_vout", "vout_ov_lvl", "Measured VOUT voltage", "VOUT Overvoltage Level");
-	log_alarm(alarms, ALARM_IIN_OC, "Input overcurrent alarm", "meas_iin", "iin_oc_lvl", "Measured IIN current", "Input Overcurrent Level");
-	log_alarm(alarms, ALARM_ICHG_UC, "Charge Undercurrent alarm", "meas_ichg", "ichg_uc_lvl", "Measured ICHG current", "Charge Undercurrent Level");
-	log_alarm(alarms, ALARM_DTEMP_COLD, "Temperature Cold alarm", "meas_dtemp", "dtemp_cold_lvl", "Measured die temperature", "Die temperature Cold level");
-	log_alarm(alarms, ALARM_DTEMP_HOT, "Temperature hot alarm", "meas_dtemp", "dtemp_hot_lvl", "Measured die temperature", "Die Temperature Hot Level");
-	log_alarm(alarms, ALARM_ESR_HI, "stack ESR high alarm", "meas_esr", "esr_hi_lvl", "Measured ESR value", "ESR High Level");
-	log_alarm(alarms, ALARM_CAP_LO, "stack capacitance low alarm", "meas_cap", "cap_lo_lvl", "Measured capacitance value", "Capacitance Low Level");
-
-	printf("CHARGER STATUS:\n");
-
-	log_chrg(chrg, CHRG_STEPDOWN, "The synchronous controller is in step-down mode (charging)");
-	log_chrg(chrg, CHRG_STEPUP, "The synchronous controller is in step-up mode (backup)");
-	log_chrg(chrg, CHRG_CV, "The charger is in constant voltage mode");
-	log_chrg(chrg, CHRG_UVLO, "The charger is in undervoltage lockout");
-	log_chrg(chrg, CHRG_INPUT_ILIM, "The charger is in input current limit");
-	log_chrg(chrg, CHRG_CAPPG, "The capacitor voltage is above power good threshold");
-	log_chrg(chrg, CHRG_SHNT, "The capacitor manager is shunting");
-	log_chrg(chrg, CHRG_BAL, "The capacitor manager is balancing");
-	log_chrg(chrg, CHRG_DIS, "The charger is temporarily disabled for capacitance measurement");
-	log_chrg(chrg, CHRG_CI, "The charger is in constant current mode");
-	log_chrg(chrg, CHRG_PFO, "Input voltage is below pfi threshold");
+		int bit = alarms & ALARM_CAP_UV ? 0 : 1;
+		fprintf(out, "%s\n", alarm_table[bit].description);
+		log_alarm_values(out, snap, bit);
+	}
+	// the capacitor alarms are handled above
+	for(int bit = 2; bit < NUM_ALARMS; bit++)
+		log_alarm(out, snap, alarms, bit);
+
+	fprintf(out, "CHARGER STATUS:\n");
+
+	log_bits(out, chrg, charger_table);
 	
 	return 0;
 }
 
+/**
+ * status_diff() - print the status bits that changed since the last report
+ * @last: status registers at the last report, updated on return
+ *
+ * The status registers are XORed with the last ones, and only the bits
+ * that changed are printed, as raised or cleared. Only the measurement
+ * and level of the alarms just raised are read from the snapshot, so that
+ * a flapping alarm costs a couple of reads instead of a whole report.
+ * Return: number of bits that changed, -1 if a status register is unavailable.
+*/
+int status_diff(FILE *out, struct status_regs *last, struct snapshot *snap)
+{
+	struct status_regs now = {
+		.alarms = snapshot_get(snap, ATTR_ALARM_REG),
+		.monitor = snapshot_get(snap, ATTR_MON_STATUS),
+		.chrg = snapshot_get(snap, ATTR_CHRG_STATUS),
+	};
+	int diff, changes = 0;
+
+	if(now.alarms == -1 || now.monitor == -1 || now.chrg == -1) {
+		fprintf(out, "Warning: alarms/monitor/charger status value may be wrong.\n");
+		return -1;
+	}
 
-static void log_alarm(int alarms, int alarm_num, char *alarm_desc, char *reg1, char *reg2, char *desc1, char *desc2) {
-	if(alarms & alarm_num) {
-		int val1, val2;
-		printf("%s\n", alarm_desc);
-		val1 = read_integer_value(reg1);
-		val2 = read_integer_value(reg2);
-		if(val1 == -1 || val2 == -1) {
-			printf("log_alarm Warning: values may be wrong.\n");
+	diff = now.alarms ^ last->alarms;
+	for(int bit = 0; bit < NUM_ALARMS; bit++) {
+		if(!(diff & BIT(bit)))
+			continue;
+		if(now.alarms & BIT(bit)) {
+			fprintf(out, "Alarm raised: %s\n", alarm_table[bit].description);
+			log_alarm_values(out, snap, bit);
+		} else {
+			fprintf(out, "Alarm cleared: %s\n", alarm_table[bit].description);
+		}
+		changes++;
+	}
+	diff = now.monitor ^ last->monitor;
+	for(int bit = 0; bit < NUM_STATUS_BITS; bit++) {
+		if(diff & BIT(bit) && monitor_table[bit] != NULL) {
+			fprintf(out, "Monitor %s: %s\n", now.monitor & BIT(bit) ? "raised" : "cleared", monitor_table[bit]);
+			changes++;
 		}
-		printf("%s: %d. %s: %d\n", desc1, val1, desc2, val2);
 	}
+	diff = now.chrg ^ last->chrg;
+	for(int bit = 0; bit < NUM_STATUS_BITS; bit++) {
+		if(diff & BIT(bit) && charger_table[bit] != NULL) {
+			fprintf(out, "Charger %s: %s\n", now.chrg & BIT(bit) ? "raised" : "cleared", charger_table[bit]);
+			changes++;
+		}
+	}
+
+	*last = now;
+	return changes;
+}
+
+static void log_alarm(FILE *out, struct snapshot *snap, int alarms, int bit) {
+	if(alarms & BIT(bit)) {
+		fprintf(out, "%s\n", alarm_table[bit].description);
+		log_alarm_values(out, snap, bit);
+	}
+}
+
+// print the measurement that raised an alarm and the level it crossed
+static void log_alarm_values(FILE *out, struct snapshot *snap, int bit) {
+	const struct alarm_desc *alarm = &alarm_table[bit];
+	int val1, val2;
+
+	// the capacitor alarms refer to every capacitor of the stack
+	if(bit == 0 || bit == 1) {
+		int cap[4];
+		val2 = snapshot_get(snap, alarm->lvl);
+		for(int i = 0; i < 4; i++)
+			cap[i] = snapshot_get(snap, ATTR_MEAS_VCAP1 + i);
+		fprintf(out, "Alarm level: %d. vcap1: %d. vcap2: %d. vcap3: %d. vcap4: %d.\n", val2, cap[0], cap[1], cap[2], cap[3]);
+		return;
+	}
+	val1 = snapshot_get(snap, alarm->meas);
+	val2 = snapshot_get(snap, alarm->lvl);
+	if(val1 == -1 || val2 == -1) {
+		fprintf(out, "log_alarm Warning: values may be wrong.\n");
+	}
+	fprintf(out, "%s: %d. %s: %d\n", alarm->meas_desc, val1, alarm->lvl_desc, val2);
 }
 
 /**
@@ -694,7 +624,7 @@ int sensors(){
 			continue;
 		
 		meas_name = entry->d_name + 5;
-		meas_conv = convert_from_LSB(buf, entry->d_name);
+		convert_from_LSB(buf, entry->d_name, meas_conv, sizeof(meas_conv));
 		printf("meas_name : %s\n");
 
 		else if(starts_with(meas_name, "vcap") && strcmp(meas_name, "vcap")) {
@@ -0,0 +1,266 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ltc-monitor.h"
+
+#define METRICS_FILE "/var/lib/node_exporter/textfile_collector/ltc-monitor.prom"
+#define METRICS_MAX (16384 * MAX_DEVICES)
+#define NSEC_PER_SEC 1000000000L
+
+/*
+ * One gauge family per measurement unit, for the measurements and for
+ * their alarm levels. iin and ichg have no conversion, they are exported
+ * in register units.
+ */
+static const struct metric_family {
+	const char *meas;
+	const char *lvl;
+	const char *unit;
+	const char *help;
+} families[NUM_UNITS] = {
+	[UNIT_MV] = { "ltc3350_voltage_volts", "ltc3350_voltage_threshold_volts", "volts", "voltage" },
+	[UNIT_F] = { "ltc3350_capacitance_farads", "ltc3350_capacitance_threshold_farads", "farads", "stack capacitance" },
+	[UNIT_C] = { "ltc3350_temperature_celsius", "ltc3350_temperature_threshold_celsius", "celsius", "die temperature" },
+	[UNIT_MR] = { "ltc3350_esr_ohms", "ltc3350_esr_threshold_ohms", "ohms", "stack ESR" },
+	[UNIT_NONE] = { "ltc3350_current_raw", "ltc3350_current_threshold_raw", NULL, "current (register units)" },
+};
+
+// label values of the status bits, NULL for the reserved bits
+static const char *const monitor_bits[NUM_STATUS_BITS] = {
+	"capesr_active", "capesr_scheduled", "capesr_pending", "cap_done", "esr_done",
+	"cap_failed", "esr_failed", NULL, "power_failed", "power_returned",
+};
+
+static const char *const charger_bits[NUM_STATUS_BITS] = {
+	"stepdown", "stepup", "cv", "uvlo", "input_ilim", "cappg",
+	"shnt", "bal", "dis", "ci", NULL, "pfo",
+};
+
+/*
+ * The file is rendered here, every cycle: the exporter does not allocate
+ * once it is running.
+ */
+static char metrics_buf[METRICS_MAX];
+static size_t metrics_len;
+
+static volatile sig_atomic_t stop_export;
+
+static void export_stop(int sig)
+{
+	(void) sig;
+	stop_export = 1;
+}
+
+static void emit(const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(metrics_buf + metrics_len, sizeof(metrics_buf) - metrics_len, fmt, ap);
+	va_end(ap);
+	if (n > 0)
+		metrics_len += n;
+	if (metrics_len > sizeof(metrics_buf) - 1)
+		metrics_len = sizeof(metrics_buf) - 1;
+}
+
+static void emit_family(const char *name, const char *unit, const char *help, const char *what)
+{
+	emit("# TYPE %s gauge\n", name);
+	if (unit != NULL)
+		emit("# UNIT %s %s\n", name, unit);
+	emit("# HELP %s %s %s.\n", name, help, what);
+}
+
+// the attribute name without its meas_ prefix or _lvl suffix
+static int short_name(enum attr_id id, const char **name)
+{
+	const char *full = attr_table[id].name;
+	int len = strlen(full);
+
+	*name = full;
+	if (attr_table[id].kind == ATTR_MEAS) {
+		*name += strlen("meas_");
+		return len - strlen("meas_");
+	}
+	return attr_table[id].kind == ATTR_LEVEL ? len - (int) strlen("_lvl") : len;
+}
+
+static void emit_attrs(struct snapshot *snaps, int ndev, enum attr_kind kind)
+{
+	for (enum attr_unit u = 0; u < NUM_UNITS; u++) {
+		const struct metric_family *f = &families[u];
+		const char *name = kind == ATTR_MEAS ? f->meas : f->lvl;
+
+		emit_family(name, f->unit, kind == ATTR_MEAS ? "Measured" : "Alarm level of the measured", f->help);
+		for (int d = 0; d < ndev; d++) {
+			for (int id = 0; id < NUM_ATTRS; id++) {
+				const char *label;
+				int len;
+
+				if (attr_table[id].kind != kind || attr_table[id].unit != u || !snapshot_has(&snaps[d], id))
+					continue;
+				len = short_name(id, &label);
+				emit("%s{device=\"%s\",%s=\"%.*s\"} %.6g\n", name, snaps[d].dev->name,
+						kind == ATTR_MEAS ? "sensor" : "threshold", len, label,
+						attr_to_si(id, snaps[d].raw[id]));
+			}
+		}
+	}
+}
+
+static void emit_bits(struct snapshot *snaps, int ndev, const char *name, const char *help,
+		enum attr_id reg, const char *label, const char *const *bits)
+{
+	emit_family(name, NULL, help, "bits");
+	for (int d = 0; d < ndev; d++) {
+		int value;
+
+		if (!snapshot_has(&snaps[d], reg))
+			continue;
+		value = snaps[d].raw[reg];
+		for (int bit = 0; bit < NUM_STATUS_BITS; bit++) {
+			if (bits[bit] != NULL)
+				emit("%s{device=\"%s\",%s=\"%s\"} %d\n", name, snaps[d].dev->name, label, bits[bit],
+						(value & BIT(bit)) != 0);
+		}
+	}
+}
+
+/**
+ * render_metrics() - render the OpenMetrics exposition of the devices
+ *
+ * Measurements and alarm levels are gauges in SI units, the status
+ * registers one 0/1 series per bit, labeled with the bit name. The alarms
+ * are named after the level they refer to, e.g. vcap_uv.
+*/
+static void render_metrics(struct snapshot *snaps, int ndev)
+{
+	const char *alarm_bits[NUM_ALARMS];
+	char names[NUM_ALARMS][24];
+	struct timespec now;
+
+	for (int bit = 0; bit < NUM_ALARMS; bit++) {
+		const char *lvl;
+		int len = short_name(alarm_table[bit].lvl, &lvl);
+
+		snprintf(names[bit], sizeof(names[bit]), "%.*s", len, lvl);
+		alarm_bits[bit] = names[bit];
+	}
+
+	metrics_len = 0;
+	emit_family("ltc3350_up", NULL, "1 if the status registers of the", "device can be read");
+	for (int d = 0; d < ndev; d++)
+		emit("ltc3350_up{device=\"%s\",bus=\"%s\"} %d\n", snaps[d].dev->name, snaps[d].dev->bus,
+				snapshot_has(&snaps[d], ATTR_ALARM_REG) && snapshot_has(&snaps[d], ATTR_MON_STATUS)
+				&& snapshot_has(&snaps[d], ATTR_CHRG_STATUS));
+	emit_attrs(snaps, ndev, ATTR_MEAS);
+	emit_attrs(snaps, ndev, ATTR_LEVEL);
+	emit_bits(snaps, ndev, "ltc3350_alarm", "Active alarm_reg", ATTR_ALARM_REG, "alarm", alarm_bits);
+	emit_bits(snaps, ndev, "ltc3350_monitor_status", "Active mon_status", ATTR_MON_STATUS, "status", monitor_bits);
+	emit_bits(snaps, ndev, "ltc3350_charger_status", "Active chrg_status", ATTR_CHRG_STATUS, "status", charger_bits);
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	emit_family("ltc3350_last_update_seconds", "seconds", "Unix time of the last", "update");
+	emit("ltc3350_last_update_seconds %lld.%03ld\n", (long long) now.tv_sec, now.tv_nsec / 1000000);
+	emit("# EOF\n");
+}
+
+/*
+ * Scrapers must never see a partial file: it is written next to the
+ * target and renamed over it.
+ */
+static int write_metrics(const char *path, const char *tmp)
+{
+	int fd, err = 0;
+
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+		return throw("export-metrics: cannot create the temporary file", errno);
+	if (write(fd, metrics_buf, metrics_len) != (ssize_t) metrics_len)
+		err = throw("export-metrics: cannot write the metrics", errno ? errno : EIO);
+	if (close(fd) < 0 && !err)
+		err = throw("export-metrics: cannot write the metrics", errno);
+	if (!err && rename(tmp, path) < 0)
+		err = throw("export-metrics: cannot rename the metrics file", errno);
+	if (err)
+		unlink(tmp);
+	return err;
+}
+
+/**
+ * export_metrics() - write the metrics of the devices in a textfile
+ *
+ * The file (--file) is rewritten every interval (--interval, 1000 ms by
+ * default), for the node exporter textfile collector or any other scraper
+ * of OpenMetrics text files. With --once it is written once.
+ * Return: 0 on success, otherwise error code
+*/
+int export_metrics(int argc, char *argv[], struct ltc_device **devs, int ndev)
+{
+	static const struct option options[] = {
+		{ "file", required_argument, NULL, 'f' },
+		{ "interval", required_argument, NULL, 'i' },
+		{ "once", no_argument, NULL, 'o' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct sigaction sa = { .sa_handler = export_stop };
+	struct snapshot snaps[MAX_DEVICES];
+	struct timespec next;
+	char tmp[PATH_MAX];
+	const char *path = METRICS_FILE;
+	long interval = 1000;
+	int opt, once = 0, err = 0;
+
+	optind = 1;
+	while ((opt = getopt_long(argc, argv, "f:i:o", options, NULL)) != -1) {
+		switch (opt) {
+		case 'f':
+			path = optarg;
+			break;
+		case 'i':
+			interval = strtol(optarg, NULL, 10);
+			break;
+		case 'o':
+			once = 1;
+			break;
+		default:
+			return EINVAL;
+		}
+	}
+	if (interval <= 0) {
+		fprintf(stderr, "export-metrics: the interval must be positive\n");
+		return EINVAL;
+	}
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp))
+		return ENAMETOOLONG;
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while (!stop_export) {
+		for (int d = 0; d < ndev; d++)
+			snapshot_init(&snaps[d], devs[d], 1);
+		render_metrics(snaps, ndev);
+		if ((err = write_metrics(path, tmp)) || once)
+			break;
+
+		next.tv_sec += interval / 1000;
+		next.tv_nsec += (interval % 1000) * 1000000;
+		if (next.tv_nsec >= NSEC_PER_SEC) {
+			next.tv_nsec -= NSEC_PER_SEC;
+			next.tv_sec++;
+		}
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR && !stop_export)
+			;
+	}
+	return err;
+}
@@ -0,0 +1,266 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ltc-monitor.h"
+
+/*
+ * The settings of a device: the alarm levels and the control registers
+ * that configure it. clr_alarms and ctl_reg are commands, num_caps is set
+ * by the board: they are not part of a profile.
+ */
+static int in_profile(enum attr_id id)
+{
+	if (id == ATTR_NONE)
+		return 0;
+	if (id == ATTR_CLR_ALARMS || id == ATTR_CTL_REG || id == ATTR_NUM_CAPS)
+		return 0;
+	return attr_table[id].kind == ATTR_LEVEL || attr_table[id].kind == ATTR_CONTROL;
+}
+
+struct profile_entry {
+	enum attr_id id;
+	long value; // as written in the profile
+	int lsb; // register value
+	int has_unit;
+};
+
+/*
+ * A line is "name value [unit]", the value in the unit of the attribute,
+ * or in register units if there is no unit. Empty lines and lines
+ * starting with # are skipped.
+ * Return: 1 if the line holds an entry, 0 if it is skipped, otherwise
+ * -EINVAL.
+ */
+static int parse_line(char *line, struct profile_entry *e)
+{
+	char *name, *value, *unit, *end, *save;
+
+	name = strtok_r(line, " \t\n", &save);
+	if (name == NULL || name[0] == '#')
+		return 0;
+	value = strtok_r(NULL, " \t\n", &save);
+	unit = strtok_r(NULL, " \t\n", &save);
+	e->id = attr_lookup(name);
+	if (!in_profile(e->id)) {
+		fprintf(stderr, "profile: %s is not a setting\n", name);
+		return -EINVAL;
+	}
+	if (value == NULL || (e->value = strtol(value, &end, 10), end == value || *end != '\0')) {
+		fprintf(stderr, "profile: %s has no valid value\n", name);
+		return -EINVAL;
+	}
+	e->has_unit = unit != NULL;
+	if (!e->has_unit)
+		e->lsb = e->value;
+	else if (convert_to_LSB(e->value, unit, name, &e->lsb))
+		return -EINVAL;
+	return 1;
+}
+
+// Return: number of entries, otherwise -error code.
+static int load_profile(const char *path, struct profile_entry *entries)
+{
+	char line[128];
+	int n = 0, lineno = 0, res;
+	FILE *file;
+
+	if ((file = fopen(path, "r")) == NULL)
+		return -throw("profile: cannot open the profile", errno);
+	while (fgets(line, sizeof(line), file) != NULL) {
+		lineno++;
+		if ((res = parse_line(line, &entries[n])) < 0) {
+			fprintf(stderr, "profile: %s:%d: invalid line\n", path, lineno);
+			fclose(file);
+			return res;
+		}
+		// a later line for the same attribute replaces the earlier one
+		for (int i = 0; i < n && res; i++)
+			if (entries[i].id == entries[n].id) {
+				entries[i] = entries[n];
+				res = 0;
+			}
+		n += res;
+	}
+	fclose(file);
+	return n;
+}
+
+/*
+ * Write a register and read it back through the same file: on sysfs the
+ * read goes to the device.
+ * Return: 0 on success, EIO if the device holds another value, otherwise
+ * error code.
+ */
+static int write_verified(const struct ltc_device *dev, enum attr_id id, int lsb, int *readback)
+{
+	char path[PATH_MAX];
+	char buf[16];
+	uint64_t start;
+	ssize_t len;
+	int fd, err;
+
+	snprintf(path, sizeof(path), "%s/%s", dev->path, attr_table[id].name);
+	if ((fd = open(path, O_RDWR)) < 0)
+		return errno;
+	len = snprintf(buf, sizeof(buf), "%d", lsb);
+	start = stats_start();
+	err = pwrite(fd, buf, len, 0) != len ? errno : 0;
+	stats_record(id, STATS_WRITE, start, err);
+	if (err == 0) {
+		start = stats_start();
+		len = pread(fd, buf, sizeof(buf) - 1, 0);
+		err = len <= 0 ? (len < 0 ? errno : EIO) : 0;
+		stats_record(id, STATS_READ, start, err);
+	}
+	close(fd);
+	if (err)
+		return err;
+	buf[len] = '\0';
+	*readback = strtol(buf, NULL, 10);
+	return *readback == lsb ? 0 : EIO;
+}
+
+/*
+ * A register already matches an entry if it holds the register value of
+ * the entry, or a value that reads back as the entry: a profile saved
+ * from a device applies to it without any write.
+ */
+static int matches(const struct profile_entry *e, int current)
+{
+	return current == e->lsb || (e->has_unit && attr_from_LSB(e->id, current) == e->value);
+}
+
+static int apply_device(FILE *out, const struct ltc_device *dev, const struct profile_entry *entries,
+		int n, int dry_run)
+{
+	struct snapshot snap;
+	int differ = 0, written = 0, failed = 0;
+
+	snapshot_init(&snap, dev, 1);
+	for (int i = 0; i < n; i++) {
+		const struct profile_entry *e = &entries[i];
+		int current, readback = 0, err;
+
+		if (!snapshot_has(&snap, e->id)) {
+			fprintf(stderr, "profile: %s: %s is not available\n", dev->name, attr_table[e->id].name);
+			failed++;
+			continue;
+		}
+		current = snap.raw[e->id];
+		if (matches(e, current))
+			continue;
+		fprintf(out, "%s: %d -> %d\n", attr_table[e->id].name, current, e->lsb);
+		differ++;
+		if (dry_run)
+			continue;
+		if ((err = write_verified(dev, e->id, e->lsb, &readback)) == 0) {
+			written++;
+		} else {
+			if (err == EIO)
+				fprintf(stderr, "profile: %s: %s reads %d after writing %d\n", dev->name,
+						attr_table[e->id].name, readback, e->lsb);
+			else
+				fprintf(stderr, "profile: %s: cannot write %s: %s\n", dev->name,
+						attr_table[e->id].name, strerror(err));
+			failed++;
+		}
+	}
+	if (dry_run)
+		fprintf(out, "%d of %d settings differ\n", differ, n);
+	else
+		fprintf(out, "%d of %d settings written\n", written, n);
+	return failed ? EIO : 0;
+}
+
+static int save_device(const char *path, const struct ltc_device *dev)
+{
+	struct snapshot snap;
+	char date[32];
+	time_t now = time(NULL);
+	FILE *file;
+	int res;
+
+	if ((file = fopen(path, "w")) == NULL)
+		return throw("profile: cannot create the profile", errno);
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&now));
+	fprintf(file, "# ltc-monitor profile of %s%s%s%s, %s\n", dev->name, dev->bus[0] ? " (" : "",
+			dev->bus, dev->bus[0] ? ")" : "", date);
+	snapshot_init(&snap, dev, 1);
+	for (int id = 0; id < NUM_ATTRS; id++) {
+		if (!in_profile(id) || !snapshot_has(&snap, id))
+			continue;
+		if (attr_table[id].unit == UNIT_NONE)
+			fprintf(file, "%s %d\n", attr_table[id].name, snap.raw[id]);
+		else
+			fprintf(file, "%s %d %s\n", attr_table[id].name, snap.conv[id], attr_unit_name(id));
+	}
+	// ferror() leaves no errno behind
+	res = ferror(file) ? EIO : 0;
+	if (fclose(file) != 0 && res == 0)
+		res = errno;
+	if (res) {
+		fprintf(stderr, "profile: cannot write %s: %s\n", path, strerror(res));
+		return res;
+	}
+	return 0;
+}
+
+/**
+ * profile_command() - save the settings of the devices, or apply them
+ *
+ * ltc-monitor profile save F
+ * ltc-monitor profile apply [--dry-run] F
+ * A profile is a text file of "name value [unit]" lines, the alarm levels
+ * in their physical unit (see parse_line()). save writes one per device
+ * (see device_filename()). apply loads the whole profile first, then reads
+ * the registers of each device and only writes the ones that differ; each
+ * write is read back. With --dry-run the differences are only printed.
+ * Return: 0 on success, otherwise error code
+*/
+int profile_command(int argc, char *argv[], struct ltc_device **devs, int ndev)
+{
+	static const struct option options[] = {
+		{ "dry-run", no_argument, NULL, 'n' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct profile_entry entries[NUM_ATTRS];
+	char path[PATH_MAX];
+	int opt, n, dry_run = 0, res = 0;
+
+	if (argc < 2 || (strcmp(argv[1], "save") != 0 && strcmp(argv[1], "apply") != 0)) {
+		fprintf(stderr, "profile: save or apply?\n");
+		return EINVAL;
+	}
+	optind = 2;
+	while ((opt = getopt_long(argc, argv, "n", options, NULL)) != -1) {
+		if (opt != 'n')
+			return EINVAL;
+		dry_run = 1;
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, "profile: missing profile file\n");
+		return EINVAL;
+	}
+
+	if (strcmp(argv[1], "save") == 0) {
+		for (int d = 0; d < ndev; d++) {
+			device_filename(path, sizeof(path), argv[optind], devs[d], ndev);
+			res |= save_device(path, devs[d]);
+		}
+		return res;
+	}
+
+	if ((n = load_profile(argv[optind], entries)) < 0)
+		return -n;
+	for (int d = 0; d < ndev; d++) {
+		device_header(stdout, devs[d], ndev);
+		res |= apply_device(stdout, devs[d], entries, n, dry_run);
+	}
+	return res;
+}
@@ -0,0 +1,207 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ring.h"
+
+#define NSEC_PER_SEC 1000000000LL
+
+static int64_t timespec_to_ns(const struct timespec *ts)
+{
+	return (int64_t) ts->tv_sec * NSEC_PER_SEC + ts->tv_nsec;
+}
+
+static int check_header(const struct ring_header *hdr, size_t size)
+{
+	if (memcmp(hdr->magic, RING_MAGIC, 4) != 0 || hdr->version != RING_VERSION
+			|| hdr->record_size != sizeof(struct ring_record))
+		return EINVAL;
+	if (size != sizeof(*hdr) + (size_t) hdr->capacity * sizeof(struct ring_record))
+		return EINVAL;
+	return 0;
+}
+
+/**
+ * ring_open() - open a ring file, creating it if it does not exist
+ * @capacity: number of records of a new file, an existing file keeps its own
+ * @hz: sampling rate of the writer, 0 to open the file read only
+ *
+ * A new file is allocated in full, so that writes never need new blocks.
+ * Record timestamps are CLOCK_MONOTONIC, shifted so that they keep growing
+ * across reboots and map to the wall clock through a single offset.
+ * Return: 0 on success, otherwise error code
+*/
+int ring_open(struct ring *ring, const char *path, uint32_t capacity, uint32_t hz)
+{
+	int writer = hz != 0;
+	struct timespec mono, wall;
+	struct stat st;
+	int err;
+
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = open(path, writer ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+	if (ring->fd < 0)
+		return throw("ring_open: cannot open ring file", errno);
+	if (fstat(ring->fd, &st) < 0) {
+		err = throw("ring_open: cannot stat ring file", errno);
+		goto fail;
+	}
+
+	ring->size = st.st_size;
+	if (ring->size == 0) {
+		if (!writer || capacity == 0) {
+			err = EINVAL;
+			goto fail;
+		}
+		ring->size = sizeof(struct ring_header) + (size_t) capacity * sizeof(struct ring_record);
+		if ((err = posix_fallocate(ring->fd, 0, ring->size)) != 0) {
+			fprintf(stderr, "ring_open: cannot allocate %zu bytes: %s\n", ring->size, strerror(err));
+			goto fail;
+		}
+	}
+
+	ring->hdr = mmap(NULL, ring->size, writer ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, ring->fd, 0);
+	if (ring->hdr == MAP_FAILED) {
+		ring->hdr = NULL;
+		err = throw("ring_open: mmap failed", errno);
+		goto fail;
+	}
+	ring->records = (struct ring_record *) (ring->hdr + 1);
+
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	clock_gettime(CLOCK_REALTIME, &wall);
+	if (writer && st.st_size == 0) {
+		memcpy(ring->hdr->magic, RING_MAGIC, 4);
+		ring->hdr->version = RING_VERSION;
+		ring->hdr->record_size = sizeof(struct ring_record);
+		ring->hdr->capacity = capacity;
+		ring->hdr->count = 0;
+		ring->hdr->wall_offset = timespec_to_ns(&wall) - timespec_to_ns(&mono);
+	} else if ((err = check_header(ring->hdr, ring->size)) != 0) {
+		fprintf(stderr, "ring_open: %s is not a ring file\n", path);
+		goto fail;
+	}
+	if (writer) {
+		ring->hdr->hz = hz;
+		ring->bias = timespec_to_ns(&wall) - ring->hdr->wall_offset - timespec_to_ns(&mono);
+	}
+	return 0;
+
+fail:
+	ring_close(ring);
+	return err;
+}
+
+void ring_append(struct ring *ring, const struct timespec *mono, const struct sample_row *row)
+{
+	struct ring_record *rec = &ring->records[ring->hdr->count % ring->hdr->capacity];
+
+	rec->timestamp = timespec_to_ns(mono) + ring->bias;
+	for (int i = 0; i < SAMPLE_COLUMNS; i++)
+		rec->raw[i] = (uint16_t) row->raw[i];
+	rec->valid = row->valid;
+	// the record must be complete before a reader can see it
+	__atomic_store_n(&ring->hdr->count, ring->hdr->count + 1, __ATOMIC_RELEASE);
+}
+
+void ring_close(struct ring *ring)
+{
+	if (ring->hdr != NULL) {
+		msync(ring->hdr, ring->size, MS_ASYNC);
+		munmap(ring->hdr, ring->size);
+	}
+	if (ring->fd >= 0)
+		close(ring->fd);
+	ring->hdr = NULL;
+	ring->fd = -1;
+}
+
+/**
+ * export_ring() - decode a ring file to csv
+ *
+ * ltc-monitor export <ring> [--from T] [--to T] [--last N] [--file F]
+ * T is a unix time in seconds. Rows have the same layout as the ones
+ * written by sample.
+ * Return: 0 on success, otherwise error code
+*/
+int export_ring(int argc, char *argv[])
+{
+	static const struct option options[] = {
+		{ "from", required_argument, NULL, 'a' },
+		{ "to", required_argument, NULL, 'b' },
+		{ "last", required_argument, NULL, 'n' },
+		{ "file", required_argument, NULL, 'f' },
+		{ NULL, 0, NULL, 0 }
+	};
+	int64_t from = INT64_MIN, to = INT64_MAX;
+	uint64_t first, count, last = 0;
+	char buf[SAMPLE_ROW_MAX];
+	struct sample_row row;
+	char *filename = NULL;
+	struct ring ring;
+	FILE *out = stdout;
+	int opt, err;
+
+	optind = 1;
+	while ((opt = getopt_long(argc, argv, "a:b:n:f:", options, NULL)) != -1) {
+		switch (opt) {
+		case 'a':
+			from = strtoll(optarg, NULL, 10) * NSEC_PER_SEC;
+			break;
+		case 'b':
+			to = strtoll(optarg, NULL, 10) * NSEC_PER_SEC;
+			break;
+		case 'n':
+			last = strtoull(optarg, NULL, 10);
+			break;
+		case 'f':
+			filename = optarg;
+			break;
+		default:
+			return EINVAL;
+		}
+	}
+	if (optind >= argc) {
+		fprintf(stderr, "export: missing ring file\n");
+		return EINVAL;
+	}
+	if ((err = ring_open(&ring, argv[optind], 0, 0)) != 0)
+		return err;
+	if (filename != NULL && (out = fopen(filename, "w")) == NULL) {
+		ring_close(&ring);
+		return throw("export: cannot open output file", errno);
+	}
+
+	count = __atomic_load_n(&ring.hdr->count, __ATOMIC_ACQUIRE);
+	first = count > ring.hdr->capacity ? count - ring.hdr->capacity : 0;
+	if (last != 0 && count - first > last)
+		first = count - last;
+
+	fwrite(buf, 1, sample_format_header(buf, sizeof(buf)), out);
+	for (uint64_t n = first; n < count; n++) {
+		const struct ring_record *rec = &ring.records[n % ring.hdr->capacity];
+		int64_t wall = rec->timestamp + ring.hdr->wall_offset;
+
+		if (wall < from || wall > to)
+			continue;
+		row.time.tv_sec = wall / NSEC_PER_SEC;
+		row.time.tv_nsec = wall % NSEC_PER_SEC;
+		// the input current is the one signed register: it reads a few LSB below 0 at rest
+		for (int i = 0; i < SAMPLE_COLUMNS; i++)
+			row.raw[i] = sample_column_id(i) == ATTR_MEAS_IIN ? (int16_t) rec->raw[i] : rec->raw[i];
+		row.valid = rec->valid;
+		fwrite(buf, 1, sample_format_row(buf, sizeof(buf), &row, ring.hdr->hz), out);
+	}
+
+	if (out != stdout)
+		fclose(out);
+	ring_close(&ring);
+	return 0;
+}
@@ -0,0 +1,55 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdint.h>
+
+#include "ltc-monitor.h"
+
+#define RING_MAGIC "LTCR"
+#define RING_VERSION 1
+// one day at 1 Hz
+#define RING_DEFAULT_CAPACITY 86400
+
+/*
+ * Binary telemetry log: a header followed by a fixed number of records.
+ * The file is allocated when it is created and never grows, once it is full
+ * the oldest records are overwritten.
+ * All fields are in host byte order.
+ */
+struct ring_header {
+	char magic[4];
+	uint16_t version;
+	uint16_t record_size;
+	uint32_t capacity;
+	uint32_t hz;
+	uint64_t count; // records written since creation, the next slot is count % capacity
+	int64_t wall_offset; // CLOCK_REALTIME - record timestamp, in ns
+	uint8_t reserved[32];
+};
+
+/*
+ * One sample: the raw register values of the sample columns
+ * (dtemp, iin, gpi, vcap, vcap1-4, vin, vout).
+ * The timestamp is monotonic, it only relates to the wall clock
+ * through the header's wall_offset.
+ */
+struct ring_record {
+	uint64_t timestamp; // ns
+	uint16_t raw[SAMPLE_COLUMNS];
+	uint16_t valid; // bitmask of the columns that were read, and SAMPLE_STRADDLED
+	uint16_t reserved;
+};
+
+struct ring {
+	int fd;
+	size_t size;
+	struct ring_header *hdr;
+	struct ring_record *records;
+	int64_t bias; // added to CLOCK_MONOTONIC to get the record timestamp
+};
+
+int ring_open(struct ring *ring, const char *path, uint32_t capacity, uint32_t hz);
+void ring_append(struct ring *ring, const struct timespec *mono, const struct sample_row *row);
+void ring_close(struct ring *ring);
+
+#endif
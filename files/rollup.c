@@ -0,0 +1,503 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rollup.h"
+#include "store.h"
+
+// the tiers, finest first: each one is a file named after its resolution
+static const struct {
+	const char *suffix;
+	uint32_t resolution; // s
+	uint32_t capacity;
+} tiers[ROLLUP_TIERS] = {
+	{ "1m", 60, ROLLUP_MINUTES },
+	{ "1h", 3600, ROLLUP_HOURS },
+};
+
+static int check_header(const struct rollup_header *hdr, size_t size, int tier)
+{
+	if (memcmp(hdr->magic, ROLLUP_MAGIC, 4) != 0 || hdr->version != ROLLUP_VERSION
+			|| hdr->bucket_size != sizeof(struct rollup_bucket) || hdr->resolution != tiers[tier].resolution
+			|| hdr->capacity == 0)
+		return EINVAL;
+	if (size != sizeof(*hdr) + (size_t) hdr->capacity * sizeof(struct rollup_bucket))
+		return EINVAL;
+	return 0;
+}
+
+static void close_tier(struct rollup_tier *t)
+{
+	if (t->hdr != NULL) {
+		msync(t->hdr, t->size, MS_ASYNC);
+		munmap(t->hdr, t->size);
+	}
+	if (t->fd >= 0)
+		close(t->fd);
+	t->hdr = NULL;
+	t->fd = -1;
+}
+
+static int open_tier(struct rollup_tier *t, const char *path, int tier, int writer)
+{
+	struct stat st;
+	int err;
+
+	t->fd = open(path, writer ? O_RDWR | O_CREAT | O_CLOEXEC : O_RDONLY | O_CLOEXEC, 0644);
+	if (t->fd < 0) {
+		err = errno;
+		fprintf(stderr, "rollup: cannot open %s: %s\n", path, strerror(err));
+		return err;
+	}
+	if (fstat(t->fd, &st) < 0) {
+		err = throw("rollup: cannot stat the tier", errno);
+		goto fail;
+	}
+
+	t->size = st.st_size;
+	if (t->size == 0) {
+		if (!writer) {
+			err = EINVAL;
+			goto fail;
+		}
+		t->size = sizeof(struct rollup_header) + (size_t) tiers[tier].capacity * sizeof(struct rollup_bucket);
+		if ((err = posix_fallocate(t->fd, 0, t->size)) != 0) {
+			fprintf(stderr, "rollup: cannot allocate %zu bytes: %s\n", t->size, strerror(err));
+			goto fail;
+		}
+	}
+
+	t->hdr = mmap(NULL, t->size, writer ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, t->fd, 0);
+	if (t->hdr == MAP_FAILED) {
+		t->hdr = NULL;
+		err = throw("rollup: mmap failed", errno);
+		goto fail;
+	}
+	t->buckets = (struct rollup_bucket *) (t->hdr + 1);
+
+	if (writer && st.st_size == 0) {
+		// posix_fallocate() zeroed the buckets: every slot is empty
+		memcpy(t->hdr->magic, ROLLUP_MAGIC, 4);
+		t->hdr->version = ROLLUP_VERSION;
+		t->hdr->bucket_size = sizeof(struct rollup_bucket);
+		t->hdr->capacity = tiers[tier].capacity;
+		t->hdr->resolution = tiers[tier].resolution;
+	} else if ((err = check_header(t->hdr, t->size, tier)) != 0) {
+		fprintf(stderr, "rollup: %s is not a %s rollup tier\n", path, tiers[tier].suffix);
+		goto fail;
+	}
+	return 0;
+
+fail:
+	close_tier(t);
+	return err;
+}
+
+/**
+ * rollup_open() - open the tiers of a rollup, creating them if they do not exist
+ * @path: the tiers are PATH.1m and PATH.1h
+ * @writer: 0 to open them read only
+ *
+ * A new tier is allocated in full, so that updates never need new blocks:
+ * a week of minutes and a year of hours, 2.5 and 2.2 MB.
+ * Return: 0 on success, otherwise error code
+*/
+int rollup_open(struct rollup *rollup, const char *path, int writer)
+{
+	char name[PATH_MAX];
+	int err;
+
+	for (int i = 0; i < ROLLUP_TIERS; i++) {
+		rollup->tiers[i].fd = -1;
+		rollup->tiers[i].hdr = NULL;
+	}
+	for (int i = 0; i < ROLLUP_TIERS; i++) {
+		snprintf(name, sizeof(name), "%s.%s", path, tiers[i].suffix);
+		if ((err = open_tier(&rollup->tiers[i], name, i, writer)) != 0) {
+			rollup_close(rollup);
+			return err;
+		}
+	}
+	return 0;
+}
+
+static void update_tier(struct rollup_tier *t, const struct sample_row *row)
+{
+	struct rollup_header *hdr = t->hdr;
+	int64_t start = row->time.tv_sec - row->time.tv_sec % hdr->resolution;
+	struct rollup_bucket *b = &t->buckets[(start / hdr->resolution) % hdr->capacity];
+
+	if (b->start != start) {
+		// the slot holds newer samples: this one is past the retention
+		if (b->start > start)
+			return;
+		// readers skip the slot while it is cleared
+		__atomic_store_n(&b->start, 0, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		memset(b->columns, 0, sizeof(b->columns));
+		__atomic_store_n(&b->start, start, __ATOMIC_RELEASE);
+	}
+	for (int i = 0; i < SAMPLE_COLUMNS; i++) {
+		struct rollup_column *c = &b->columns[i];
+		int32_t value = row->raw[i];
+
+		if (!(row->valid & (1U << i)))
+			continue;
+		if (c->count == 0 || value < c->min)
+			c->min = value;
+		if (c->count == 0 || value > c->max)
+			c->max = value;
+		c->sum += value;
+		c->count++;
+		c->last = value;
+	}
+	if (start > hdr->latest)
+		hdr->latest = start;
+	hdr->updates++;
+}
+
+/**
+ * rollup_update() - take a sample into the bucket of its time in every tier
+ *
+ * The aggregates are updated in place, a bucket at a time: the cost does
+ * not depend on the size of the tiers, and between syncs the kernel
+ * writes back the pages of the current buckets only. Samples older than
+ * what a tier keeps are left out of it.
+*/
+void rollup_update(struct rollup *rollup, const struct sample_row *row)
+{
+	if (row->time.tv_sec <= 0)
+		return;
+	for (int i = 0; i < ROLLUP_TIERS; i++)
+		update_tier(&rollup->tiers[i], row);
+}
+
+void rollup_sync(struct rollup *rollup)
+{
+	for (int i = 0; i < ROLLUP_TIERS; i++)
+		if (rollup->tiers[i].hdr != NULL)
+			msync(rollup->tiers[i].hdr, rollup->tiers[i].size, MS_SYNC);
+}
+
+void rollup_close(struct rollup *rollup)
+{
+	for (int i = 0; i < ROLLUP_TIERS; i++)
+		close_tier(&rollup->tiers[i]);
+}
+
+/*
+ * Copies the bucket of @start, if its slot still holds it.
+ * Return: 1 if it does, 0 otherwise.
+ */
+static int read_bucket(const struct rollup_tier *t, int64_t start, struct rollup_bucket *copy)
+{
+	const struct rollup_bucket *b = &t->buckets[(start / t->hdr->resolution) % t->hdr->capacity];
+
+	if (__atomic_load_n(&b->start, __ATOMIC_ACQUIRE) != start)
+		return 0;
+	memcpy(copy, b, sizeof(*copy));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&b->start, __ATOMIC_RELAXED) == start;
+}
+
+// the start of the oldest bucket a tier can still hold
+static int64_t tier_oldest(const struct rollup_tier *t)
+{
+	return t->hdr->latest - (int64_t) (t->hdr->capacity - 1) * t->hdr->resolution;
+}
+
+// the finest tier that still holds @from, or the coarsest one
+static int choose_tier(const struct rollup *rollup, int64_t from)
+{
+	for (int i = 0; i < ROLLUP_TIERS - 1; i++) {
+		const struct rollup_tier *t = &rollup->tiers[i];
+
+		if (t->hdr->latest != 0 && from >= tier_oldest(t))
+			return i;
+	}
+	return ROLLUP_TIERS - 1;
+}
+
+static const char *const aggregates[] = { "min", "max", "mean", "last" };
+
+static void format_time(char *buf, size_t size, int64_t t)
+{
+	time_t tt = t;
+	struct tm tm;
+
+	gmtime_r(&tt, &tm);
+	strftime(buf, size, "%Y-%m-%dT%H:%M:%SZ", &tm);
+}
+
+// a column's aggregates in °C or mV, in the order of aggregates[]
+static void column_values(const struct rollup_column *c, int column, double *values)
+{
+	values[0] = sample_column_value(column, c->min);
+	values[1] = sample_column_value(column, c->max);
+	values[2] = sample_column_value(column, (double) c->sum / c->count);
+	values[3] = sample_column_value(column, c->last);
+}
+
+static void print_csv_header(FILE *out)
+{
+	fprintf(out, "time,samples");
+	for (int i = 0; i < SAMPLE_COLUMNS; i++)
+		for (int a = 0; a < 4; a++)
+			fprintf(out, ",%s_%s", attr_table[sample_column_id(i)].name + strlen("meas_"), aggregates[a]);
+	fputc('\n', out);
+}
+
+static void print_csv_bucket(FILE *out, const struct rollup_bucket *b, uint32_t samples)
+{
+	char time[32];
+
+	format_time(time, sizeof(time), b->start);
+	fprintf(out, "%s,%u", time, samples);
+	for (int i = 0; i < SAMPLE_COLUMNS; i++) {
+		int decimals = attr_table[sample_column_id(i)].unit == UNIT_C ? 2 : 1;
+		double values[4];
+
+		if (b->columns[i].count == 0) {
+			fprintf(out, ",,,,");
+			continue;
+		}
+		column_values(&b->columns[i], i, values);
+		for (int a = 0; a < 4; a++)
+			fprintf(out, ",%.*f", decimals, values[a]);
+	}
+	fputc('\n', out);
+}
+
+static void print_json_bucket(FILE *out, const struct rollup_bucket *b, uint32_t samples, int first)
+{
+	char time[32];
+
+	format_time(time, sizeof(time), b->start);
+	fprintf(out, "%s{\"time\":\"%s\",\"samples\":%u", first ? "" : ",\n", time, samples);
+	for (int i = 0; i < SAMPLE_COLUMNS; i++) {
+		int decimals = attr_table[sample_column_id(i)].unit == UNIT_C ? 2 : 1;
+		double values[4];
+
+		fprintf(out, ",\"%s\":", attr_table[sample_column_id(i)].name + strlen("meas_"));
+		if (b->columns[i].count == 0) {
+			fprintf(out, "null");
+			continue;
+		}
+		column_values(&b->columns[i], i, values);
+		for (int a = 0; a < 4; a++)
+			fprintf(out, "%s\"%s\":%.*f", a ? "," : "{", aggregates[a], decimals, values[a]);
+		fputc('}', out);
+	}
+	fputc('}', out);
+}
+
+/*
+ * --from and --to are unix times in seconds, the buckets that overlap
+ * them are written. Without --tier, the finest tier that still holds
+ * --from is taken.
+ */
+static int rollup_query(int argc, char *argv[])
+{
+	static const struct option options[] = {
+		{ "from", required_argument, NULL, 'a' },
+		{ "to", required_argument, NULL, 'b' },
+		{ "tier", required_argument, NULL, 't' },
+		{ "format", required_argument, NULL, 'o' },
+		{ "file", required_argument, NULL, 'f' },
+		{ NULL, 0, NULL, 0 }
+	};
+	int64_t from = INT64_MIN, to = INT64_MAX, first, last;
+	const struct rollup_tier *t;
+	struct rollup_bucket bucket;
+	struct rollup rollup;
+	char *filename = NULL;
+	FILE *out = stdout;
+	int opt, err, tier = -1, json = 0, rows = 0;
+
+	optind = 1;
+	while ((opt = getopt_long(argc, argv, "a:b:t:o:f:", options, NULL)) != -1) {
+		switch (opt) {
+		case 'a':
+			from = strtoll(optarg, NULL, 10);
+			break;
+		case 'b':
+			to = strtoll(optarg, NULL, 10);
+			break;
+		case 't':
+			for (tier = ROLLUP_TIERS - 1; tier >= 0 && strcmp(optarg, tiers[tier].suffix) != 0; tier--)
+				;
+			if (tier < 0) {
+				fprintf(stderr, "rollup: the tiers are 1m and 1h\n");
+				return EINVAL;
+			}
+			break;
+		case 'o':
+			if (strcmp(optarg, "json") != 0 && strcmp(optarg, "csv") != 0) {
+				fprintf(stderr, "rollup: the formats are csv and json\n");
+				return EINVAL;
+			}
+			json = strcmp(optarg, "json") == 0;
+			break;
+		case 'f':
+			filename = optarg;
+			break;
+		default:
+			return EINVAL;
+		}
+	}
+	if (optind >= argc) {
+		fprintf(stderr, "rollup: missing rollup\n");
+		return EINVAL;
+	}
+	if ((err = rollup_open(&rollup, argv[optind], 0)) != 0)
+		return err;
+	if (filename != NULL && (out = fopen(filename, "w")) == NULL) {
+		rollup_close(&rollup);
+		return throw("rollup: cannot open output file", errno);
+	}
+
+	if (tier < 0)
+		tier = choose_tier(&rollup, from);
+	t = &rollup.tiers[tier];
+	first = tier_oldest(t);
+	if (from > first)
+		first = from - from % t->hdr->resolution;
+	last = to < t->hdr->latest ? to : t->hdr->latest;
+
+	if (json)
+		fprintf(out, "{\"tier\":\"%s\",\"resolution\":%u,\"buckets\":[\n", tiers[tier].suffix,
+				t->hdr->resolution);
+	else
+		print_csv_header(out);
+	for (int64_t start = first; t->hdr->latest != 0 && start <= last; start += t->hdr->resolution) {
+		uint32_t samples = 0;
+
+		if (!read_bucket(t, start, &bucket))
+			continue;
+		for (int i = 0; i < SAMPLE_COLUMNS; i++)
+			if (bucket.columns[i].count > samples)
+				samples = bucket.columns[i].count;
+		if (json)
+			print_json_bucket(out, &bucket, samples, rows == 0);
+		else
+			print_csv_bucket(out, &bucket, samples);
+		rows++;
+	}
+	if (json)
+		fprintf(out, "%s]}\n", rows ? "\n" : "");
+
+	if (out != stdout)
+		fclose(out);
+	rollup_close(&rollup);
+	return 0;
+}
+
+// what each tier holds
+static int rollup_info(int argc, char *argv[])
+{
+	struct rollup_bucket bucket;
+	struct rollup rollup;
+	int err;
+
+	if (argc < 2) {
+		fprintf(stderr, "rollup: missing rollup\n");
+		return EINVAL;
+	}
+	if ((err = rollup_open(&rollup, argv[1], 0)) != 0)
+		return err;
+	for (int i = 0; i < ROLLUP_TIERS; i++) {
+		const struct rollup_tier *t = &rollup.tiers[i];
+		int64_t first = 0;
+		uint32_t filled = 0;
+
+		for (int64_t start = tier_oldest(t); t->hdr->latest != 0 && start <= t->hdr->latest;
+				start += t->hdr->resolution) {
+			if (!read_bucket(t, start, &bucket))
+				continue;
+			if (filled++ == 0)
+				first = start;
+		}
+		printf("%s: %u buckets of %u s, %.1f days, %zu bytes, %u filled, %llu samples taken in\n",
+				tiers[i].suffix, t->hdr->capacity, t->hdr->resolution,
+				(double) t->hdr->capacity * t->hdr->resolution / 86400, t->size, filled,
+				(unsigned long long) t->hdr->updates);
+		if (filled) {
+			char from[32], to[32];
+
+			format_time(from, sizeof(from), first);
+			format_time(to, sizeof(to), t->hdr->latest);
+			printf("from %s to %s\n", from, to);
+		}
+	}
+	rollup_close(&rollup);
+	return 0;
+}
+
+// rolls up the rows of stores, in the order given
+static int rollup_import(int argc, char *argv[])
+{
+	struct sample_row row;
+	struct rollup rollup;
+	struct store *store;
+	uint64_t imported = 0;
+	int err, res = 0;
+
+	if (argc < 3) {
+		fprintf(stderr, "rollup: import R store...\n");
+		return EINVAL;
+	}
+	if ((store = malloc(sizeof(*store))) == NULL)
+		return throw("rollup: cannot allocate the store", ENOMEM);
+	if ((err = rollup_open(&rollup, argv[1], 1)) != 0) {
+		free(store);
+		return err;
+	}
+	for (int i = 2; i < argc && !err; i++) {
+		if ((err = store_open(store, argv[i], 0)) != 0)
+			break;
+		while ((res = store_next_block(store, INT64_MIN, INT64_MAX)) > 0) {
+			for (uint32_t n = 0; n < store->rows; n++) {
+				store_row(store, n, &row);
+				rollup_update(&rollup, &row);
+				imported++;
+			}
+		}
+		store_close(store);
+		if (res < 0)
+			err = EINVAL;
+	}
+	rollup_sync(&rollup);
+	rollup_close(&rollup);
+	free(store);
+	printf("%llu rows imported\n", (unsigned long long) imported);
+	return err;
+}
+
+/**
+ * rollup_command() - query the rollups of a device
+ *
+ * ltc-monitor rollup query R [--from T] [--to T] [--tier 1m|1h] [--format csv|json] [--file F]
+ * ltc-monitor rollup info R
+ * ltc-monitor rollup import R store...
+ * Rollups are written by sample --rollup, or imported from stores. The
+ * values are in °C and mV, as in the csv files of sample.
+ * Return: 0 on success, otherwise error code
+*/
+int rollup_command(int argc, char *argv[])
+{
+	if (argc >= 2 && strcmp(argv[1], "query") == 0)
+		return rollup_query(argc - 1, argv + 1);
+	if (argc >= 2 && strcmp(argv[1], "info") == 0)
+		return rollup_info(argc - 1, argv + 1);
+	if (argc >= 2 && strcmp(argv[1], "import") == 0)
+		return rollup_import(argc - 1, argv + 1);
+	fprintf(stderr, "rollup: query, info or import\n");
+	return EINVAL;
+}
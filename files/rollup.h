@@ -0,0 +1,65 @@
+#ifndef ROLLUP_H
+#define ROLLUP_H
+
+#include <stdint.h>
+
+#include "ltc-monitor.h"
+
+#define ROLLUP_MAGIC "LTCU"
+#define ROLLUP_VERSION 1
+#define ROLLUP_TIERS 2
+// a week of minutes
+#define ROLLUP_MINUTES (7 * 24 * 60)
+// a leap year of hours
+#define ROLLUP_HOURS (366 * 24)
+
+/*
+ * A tier of rollups: a header followed by a fixed number of buckets, the
+ * aggregates of the samples of one resolution interval each. The file is
+ * allocated when it is created and never grows. The bucket of a time is
+ * at the slot (time / resolution) % capacity: it overwrites the one a
+ * capacity of intervals older. All fields are in host byte order.
+ */
+struct rollup_header {
+	char magic[4];
+	uint16_t version;
+	uint16_t bucket_size;
+	uint32_t capacity;
+	uint32_t resolution; // seconds per bucket
+	uint64_t updates; // samples taken in since creation
+	int64_t latest; // unix time of the start of the newest bucket, 0 while empty
+	uint8_t reserved[32];
+};
+
+// the aggregates of a column, in raw register units: unsigned 16-bit registers, and imported values may be negative
+struct rollup_column {
+	int64_t sum;
+	uint32_t count; // samples where the column was valid
+	int32_t min;
+	int32_t max;
+	int32_t last;
+};
+
+struct rollup_bucket {
+	int64_t start; // unix time, 0 for a slot never written
+	struct rollup_column columns[SAMPLE_COLUMNS];
+};
+
+struct rollup_tier {
+	int fd;
+	size_t size;
+	struct rollup_header *hdr;
+	struct rollup_bucket *buckets;
+};
+
+// the tiers of a device, finest first: PATH.1m and PATH.1h
+struct rollup {
+	struct rollup_tier tiers[ROLLUP_TIERS];
+};
+
+int rollup_open(struct rollup *rollup, const char *path, int writer);
+void rollup_update(struct rollup *rollup, const struct sample_row *row);
+void rollup_sync(struct rollup *rollup);
+void rollup_close(struct rollup *rollup);
+
+#endif
@@ -0,0 +1,890 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ring.h"
+#include "rollup.h"
+#include "store.h"
+
+#define NSEC_PER_SEC 1000000000L
+#define MAX_HZ 1000
+#define SAMPLE_QUEUE 1024
+#define SAMPLE_MAX_QUEUE 65536
+
+/*
+ * The columns of the csv files written by ltcsensors.py, in the same order
+ * (the meas_* attributes it reads, sorted by name).
+ */
+static const enum attr_id columns[SAMPLE_COLUMNS] = {
+	ATTR_MEAS_DTEMP,
+	ATTR_MEAS_IIN,
+	ATTR_MEAS_GPI,
+	ATTR_MEAS_VCAP,
+	ATTR_MEAS_VCAP1,
+	ATTR_MEAS_VCAP2,
+	ATTR_MEAS_VCAP3,
+	ATTR_MEAS_VCAP4,
+	ATTR_MEAS_VIN,
+	ATTR_MEAS_VOUT,
+};
+
+#define NUM_COLUMNS SAMPLE_COLUMNS
+
+// the attributes and outputs of one device
+struct sampler {
+	const struct ltc_device *dev;
+	int fds[NUM_COLUMNS];
+	FILE *out;
+	struct ring ring;
+	int has_ring;
+	struct store *store; // allocated when sampling to a store
+	struct rollup rollup;
+	int has_rollup;
+	struct balance balance;
+	struct cycle *cycle; // allocated when locked to the measurement cycle
+};
+
+/*
+ * A sample on its way from the sampler to the writer: the row has no
+ * wall clock time yet, the writer derives it from the monotonic one.
+ */
+struct sample_record {
+	struct timespec mono;
+	struct sample_row row;
+	int dev;
+};
+
+/*
+ * Lock-free single producer, single consumer ring of preallocated
+ * records. head is only written by the sampler and tail by the writer,
+ * each on its own cache line; a record is published by the release store
+ * of head, and given back by the release store of tail. A sampler that
+ * finds the ring full drops the record instead of waiting.
+ */
+struct sample_queue {
+	uint64_t head __attribute__((aligned(64)));
+	uint64_t dropped; // sampler only, like high_water
+	uint64_t high_water;
+	uint64_t tail __attribute__((aligned(64)));
+	int done __attribute__((aligned(64))); // set by the sampler after its last record
+	uint32_t mask; // size - 1, the size is a power of 2
+	struct sample_record *records;
+};
+
+// the writer thread and what it writes to
+struct sample_writer {
+	struct sampler *samplers;
+	int ndev;
+	int hz;
+	int prefix; // rows on standard output start with the device name
+	int balance;
+	long flush; // ms between batches
+	long fsync; // ms between fsyncs, 0 after every batch, -1 never
+	int64_t wall_offset; // CLOCK_REALTIME - CLOCK_MONOTONIC, in ns
+	struct sample_queue queue;
+	uint64_t rows;
+	uint64_t batches;
+	uint64_t fsyncs;
+	uint64_t max_batch_ns; // longest time to write and flush a batch
+	uint64_t max_fsync_ns;
+	int err;
+};
+
+static volatile sig_atomic_t stop_sampling;
+
+static void sample_stop(int sig)
+{
+	(void) sig;
+	stop_sampling = 1;
+}
+
+/**
+ * sample_open_columns() - open every meas_* attribute once
+ * @fds: SAMPLE_COLUMNS descriptors, -1 for the attributes missing
+ *
+ * Missing attributes are not fatal: the column is kept, so that the csv
+ * layout stays the same, but it is left empty.
+ * Return: number of attributes opened.
+ */
+int sample_open_columns(const struct ltc_device *dev, int *fds)
+{
+	char path[PATH_MAX];
+	int opened = 0;
+
+	for (size_t i = 0; i < NUM_COLUMNS; i++) {
+		snprintf(path, sizeof(path), "%s/%s", dev->path, attr_table[columns[i]].name);
+		fds[i] = open(path, O_RDONLY);
+		if (fds[i] < 0) {
+			fprintf(stderr, "sample: cannot open %s: %s\n", path, strerror(errno));
+			continue;
+		}
+		opened++;
+	}
+	return opened;
+}
+
+void sample_close_columns(int *fds)
+{
+	for (size_t i = 0; i < NUM_COLUMNS; i++) {
+		if (fds[i] >= 0)
+			close(fds[i]);
+		fds[i] = -1;
+	}
+}
+
+static void close_sampler(struct sampler *s)
+{
+	sample_close_columns(s->fds);
+	if (s->out != NULL && s->out != stdout)
+		fclose(s->out);
+	s->out = NULL;
+	if (s->has_ring)
+		ring_close(&s->ring);
+	s->has_ring = 0;
+	if (s->store != NULL)
+		store_close(s->store);
+	free(s->store);
+	s->store = NULL;
+	if (s->has_rollup)
+		rollup_close(&s->rollup);
+	s->has_rollup = 0;
+	free(s->cycle);
+	s->cycle = NULL;
+}
+
+/*
+ * sysfs regenerates the attribute on every read at offset 0,
+ * so a pread() is all it takes to refresh the value.
+ * Return: 0 on success, otherwise error code
+ */
+int sample_read_column(const int *fds, int column, long *value)
+{
+	char buf[16];
+	char *endptr;
+	ssize_t len;
+	int err;
+
+	if (fds[column] < 0)
+		return ENOENT;
+	for (int attempt = 0; ; attempt++) {
+		uint64_t start = stats_start();
+
+		len = pread(fds[column], buf, sizeof(buf) - 1, 0);
+		err = len < 0 ? errno : len == 0 ? EIO : 0;
+		stats_record(columns[column], STATS_READ, start, err);
+		if (!stats_transient(err) || attempt == STATS_RETRIES)
+			break;
+		stats_retry(columns[column], STATS_READ);
+	}
+	if (err)
+		return err;
+	buf[len] = '\0';
+	*value = strtol(buf, &endptr, 10);
+	return endptr != buf ? 0 : EINVAL;
+}
+
+void sample_read_columns(const int *fds, struct sample_row *row)
+{
+	row->valid = 0;
+	for (size_t i = 0; i < NUM_COLUMNS; i++)
+		if (sample_read_column(fds, i, &row->raw[i]) == 0)
+			row->valid |= 1U << i;
+}
+
+/**
+ * sample_snapshot_row() - take the sample columns from a snapshot
+ *
+ * Columns the snapshot does not have are left empty.
+*/
+void sample_snapshot_row(struct snapshot *snap, struct sample_row *row)
+{
+	row->valid = 0;
+	for (size_t i = 0; i < NUM_COLUMNS; i++) {
+		if (!snapshot_has(snap, columns[i]))
+			continue;
+		row->raw[i] = snap->raw[columns[i]];
+		row->valid |= 1U << i;
+	}
+	row->time = snap->time;
+}
+
+// Return: index of the column of a measurement, -1 if it is not sampled.
+int sample_column(enum attr_id id)
+{
+	for (size_t i = 0; i < NUM_COLUMNS; i++)
+		if (columns[i] == id)
+			return i;
+	return -1;
+}
+
+enum attr_id sample_column_id(int column)
+{
+	return columns[column];
+}
+
+/**
+ * sample_column_value() - convert a register value of a column as ltcsensors.py does
+ * @raw: register value, or a mean of register values
+ *
+ * ltcsensors.py has no conversion for iin and reports it as a 2.21 mV/LSB
+ * voltage: keep that for compatibility.
+ * Return: the value in °C for the temperature, in mV for everything else.
+*/
+double sample_column_value(int column, double raw)
+{
+	const struct attr_desc *desc = &attr_table[columns[column]];
+
+	if (desc->unit == UNIT_C)
+		return 0.028 * raw - 251.4;
+	if (desc->unit == UNIT_MV)
+		return raw * (desc->factor / 10.0) / 1000;
+	return raw * 2.21;
+}
+
+// same formatting as ltcsensors.py: "%5.1f °C" for the temperature, "%5.0f mV" for everything else
+static int format_column(char *buf, size_t size, int column, long raw)
+{
+	if (attr_table[columns[column]].unit == UNIT_C)
+		return snprintf(buf, size, "%5.1f °C", sample_column_value(column, raw));
+	return snprintf(buf, size, "%5.0f mV", sample_column_value(column, raw));
+}
+
+int sample_format_header(char *buf, size_t size)
+{
+	int len = snprintf(buf, size, "timestamp");
+
+	for (size_t i = 0; i < NUM_COLUMNS; i++)
+		len += snprintf(buf + len, size - len, ",%s", attr_table[columns[i]].name + strlen("meas_"));
+	buf[len++] = '\n';
+	return len;
+}
+
+// the register value closest to a value formatted by format_column()
+static long parse_column(enum attr_id id, double value)
+{
+	const struct attr_desc *desc = &attr_table[id];
+
+	if (desc->unit == UNIT_C)
+		return lround((value + 251.4) / 0.028);
+	if (desc->unit == UNIT_MV)
+		return lround(value * 1000 / (desc->factor / 10.0));
+	return lround(value / 2.21);
+}
+
+/**
+ * sample_format_row() - format a row as ltcsensors.py does
+ * @buf: output buffer, at least SAMPLE_ROW_MAX bytes
+ * @hz: sampling rate, above 1 Hz the timestamp gets a milliseconds field
+ * Return: length of the row, newline included.
+*/
+int sample_format_row(char *buf, size_t size, const struct sample_row *row, int hz)
+{
+	struct tm tm;
+	int len;
+
+	gmtime_r(&row->time.tv_sec, &tm);
+	len = strftime(buf, size, "%H:%M:%S", &tm);
+	// with more than one row per second the timestamps need to be told apart
+	if (hz > 1)
+		len += snprintf(buf + len, size - len, ".%03ld", row->time.tv_nsec / 1000000);
+
+	for (size_t i = 0; i < NUM_COLUMNS; i++) {
+		buf[len++] = ',';
+		if (row->valid & (1U << i))
+			len += format_column(buf + len, size - len, i, row->raw[i]);
+	}
+	// a column past the ones of ltcsensors.py, only on the rows it flags
+	if (row->valid & SAMPLE_STRADDLED)
+		len += snprintf(buf + len, size - len, ",straddled");
+	buf[len++] = '\n';
+	return len;
+}
+
+/**
+ * sample_parse_row() - parse a row of a csv file written by ltcsensors.py
+ *
+ * The timestamps of these files are the time of the day: row->time is in
+ * seconds since midnight. The values are converted back to register units.
+ * Return: 0 on success, EINVAL if the line is not a row.
+*/
+int sample_parse_row(const char *line, struct sample_row *row)
+{
+	unsigned int h, m, s;
+	const char *p;
+	char *end;
+	long ms = 0;
+	int len;
+
+	if (sscanf(line, "%2u:%2u:%2u%n", &h, &m, &s, &len) != 3)
+		return EINVAL;
+	p = line + len;
+	if (*p == '.') {
+		ms = strtol(p + 1, &end, 10);
+		p = end;
+	}
+	row->time.tv_sec = h * 3600 + m * 60 + s;
+	row->time.tv_nsec = ms * 1000000;
+	row->valid = 0;
+	for (size_t i = 0; i < NUM_COLUMNS; i++) {
+		double value;
+
+		if (*p++ != ',')
+			return EINVAL;
+		value = strtod(p, &end);
+		if (end != p) {
+			row->raw[i] = parse_column(columns[i], value);
+			row->valid |= 1U << i;
+		}
+		// skip the unit
+		p = end + strcspn(end, ",\n");
+	}
+	if (strncmp(p, ",straddled", strlen(",straddled")) == 0)
+		row->valid |= SAMPLE_STRADDLED;
+	return 0;
+}
+
+static void timespec_add_ns(struct timespec *ts, long ns)
+{
+	ts->tv_nsec += ns;
+	while (ts->tv_nsec >= NSEC_PER_SEC) {
+		ts->tv_nsec -= NSEC_PER_SEC;
+		ts->tv_sec++;
+	}
+}
+
+static int queue_init(struct sample_queue *q, long size)
+{
+	uint32_t n = 1;
+
+	while (n < size)
+		n <<= 1;
+	memset(q, 0, sizeof(*q));
+	q->mask = n - 1;
+	if ((q->records = calloc(n, sizeof(*q->records))) == NULL)
+		return throw("sample: cannot allocate the queue", ENOMEM);
+	return 0;
+}
+
+// sampler side: no lock, no system call
+static void queue_push(struct sample_queue *q, int dev, const struct timespec *mono, const struct sample_row *row)
+{
+	uint64_t head = q->head;
+	uint64_t depth = head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+	struct sample_record *rec;
+
+	if (depth > q->mask) {
+		q->dropped++;
+		return;
+	}
+	rec = &q->records[head & q->mask];
+	rec->mono = *mono;
+	rec->row = *row;
+	rec->dev = dev;
+	__atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+	if (depth + 1 > q->high_water)
+		q->high_water = depth + 1;
+}
+
+static void write_record(struct sample_writer *w, struct sample_record *rec)
+{
+	struct sampler *s = &w->samplers[rec->dev];
+	struct sample_row *row = &rec->row;
+	char buf[SAMPLE_ROW_MAX];
+	int64_t wall = rec->mono.tv_sec * NSEC_PER_SEC + rec->mono.tv_nsec + w->wall_offset;
+
+	row->time.tv_sec = wall / NSEC_PER_SEC;
+	row->time.tv_nsec = wall % NSEC_PER_SEC;
+	if (s->has_ring)
+		ring_append(&s->ring, &rec->mono, row);
+	if (s->store != NULL && w->err == 0 && (w->err = store_append(s->store, row)))
+		stop_sampling = 1;
+	if (s->has_rollup)
+		rollup_update(&s->rollup, row);
+	if (w->balance)
+		balance_update(&s->balance, row);
+	if (s->out != NULL) {
+		if (w->prefix)
+			fprintf(s->out, "%s,", s->dev->name);
+		fwrite(buf, 1, sample_format_row(buf, sizeof(buf), row, w->hz), s->out);
+	}
+	w->rows++;
+}
+
+/*
+ * The rows of a batch go out with one flush per file. The store writes
+ * its blocks as they fill up, it is only synced.
+ */
+static void sync_outputs(struct sample_writer *w, int sync)
+{
+	uint64_t start = stats_start(), end;
+
+	for (int d = 0; d < w->ndev; d++) {
+		struct sampler *s = &w->samplers[d];
+
+		if (s->out != NULL)
+			fflush(s->out);
+		if (!sync)
+			continue;
+		// standard output may be a pipe or a terminal: nothing to sync there
+		if (s->out != NULL && s->out != stdout)
+			fsync(fileno(s->out));
+		if (s->has_ring)
+			msync(s->ring.hdr, s->ring.size, MS_SYNC);
+		if (s->store != NULL)
+			fsync(s->store->fd);
+		if (s->has_rollup)
+			rollup_sync(&s->rollup);
+	}
+	if (sync) {
+		end = stats_start();
+		w->fsyncs++;
+		if (end - start > w->max_fsync_ns)
+			w->max_fsync_ns = end - start;
+	}
+}
+
+/**
+ * sample_writer() - format and write what the sampler queued
+ *
+ * Every --flush milliseconds the records queued are written as a batch,
+ * then the files are flushed, and synced as --fsync says. Whatever the
+ * writes cost, the sampler keeps its ticks: once the queue is full it
+ * drops samples and counts them. After the sampler is done the queue is
+ * drained.
+*/
+static void *sample_writer(void *arg)
+{
+	struct sample_writer *w = arg;
+	struct sample_queue *q = &w->queue;
+	struct timespec next;
+	uint64_t last_sync = stats_start();
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (;;) {
+		int done = __atomic_load_n(&q->done, __ATOMIC_ACQUIRE);
+		uint64_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+		uint64_t tail = q->tail, start = stats_start(), end;
+		int sync;
+
+		for (; tail != head; tail++)
+			write_record(w, &q->records[tail & q->mask]);
+		__atomic_store_n(&q->tail, tail, __ATOMIC_RELEASE);
+		sync = w->fsync >= 0 && (done || start - last_sync >= w->fsync * 1000000ULL);
+		sync_outputs(w, sync);
+		if (sync)
+			last_sync = start;
+		end = stats_start();
+		w->batches++;
+		if (end - start > w->max_batch_ns)
+			w->max_batch_ns = end - start;
+		if (done)
+			return NULL;
+
+		timespec_add_ns(&next, w->flush * 1000000);
+		// after a batch longer than the interval the next one starts at once, the cadence restarts from it
+		if ((uint64_t) next.tv_sec * NSEC_PER_SEC + next.tv_nsec < end)
+			clock_gettime(CLOCK_MONOTONIC, &next);
+		else
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+}
+
+static int64_t monotonic_ns(struct timespec *ts)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	return ts->tv_sec * NSEC_PER_SEC + ts->tv_nsec;
+}
+
+/*
+ * The row is read as soon as the sentinel changed, and the sentinel again
+ * after it: if it changed, the row straddles an update and is read again
+ * at once, just after it.
+ */
+static void read_locked_row(struct sample_writer *w, int d, int64_t start)
+{
+	struct sampler *s = &w->samplers[d];
+	struct cycle *c = s->cycle;
+	struct sample_row row;
+	struct timespec mono;
+	long before = c->last, after = c->last;
+	int64_t end;
+
+	sample_read_columns(s->fds, &row);
+	sample_read_column(s->fds, c->sentinel, &after);
+	end = monotonic_ns(&mono);
+	c->reads += 1 + __builtin_popcount(row.valid);
+	if (cycle_check(c, before, after, start, end)) {
+		before = after;
+		sample_read_columns(s->fds, &row);
+		sample_read_column(s->fds, c->sentinel, &after);
+		end = monotonic_ns(&mono);
+		c->reads += 1 + __builtin_popcount(row.valid);
+		if (after != before) {
+			c->incoherent++;
+			row.valid |= SAMPLE_STRADDLED;
+		}
+		c->last = after;
+	}
+	queue_push(&w->queue, d, &mono, &row);
+	cycle_advance(c, end);
+}
+
+/*
+ * Locked to the measurement cycles: while a device's cycle is learned
+ * its rows are read every CYCLE_LEARN_STEP ms, and queued at the sampling
+ * rate; then the sentinel is polled around each update expected and the
+ * row read as soon as it changed (see cycle_poll()). A device without a
+ * cycle is read at the sampling rate. Each device has its own cycle and
+ * state, the sampler sleeps until the earliest read due of any of them,
+ * so a device learning its cycle again does not hold up the others.
+ */
+static void sample_locked(struct sample_writer *w, long hz, long duration)
+{
+	struct timespec mono, due_ts;
+	struct sample_row row;
+	int64_t tick[MAX_DEVICES], now = monotonic_ns(&mono);
+	int64_t end = now + duration * NSEC_PER_SEC;
+
+	for (int d = 0; d < w->ndev; d++)
+		tick[d] = now;
+	while (!stop_sampling && (duration == 0 || now < end)) {
+		int64_t due = INT64_MAX, start;
+		struct sampler *s;
+		struct cycle *c;
+		int next = 0;
+
+		for (int d = 0; d < w->ndev; d++) {
+			c = w->samplers[d].cycle;
+			start = c->state == CYCLE_FREE ? tick[d] : c->poll;
+			if (start < due) {
+				due = start;
+				next = d;
+			}
+		}
+		due_ts.tv_sec = due / NSEC_PER_SEC;
+		due_ts.tv_nsec = due % NSEC_PER_SEC;
+		if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due_ts, NULL) == EINTR) {
+			now = monotonic_ns(&mono);
+			continue;
+		}
+
+		s = &w->samplers[next];
+		c = s->cycle;
+		if (c->state == CYCLE_LEARNING) {
+			start = monotonic_ns(&mono);
+			sample_read_columns(s->fds, &row);
+			now = monotonic_ns(&mono);
+			if (now >= tick[next]) {
+				queue_push(&w->queue, next, &mono, &row);
+				while (tick[next] <= now)
+					tick[next] += NSEC_PER_SEC / hz;
+			}
+			cycle_learn(c, &row, start, now, hz);
+		} else if (c->state == CYCLE_FREE) {
+			sample_read_columns(s->fds, &row);
+			monotonic_ns(&mono);
+			queue_push(&w->queue, next, &mono, &row);
+			tick[next] += NSEC_PER_SEC / hz;
+		} else {
+			long value = c->last;
+
+			sample_read_column(s->fds, c->sentinel, &value);
+			c->reads++;
+			now = monotonic_ns(&mono);
+			if (cycle_poll(c, value, now))
+				read_locked_row(w, next, now);
+		}
+		now = monotonic_ns(&mono);
+	}
+}
+
+static int parse_fsync(const char *arg, long *fsync)
+{
+	char *end;
+
+	if (strcmp(arg, "never") == 0)
+		*fsync = -1;
+	else if (strcmp(arg, "batch") == 0)
+		*fsync = 0;
+	else if ((*fsync = strtol(arg, &end, 10)) <= 0 || *end != '\0') {
+		fprintf(stderr, "sample: --fsync is never, batch or a number of milliseconds\n");
+		return EINVAL;
+	}
+	return 0;
+}
+
+static int open_sampler(struct sampler *s, const char *filename, const char *ringname,
+		const char *storename, const char *rollupname, long capacity, long hz, int ndev)
+{
+	char path[PATH_MAX];
+	int err;
+
+	if (sample_open_columns(s->dev, s->fds) == 0)
+		return ENOENT;
+	if (ringname != NULL) {
+		device_filename(path, sizeof(path), ringname, s->dev, ndev);
+		if ((err = ring_open(&s->ring, path, capacity, hz)) != 0)
+			return err;
+		s->has_ring = 1;
+	}
+	if (storename != NULL) {
+		if ((s->store = malloc(sizeof(*s->store))) == NULL)
+			return throw("sample: cannot allocate the store", ENOMEM);
+		device_filename(path, sizeof(path), storename, s->dev, ndev);
+		if ((err = store_open(s->store, path, hz)) != 0) {
+			free(s->store);
+			s->store = NULL;
+			return err;
+		}
+	}
+	if (rollupname != NULL) {
+		device_filename(path, sizeof(path), rollupname, s->dev, ndev);
+		if ((err = rollup_open(&s->rollup, path, 1)) != 0)
+			return err;
+		s->has_rollup = 1;
+	}
+	// with a ring file, a store or rollups the csv is only written if asked for
+	if (filename != NULL) {
+		device_filename(path, sizeof(path), filename, s->dev, ndev);
+		if ((s->out = fopen(path, "w")) == NULL)
+			return throw("sample: cannot open output file", errno);
+	} else if (ringname == NULL && storename == NULL && rollupname == NULL) {
+		s->out = stdout;
+	}
+	return 0;
+}
+
+/**
+ * sample() - sample the meas_* attributes at a fixed rate
+ *
+ * ltc-monitor sample [--hz N] [--duration S] [--file F] [--ring R [--ring-size N]] [--store S]
+ *	[--rollup R] [--balance [--spread-limit MV] [--drift-limit MV] [--balance-tau S]]
+ *	[--queue N] [--flush MS] [--fsync never|batch|MS] [--lock [--learn MS]]
+ * Attributes are opened once and re-read with pread(), rows are written in the
+ * same csv format as ltcsensors.py, and/or appended to a binary ring file
+ * and/or a compressed store, and/or rolled up by the minute and the hour
+ * (see rollup_update()). With --balance the cell voltages are
+ * analyzed on every sample (see balance_update()), the warnings go to
+ * standard error.
+ * The sampling loop only reads the attributes and timestamps them, the
+ * rows go through a queue of --queue samples to a writer thread (see
+ * sample_writer()), which writes them in batches every --flush
+ * milliseconds (every sample by default) and syncs the files never (the
+ * default), after every batch, or every MS milliseconds.
+ * All the devices are sampled at the same ticks; each one has its own files,
+ * on standard output their rows start with the device name.
+ * Sampling runs until the duration elapses (forever if it is 0)
+ * or until SIGINT/SIGTERM.
+ * Return: 0 on success, otherwise error code
+*/
+int sample(int argc, char *argv[], struct ltc_device **devs, int ndev)
+{
+	static const struct option options[] = {
+		{ "hz", required_argument, NULL, 'r' },
+		{ "duration", required_argument, NULL, 'd' },
+		{ "file", required_argument, NULL, 'f' },
+		{ "ring", required_argument, NULL, 'R' },
+		{ "ring-size", required_argument, NULL, 'S' },
+		{ "store", required_argument, NULL, 's' },
+		{ "rollup", required_argument, NULL, 'U' },
+		{ "balance", no_argument, NULL, 'b' },
+		{ "spread-limit", required_argument, NULL, 'L' },
+		{ "drift-limit", required_argument, NULL, 'D' },
+		{ "balance-tau", required_argument, NULL, 'T' },
+		{ "queue", required_argument, NULL, 'q' },
+		{ "flush", required_argument, NULL, 'F' },
+		{ "fsync", required_argument, NULL, 'y' },
+		{ "lock", no_argument, NULL, 'l' },
+		{ "learn", required_argument, NULL, 'n' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct sigaction sa = { .sa_handler = sample_stop };
+	struct sampler samplers[MAX_DEVICES];
+	struct sample_writer writer = { .samplers = samplers, .ndev = ndev, .fsync = -1 };
+	struct timespec next, mono, wall;
+	struct sample_row row;
+	char buf[SAMPLE_ROW_MAX];
+	sigset_t mask, oldmask;
+	pthread_t thread;
+	long hz = 1, duration = 0, samples, period, queue = SAMPLE_QUEUE, learn = CYCLE_LEARN;
+	long capacity = RING_DEFAULT_CAPACITY;
+	char *filename = NULL, *ringname = NULL, *storename = NULL, *rollupname = NULL;
+	struct balance_config balance_cfg = { .spread_mv = 50, .drift_mv_min = 2, .tau = 60 };
+	int opt, err = 0, lock = 0;
+
+	optind = 1;
+	while ((opt = getopt_long(argc, argv, "r:d:f:R:S:s:U:bL:D:T:q:F:y:ln:", options, NULL)) != -1) {
+		switch (opt) {
+		case 'r':
+			hz = strtol(optarg, NULL, 10);
+			break;
+		case 'd':
+			duration = strtol(optarg, NULL, 10);
+			break;
+		case 'f':
+			filename = optarg;
+			break;
+		case 'R':
+			ringname = optarg;
+			break;
+		case 'S':
+			capacity = strtol(optarg, NULL, 10);
+			break;
+		case 's':
+			storename = optarg;
+			break;
+		case 'U':
+			rollupname = optarg;
+			break;
+		case 'b':
+			writer.balance = 1;
+			break;
+		case 'L':
+			balance_cfg.spread_mv = strtof(optarg, NULL);
+			break;
+		case 'D':
+			balance_cfg.drift_mv_min = strtof(optarg, NULL);
+			break;
+		case 'T':
+			balance_cfg.tau = strtof(optarg, NULL);
+			break;
+		case 'q':
+			queue = strtol(optarg, NULL, 10);
+			break;
+		case 'F':
+			writer.flush = strtol(optarg, NULL, 10);
+			break;
+		case 'y':
+			if (parse_fsync(optarg, &writer.fsync))
+				return EINVAL;
+			break;
+		case 'l':
+			lock = 1;
+			break;
+		case 'n':
+			learn = strtol(optarg, NULL, 10);
+			break;
+		default:
+			return EINVAL;
+		}
+	}
+	if (hz <= 0 || hz > MAX_HZ || duration < 0 || capacity <= 0) {
+		fprintf(stderr, "sample: rate must be between 1 and %d Hz, duration and ring size must be positive\n", MAX_HZ);
+		return EINVAL;
+	}
+	if (balance_cfg.tau <= 0) {
+		fprintf(stderr, "sample: the balance time constant must be positive\n");
+		return EINVAL;
+	}
+	if (learn <= 0) {
+		fprintf(stderr, "sample: the learning time must be positive\n");
+		return EINVAL;
+	}
+	if (queue <= 0 || queue > SAMPLE_MAX_QUEUE || writer.flush < 0) {
+		fprintf(stderr, "sample: the queue holds 1 to %d samples, the flush interval must be positive\n",
+				SAMPLE_MAX_QUEUE);
+		return EINVAL;
+	}
+	// by default every sample is written as it comes, as a batch of one
+	if (writer.flush == 0)
+		writer.flush = 1000 / hz;
+
+	memset(samplers, 0, sizeof(samplers));
+	for (int d = 0; d < ndev; d++) {
+		samplers[d].dev = devs[d];
+		balance_init(&samplers[d].balance, devs[d], &balance_cfg);
+		for (int i = 0; i < NUM_COLUMNS; i++)
+			samplers[d].fds[i] = -1;
+	}
+	for (int d = 0; d < ndev && err == 0; d++)
+		err = open_sampler(&samplers[d], filename, ringname, storename, rollupname, capacity, hz, ndev);
+	if (err)
+		goto out;
+
+	if ((err = queue_init(&writer.queue, queue)))
+		goto out;
+	for (int d = 0; d < ndev && lock; d++) {
+		if ((samplers[d].cycle = malloc(sizeof(*samplers[d].cycle))) == NULL) {
+			err = throw("sample: cannot allocate the cycle", ENOMEM);
+			goto out;
+		}
+		cycle_init(samplers[d].cycle, monotonic_ns(&mono), learn * 1000000);
+	}
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	writer.hz = hz;
+	writer.prefix = ndev > 1 && filename == NULL;
+	if (writer.prefix && ringname == NULL && storename == NULL && rollupname == NULL)
+		fputs("device,", stdout);
+	for (int d = 0; d < ndev; d++) {
+		if (samplers[d].out != NULL && (samplers[d].out != stdout || d == 0))
+			fwrite(buf, 1, sample_format_header(buf, sizeof(buf)), samplers[d].out);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	clock_gettime(CLOCK_REALTIME, &wall);
+	writer.wall_offset = (wall.tv_sec - mono.tv_sec) * NSEC_PER_SEC + wall.tv_nsec - mono.tv_nsec;
+
+	// the signals stop the sampler, the writer does not see them
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &mask, &oldmask);
+	err = pthread_create(&thread, NULL, sample_writer, &writer);
+	pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+	if (err) {
+		fprintf(stderr, "sample: cannot start the writer: %s\n", strerror(err));
+		goto out;
+	}
+
+	/*
+	 * The sampler only reads and timestamps: formatting, files and syncs
+	 * are the writer's, so storage latency never shifts a tick.
+	 */
+	period = NSEC_PER_SEC / hz;
+	samples = hz * duration;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	if (lock)
+		sample_locked(&writer, hz, duration);
+	for (long n = 0; !lock && !stop_sampling && (duration == 0 || n < samples); n++) {
+		for (int d = 0; d < ndev; d++) {
+			sample_read_columns(samplers[d].fds, &row);
+			clock_gettime(CLOCK_MONOTONIC, &mono);
+			queue_push(&writer.queue, d, &mono, &row);
+		}
+
+		// absolute deadlines, so that the time spent reading does not add up
+		timespec_add_ns(&next, period);
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR && !stop_sampling)
+			;
+	}
+	__atomic_store_n(&writer.queue.done, 1, __ATOMIC_RELEASE);
+	pthread_join(thread, NULL);
+	err = writer.err;
+
+	for (int d = 0; d < ndev && writer.balance; d++)
+		balance_summary(stderr, &samplers[d].balance);
+	for (int d = 0; d < ndev && lock; d++)
+		cycle_summary(stderr, samplers[d].dev, samplers[d].cycle);
+	fprintf(stderr, "sample: %llu rows written, %llu dropped, queue high-water %llu of %u, %llu batches"
+			" (longest %.3f ms), %llu syncs (longest %.3f ms)\n", (unsigned long long) writer.rows,
+			(unsigned long long) writer.queue.dropped, (unsigned long long) writer.queue.high_water,
+			writer.queue.mask + 1, (unsigned long long) writer.batches, writer.max_batch_ns / 1e6,
+			(unsigned long long) writer.fsyncs, writer.max_fsync_ns / 1e6);
+	stats_print(stderr);
+out:
+	for (int d = 0; d < ndev; d++)
+		close_sampler(&samplers[d]);
+	free(writer.queue.records);
+	return err;
+}
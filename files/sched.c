@@ -0,0 +1,260 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "ltc-monitor.h"
+
+/*
+ * Slopes above which a measurement is read at the fastest rate, per
+ * second in the SI unit of the measurement. iin and ichg have no unit,
+ * their slope is in register units.
+ */
+const double sched_default_slope[NUM_UNITS] = {
+	[UNIT_NONE] = 20,
+	[UNIT_MV] = 0.010,
+	[UNIT_F] = 0,
+	[UNIT_C] = 0.05,
+	[UNIT_MR] = 0,
+};
+
+static int before(const struct scheduler *s, int a, int b)
+{
+	return s->heap[a].deadline < s->heap[b].deadline;
+}
+
+static void swap(struct scheduler *s, int a, int b)
+{
+	struct sched_entry tmp = s->heap[a];
+
+	s->heap[a] = s->heap[b];
+	s->heap[b] = tmp;
+	s->attrs[s->heap[a].dev][s->heap[a].id].pos = a;
+	s->attrs[s->heap[b].dev][s->heap[b].id].pos = b;
+}
+
+static void sift_up(struct scheduler *s, int i)
+{
+	while (i > 0 && before(s, i, (i - 1) / 2)) {
+		swap(s, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void sift_down(struct scheduler *s, int i)
+{
+	for (;;) {
+		int first = i, left = 2 * i + 1, right = 2 * i + 2;
+
+		if (left < s->size && before(s, left, first))
+			first = left;
+		if (right < s->size && before(s, right, first))
+			first = right;
+		if (first == i)
+			return;
+		swap(s, i, first);
+		i = first;
+	}
+}
+
+// add the attribute to the heap, or move it if it is there already
+static void schedule(struct scheduler *s, int dev, enum attr_id id, long long deadline)
+{
+	struct sched_attr *a = &s->attrs[dev][id];
+	int i = a->pos;
+
+	if (i < 0) {
+		i = a->pos = s->size++;
+		s->heap[i].dev = dev;
+		s->heap[i].id = id;
+	}
+	s->heap[i].deadline = deadline;
+	sift_up(s, i);
+	sift_down(s, a->pos);
+}
+
+static void pop(struct scheduler *s)
+{
+	s->attrs[s->heap[0].dev][s->heap[0].id].pos = -1;
+	if (--s->size > 0) {
+		s->heap[0] = s->heap[s->size];
+		s->attrs[s->heap[0].dev][s->heap[0].id].pos = 0;
+		sift_down(s, 0);
+	}
+}
+
+/*
+ * The measurements an active status bit asks to follow closely: the one
+ * an alarm refers to, and every voltage while the input power is lost.
+ */
+static int watched_closely(struct snapshot *snap, enum attr_id id)
+{
+	int alarms = snap->raw[ATTR_ALARM_REG], monitor = snap->raw[ATTR_MON_STATUS];
+	int chrg = snap->raw[ATTR_CHRG_STATUS];
+
+	if (snapshot_has(snap, ATTR_MON_STATUS) && snapshot_has(snap, ATTR_CHRG_STATUS)
+			&& ((monitor & MON_POWER_FAILED) || (chrg & CHRG_STEPUP))
+			&& attr_table[id].unit == UNIT_MV)
+		return 1;
+	if (!snapshot_has(snap, ATTR_ALARM_REG))
+		return 0;
+	for (int bit = 0; bit < NUM_ALARMS; bit++) {
+		if (!(alarms & BIT(bit)))
+			continue;
+		if (alarm_table[bit].meas == id)
+			return 1;
+		// the cell voltages of the capacitor alarms
+		if ((BIT(bit) & (ALARM_CAP_UV | ALARM_CAP_OV)) && id >= ATTR_MEAS_VCAP1 && id <= ATTR_MEAS_VCAP4)
+			return 1;
+	}
+	return 0;
+}
+
+// tighten the measurements the status registers ask for
+static void follow_status(struct scheduler *s, int dev, long long now)
+{
+	for (int id = ATTR_MEAS_CAP; id < NUM_ATTRS; id++) {
+		struct sched_attr *a = &s->attrs[dev][id];
+
+		if (a->period > s->cfg.min_period && watched_closely(&s->snaps[dev], id)) {
+			a->period = s->cfg.min_period;
+			if (a->pos >= 0 && s->heap[a->pos].deadline > now + a->period)
+				schedule(s, dev, id, now + a->period);
+		}
+	}
+}
+
+/*
+ * Measurements that move faster than their slope, or that a status bit
+ * points at, are read every min_period. The others back off, doubling
+ * their period up to max_period.
+ */
+static long next_period(struct scheduler *s, int dev, enum attr_id id, int previous, long long elapsed)
+{
+	struct snapshot *snap = &s->snaps[dev];
+	long period = s->attrs[dev][id].period;
+	double slope;
+
+	if (attr_table[id].kind == ATTR_STATUS)
+		return period;
+	slope = attr_to_si(id, snap->raw[id]) - attr_to_si(id, previous);
+	if (slope < 0)
+		slope = -slope;
+	if (elapsed > 0 && slope * 1000 / elapsed > s->cfg.slope[attr_table[id].unit])
+		return s->cfg.min_period;
+	if (watched_closely(snap, id))
+		return s->cfg.min_period;
+	return period * 2 < s->cfg.max_period ? period * 2 : s->cfg.max_period;
+}
+
+/**
+ * sched_init() - schedule the attribute reads of the devices
+ * @snaps: snapshots the attributes are read in, read in full first
+ *
+ * The status registers are read every min_period, the measurements start
+ * there and adapt (see next_period()). The levels and control registers
+ * are not scheduled: they only change when they are written, and are read
+ * again then.
+*/
+void sched_init(struct scheduler *s, const struct sched_config *cfg, struct snapshot *snaps, int ndev, long long now)
+{
+	s->cfg = *cfg;
+	s->snaps = snaps;
+	s->ndev = ndev;
+	s->size = 0;
+	s->reads = 0;
+	for (int d = 0; d < ndev; d++) {
+		s->reads += snapshot_read(&snaps[d]);
+		for (int id = 0; id < NUM_ATTRS; id++) {
+			struct sched_attr *a = &s->attrs[d][id];
+
+			a->pos = -1;
+			a->period = 0;
+			a->last_time = now;
+			if (attr_table[id].kind != ATTR_STATUS && attr_table[id].kind != ATTR_MEAS)
+				continue;
+			if (!snapshot_has(&snaps[d], id))
+				continue;
+			a->period = cfg->min_period;
+			schedule(s, d, id, now + a->period);
+		}
+	}
+}
+
+/*
+ * Change the period of an attribute, e.g. a status register that notifies
+ * its changes only needs to be polled once in a while.
+ */
+void sched_set_period(struct scheduler *s, int dev, enum attr_id id, long period)
+{
+	struct sched_attr *a = &s->attrs[dev][id];
+
+	if (a->pos < 0)
+		return;
+	a->period = period;
+	schedule(s, dev, id, a->last_time + period);
+}
+
+// Return: CLOCK_MONOTONIC milliseconds of the next read, -1 if there is none.
+long long sched_next(const struct scheduler *s)
+{
+	return s->size > 0 ? s->heap[0].deadline : -1;
+}
+
+static void read_attr_now(struct scheduler *s, int dev, enum attr_id id, long long now)
+{
+	struct sched_attr *a = &s->attrs[dev][id];
+	int previous = s->snaps[dev].raw[id];
+
+	if (snapshot_update(&s->snaps[dev], id) != 0)
+		return;
+	s->reads++;
+	if (a->period > 0)
+		a->period = next_period(s, dev, id, previous, now - a->last_time);
+	a->last_time = now;
+	if (attr_table[id].kind != ATTR_STATUS || s->snaps[dev].raw[id] == previous)
+		return;
+	follow_status(s, dev, now);
+	// the results of a capacitance or ESR measurement are read as soon as they are out
+	if (id == ATTR_MON_STATUS) {
+		int done = s->snaps[dev].raw[id] & ~previous;
+
+		if ((done & MON_CAP_DONE) && s->attrs[dev][ATTR_MEAS_CAP].pos >= 0)
+			schedule(s, dev, ATTR_MEAS_CAP, now);
+		if ((done & MON_ESR_DONE) && s->attrs[dev][ATTR_MEAS_ESR].pos >= 0)
+			schedule(s, dev, ATTR_MEAS_ESR, now);
+	}
+}
+
+/**
+ * sched_run() - read the attributes that are due
+ * @now: CLOCK_MONOTONIC milliseconds
+ * Return: number of attributes read.
+*/
+int sched_run(struct scheduler *s, long long now)
+{
+	uint64_t reads = s->reads;
+
+	while (s->size > 0 && s->heap[0].deadline <= now) {
+		struct sched_entry e = s->heap[0];
+		long long deadline;
+
+		pop(s);
+		read_attr_now(s, e.dev, e.id, now);
+		// keep the cadence, unless the reads are late by more than a period
+		deadline = e.deadline + s->attrs[e.dev][e.id].period;
+		schedule(s, e.dev, e.id, deadline > now ? deadline : now + s->attrs[e.dev][e.id].period);
+	}
+	return s->reads - reads;
+}
+
+/**
+ * sched_read() - read an attribute out of schedule
+ *
+ * For the status registers that notified, and for what was just written:
+ * the attribute is read at once, the schedule adapts to its new value.
+*/
+void sched_read(struct scheduler *s, int dev, enum attr_id id, long long now)
+{
+	read_attr_now(s, dev, id, now);
+	if (s->attrs[dev][id].pos >= 0)
+		schedule(s, dev, id, now + s->attrs[dev][id].period);
+}
@@ -0,0 +1,329 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shm.h"
+
+static void segment_name(struct shm *shm)
+{
+	const char *name = getenv("LTC_MONITOR_SHM");
+
+	if (name == NULL || *name == '\0')
+		name = SHM_NAME;
+	snprintf(shm->name, sizeof(shm->name), "%s", name);
+}
+
+/**
+ * shm_publish_open() - create the segment the snapshots are published in
+ *
+ * The segment is LTC_MONITOR_SHM, or /ltc-monitor. One left over from a
+ * previous run is reused; the devices are published at once.
+ * Return: 0 on success, otherwise error code
+*/
+int shm_publish_open(struct shm *shm, struct snapshot *snaps, int ndev)
+{
+	struct shm_segment *seg;
+	int fd;
+
+	segment_name(shm);
+	shm->writer = 1;
+	if ((fd = shm_open(shm->name, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0)
+		return throw("shm: cannot create the segment", errno);
+	if (ftruncate(fd, sizeof(*seg)) < 0) {
+		int err = throw("shm: cannot size the segment", errno);
+		close(fd);
+		return err;
+	}
+	seg = mmap(NULL, sizeof(*seg), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (seg == MAP_FAILED)
+		return throw("shm: cannot map the segment", errno);
+
+	/*
+	 * Readers of a segment left over may be in the middle of a copy: the
+	 * header is written under the lock too, and seq carries on from where
+	 * it was, made even if the previous writer died while publishing.
+	 */
+	__atomic_store_n(&seg->seq, (__atomic_load_n(&seg->seq, __ATOMIC_RELAXED) | 1), __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memset(seg->devices, 0, sizeof(seg->devices));
+	memcpy(seg->magic, SHM_MAGIC, sizeof(seg->magic));
+	seg->version = SHM_VERSION;
+	seg->size = sizeof(*seg);
+	seg->pid = getpid();
+	seg->updates = 0;
+	for (int d = 0; d < ndev; d++) {
+		snprintf(seg->devices[d].name, sizeof(seg->devices[d].name), "%s", snaps[d].dev->name);
+		snprintf(seg->devices[d].bus, sizeof(seg->devices[d].bus), "%s", snaps[d].dev->bus);
+		snprintf(seg->devices[d].path, sizeof(seg->devices[d].path), "%s", snaps[d].dev->path);
+	}
+	__atomic_store_n(&seg->seq, seg->seq + 1, __ATOMIC_RELEASE);
+	shm->seg = seg;
+	shm_publish(shm, snaps, ndev);
+	return 0;
+}
+
+/**
+ * shm_publish() - copy the snapshots into the segment
+ *
+ * The copy is a few kilobytes of plain stores between the two increments
+ * of seq: readers are never waited for. The time published is the one of
+ * the newest read of each snapshot, republishing does not make it newer.
+*/
+void shm_publish(struct shm *shm, const struct snapshot *snaps, int ndev)
+{
+	struct shm_segment *seg = shm->seg;
+	uint32_t seq;
+
+	if (seg == NULL)
+		return;
+	seq = __atomic_load_n(&seg->seq, __ATOMIC_RELAXED);
+	__atomic_store_n(&seg->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	for (int d = 0; d < ndev; d++) {
+		struct shm_device *sd = &seg->devices[d];
+		const struct snapshot *snap = &snaps[d];
+
+		sd->valid = snap->valid;
+		sd->time = snap->time.tv_sec * 1000000000LL + snap->time.tv_nsec;
+		for (int id = 0; id < NUM_ATTRS; id++) {
+			sd->raw[id] = snap->raw[id];
+			sd->conv[id] = snap->conv[id];
+		}
+		sd->alarms = snap->raw[ATTR_ALARM_REG];
+		sd->monitor = snap->raw[ATTR_MON_STATUS];
+		sd->charger = snap->raw[ATTR_CHRG_STATUS];
+	}
+	seg->ndev = ndev;
+	seg->updates++;
+	__atomic_store_n(&seg->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/*
+ * The segment is removed: readers that still map it keep the last values,
+ * new ones find that the daemon is not running.
+ */
+void shm_publish_close(struct shm *shm)
+{
+	if (shm->seg == NULL)
+		return;
+	munmap(shm->seg, sizeof(*shm->seg));
+	shm->seg = NULL;
+	if (shm->writer)
+		shm_unlink(shm->name);
+}
+
+/**
+ * shm_reader_open() - map the segment the daemon publishes in, read-only
+ * Return: 0 on success, ENOENT if the daemon is not running, EPROTO if the
+ * segment has another format, otherwise error code
+*/
+int shm_reader_open(struct shm *shm)
+{
+	struct shm_segment *seg;
+	struct stat st;
+	int fd;
+
+	segment_name(shm);
+	shm->writer = 0;
+	shm->seg = NULL;
+	if ((fd = shm_open(shm->name, O_RDONLY | O_CLOEXEC, 0)) < 0)
+		return errno;
+	if (fstat(fd, &st) < 0 || st.st_size != sizeof(*seg)) {
+		close(fd);
+		return EPROTO;
+	}
+	seg = mmap(NULL, sizeof(*seg), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (seg == MAP_FAILED)
+		return errno;
+	shm->seg = seg;
+	return 0;
+}
+
+/**
+ * shm_read() - copy a consistent view of the segment
+ * @copy: filled in with the header and the devices published
+ *
+ * Copies until seq is the same even value before and after the copy.
+ * The segment outlives a daemon that crashed: its values are then stale.
+ * Return: 0 on success, EPROTO if the segment has another format, EAGAIN
+ * if the writer never let a copy through, ESRCH if the daemon that
+ * published it is gone
+*/
+int shm_read(const struct shm *shm, struct shm_segment *copy)
+{
+	const struct shm_segment *seg = shm->seg;
+
+	for (int tries = 0; tries < SHM_RETRIES; tries++) {
+		uint32_t seq = __atomic_load_n(&seg->seq, __ATOMIC_ACQUIRE);
+		int ndev;
+
+		if (seq & 1)
+			continue;
+		memcpy(copy, seg, offsetof(struct shm_segment, devices));
+		ndev = copy->ndev <= MAX_DEVICES ? copy->ndev : 0;
+		memcpy(copy->devices, seg->devices, ndev * sizeof(copy->devices[0]));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&seg->seq, __ATOMIC_RELAXED) != seq)
+			continue;
+		if (memcmp(copy->magic, SHM_MAGIC, sizeof(copy->magic)) != 0 || copy->version != SHM_VERSION
+				|| copy->size != sizeof(*copy) || copy->ndev > MAX_DEVICES)
+			return EPROTO;
+		// EPERM: it runs, as another user
+		if (kill(copy->pid, 0) < 0 && errno == ESRCH)
+			return ESRCH;
+		return 0;
+	}
+	return EAGAIN;
+}
+
+static void describe_device(const struct shm_device *sd, struct ltc_device *dev)
+{
+	memset(dev, 0, sizeof(*dev));
+	snprintf(dev->name, sizeof(dev->name), "%s", sd->name);
+	snprintf(dev->bus, sizeof(dev->bus), "%s", sd->bus);
+	snprintf(dev->path, sizeof(dev->path), "%s", sd->path);
+}
+
+/**
+ * shm_snapshot() - turn a device of a copy into a snapshot
+ * @dev: filled in with the name, bus and path of the device, the snapshot points to it
+ *
+ * The snapshot is not live: show(), status() and read_attr() print it as
+ * they print the daemon's.
+*/
+void shm_snapshot(const struct shm_device *sd, struct ltc_device *dev, struct snapshot *snap)
+{
+	describe_device(sd, dev);
+	snapshot_init(snap, dev, 0);
+	snap->valid = sd->valid;
+	snap->time.tv_sec = sd->time / 1000000000;
+	snap->time.tv_nsec = sd->time % 1000000000;
+	for (int id = 0; id < NUM_ATTRS; id++) {
+		snap->raw[id] = sd->raw[id];
+		snap->conv[id] = sd->conv[id];
+	}
+}
+
+void shm_reader_close(struct shm *shm)
+{
+	shm_publish_close(shm);
+}
+
+static int selected(const struct shm_device *sd, int index, const char **selectors, int nsel)
+{
+	struct ltc_device dev;
+
+	describe_device(sd, &dev);
+	return nsel == 0 || device_selected(&dev, index, selectors, nsel);
+}
+
+static int print_device(FILE *out, struct snapshot *snap, int argc, char *argv[])
+{
+	if (argc == 0 || strcmp(argv[0], "show") == 0)
+		return show(out, snap);
+	if (strcmp(argv[0], "status") == 0)
+		return status(out, snap);
+	if (strcmp(argv[0], "read") == 0 && argc == 2)
+		return read_attr(out, snap, argv[1], 0);
+	if (strcmp(argv[0], "read") == 0 && argc == 3 && strcmp(argv[1], "-c") == 0)
+		return read_attr(out, snap, argv[2], 1);
+	fprintf(stderr, "peek: unknown request %s\n", argv[0]);
+	return EINVAL;
+}
+
+/**
+ * peek() - print the values the daemon published, without going through it
+ *
+ * ltc-monitor peek [--watch MS] [show | status | read [-c] file]
+ * The values come from the daemon's shared memory segment (see
+ * shm_read()), as they were when it last read them: nothing is read from
+ * the devices and the daemon is not asked. show is the default. With
+ * --watch they are printed again every MS milliseconds, each time after
+ * the age of the values.
+ * Return: 0 on success, ENOENT or ESRCH if the daemon is not running,
+ * otherwise error code
+*/
+int peek(int argc, char *argv[], const char **selectors, int nsel)
+{
+	static const struct option options[] = {
+		{ "watch", required_argument, NULL, 'w' },
+		{ NULL, 0, NULL, 0 }
+	};
+	static struct shm_segment copy;
+	struct ltc_device dev;
+	struct snapshot snap;
+	struct timespec next, now;
+	struct shm shm;
+	long watch = 0;
+	int opt, res = 0;
+
+	optind = 1;
+	while ((opt = getopt_long(argc, argv, "+w:", options, NULL)) != -1) {
+		if (opt != 'w')
+			return EINVAL;
+		watch = strtol(optarg, NULL, 10);
+		if (watch <= 0) {
+			fprintf(stderr, "peek: the watch interval must be positive\n");
+			return EINVAL;
+		}
+	}
+	if ((res = shm_reader_open(&shm)) != 0) {
+		if (res == ENOENT)
+			fprintf(stderr, "peek: the daemon is not running\n");
+		else
+			fprintf(stderr, "peek: cannot open %s: %s\n", shm.name, strerror(res));
+		return res;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	do {
+		int ndev = 0;
+
+		if ((res = shm_read(&shm, &copy)) == ESRCH) {
+			fprintf(stderr, "peek: the daemon that published %s (pid %d) is gone, its values are stale\n",
+					shm.name, copy.pid);
+			break;
+		}
+		if (res != 0) {
+			fprintf(stderr, "peek: cannot read %s: %s\n", shm.name, strerror(res));
+			break;
+		}
+		for (int d = 0; d < copy.ndev; d++)
+			ndev += selected(&copy.devices[d], d, selectors, nsel);
+		if (ndev == 0) {
+			fprintf(stderr, "No ltc3350 device matches the selection\n");
+			res = ENODEV;
+			break;
+		}
+		for (int d = 0; d < copy.ndev; d++) {
+			if (!selected(&copy.devices[d], d, selectors, nsel))
+				continue;
+			shm_snapshot(&copy.devices[d], &dev, &snap);
+			device_header(stdout, &dev, ndev);
+			if (watch) {
+				clock_gettime(CLOCK_REALTIME, &now);
+				printf("%lld ms old\n", (now.tv_sec * 1000000000LL + now.tv_nsec - copy.devices[d].time)
+						/ 1000000);
+			}
+			if ((res = print_device(stdout, &snap, argc - optind, argv + optind)) == EINVAL)
+				break;
+		}
+		fflush(stdout);
+		next.tv_sec += (next.tv_nsec + watch * 1000000) / 1000000000;
+		next.tv_nsec = (next.tv_nsec + watch * 1000000) % 1000000000;
+	} while (watch && res != EINVAL && clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == 0);
+
+	shm_reader_close(&shm);
+	return res;
+}
@@ -0,0 +1,70 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdint.h>
+
+#include "ltc-monitor.h"
+
+#define SHM_MAGIC "LTCS"
+#define SHM_VERSION 1
+#define SHM_NAME "/ltc-monitor"
+// a reader gives up after this many torn reads in a row: the writer died while publishing
+#define SHM_RETRIES 100000
+
+/*
+ * The latest values of a device, as the daemon's snapshot holds them.
+ * alarms, monitor and charger are alarm_reg, mon_status and chrg_status,
+ * the ALARM_*, MON_* and CHRG_* bits.
+ */
+struct shm_device {
+	char name[32];
+	char bus[32];
+	char path[256]; // hwmon directory
+	uint64_t valid; // bitmask of the attributes in raw and conv
+	int64_t time; // CLOCK_REALTIME of the newest read of the values, in ns
+	uint32_t alarms;
+	uint32_t monitor;
+	uint32_t charger;
+	uint32_t reserved;
+	int32_t raw[NUM_ATTRS];
+	int32_t conv[NUM_ATTRS]; // in the attribute's unit
+};
+
+/*
+ * POSIX shared memory segment the daemon publishes its snapshots in.
+ * It is guarded by a sequence lock: seq is odd while the daemon writes,
+ * and a reader that saw seq change while copying copies again. Readers
+ * only read the segment: they take no lock and make no system call.
+ * size is the size of the whole segment, a reader built with another
+ * attribute table sees it differ. All fields are in host byte order.
+ */
+struct shm_segment {
+	char magic[4];
+	uint16_t version;
+	uint16_t ndev;
+	uint32_t size;
+	uint32_t seq;
+	uint64_t updates; // publications since the daemon started
+	int32_t pid; // of the daemon
+	uint32_t reserved;
+	struct shm_device devices[MAX_DEVICES];
+};
+
+struct shm {
+	int writer;
+	char name[64];
+	struct shm_segment *seg;
+};
+
+int shm_publish_open(struct shm *shm, struct snapshot *snaps, int ndev);
+void shm_publish(struct shm *shm, const struct snapshot *snaps, int ndev);
+void shm_publish_close(struct shm *shm);
+
+int shm_reader_open(struct shm *shm);
+int shm_read(const struct shm *shm, struct shm_segment *copy);
+void shm_snapshot(const struct shm_device *sd, struct ltc_device *dev, struct snapshot *snap);
+void shm_reader_close(struct shm *shm);
+
+int peek(int argc, char *argv[], const char **selectors, int nsel);
+
+#endif
@@ -0,0 +1,342 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ltc-monitor.h"
+
+#define NSEC_PER_SEC 1000000000L
+#define SECONDS_PER_DAY 86400
+
+static volatile sig_atomic_t stop_simulation;
+
+static void simulate_stop(int sig)
+{
+	(void) sig;
+	stop_simulation = 1;
+}
+
+struct sim_device {
+	struct ltc_device dev;
+	int fds[NUM_ATTRS]; // the attributes replayed or computed, -1 for the others
+	struct status_regs regs;
+};
+
+static int is_status(enum attr_id id)
+{
+	return id == ATTR_ALARM_REG || id == ATTR_MON_STATUS || id == ATTR_CHRG_STATUS;
+}
+
+/*
+ * Values are written in place, padded to a fixed width, in one pwrite():
+ * readers that keep the attribute open, as sample does, never see a
+ * shorter value followed by the end of a longer one.
+ */
+static int put(int fd, long value)
+{
+	char buf[16];
+	int len = snprintf(buf, sizeof(buf), "%6ld\n", value);
+
+	return pwrite(fd, buf, len, 0) == len ? 0 : errno;
+}
+
+static void close_device(struct sim_device *sd)
+{
+	for (int id = 0; id < NUM_ATTRS; id++)
+		if (sd->fds[id] >= 0)
+			close(sd->fds[id]);
+}
+
+/*
+ * The device starts on mains power and charging. The alarms of the
+ * replayed measurements that have a level are enabled.
+ */
+static int open_device(struct sim_device *sd, const char *root, int n)
+{
+	char path[PATH_MAX];
+	struct snapshot snap;
+	int err, mask = 0;
+
+	for (int id = 0; id < NUM_ATTRS; id++)
+		sd->fds[id] = -1;
+	if ((err = fake_device_create(root, n, &sd->dev)))
+		return err;
+	for (int id = 0; id < NUM_ATTRS; id++) {
+		if (sample_column(id) < 0 && !is_status(id) && id != ATTR_MSK_ALARMS)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", sd->dev.path, attr_table[id].name);
+		if ((sd->fds[id] = open(path, O_WRONLY | O_CLOEXEC)) < 0)
+			return throw("simulate: cannot open a fake attribute", errno);
+	}
+
+	snapshot_init(&snap, &sd->dev, 1);
+	for (int bit = 0; bit < NUM_ALARMS; bit++)
+		if (sample_column(alarm_table[bit].meas) >= 0 && snapshot_get(&snap, alarm_table[bit].lvl) > 0)
+			mask |= BIT(bit);
+	sd->regs = (struct status_regs) { 0, MON_POWER_RETURNED, CHRG_STEPDOWN | CHRG_CAPPG };
+	err = put(sd->fds[ATTR_MSK_ALARMS], mask);
+	err = err ? err : put(sd->fds[ATTR_ALARM_REG], sd->regs.alarms);
+	err = err ? err : put(sd->fds[ATTR_MON_STATUS], sd->regs.monitor);
+	err = err ? err : put(sd->fds[ATTR_CHRG_STATUS], sd->regs.chrg);
+	if (err)
+		return throw("simulate: cannot write a fake attribute", err);
+	return 0;
+}
+
+static void log_change(const struct sim_device *sd, enum attr_id id, int from, int to, const struct sample_row *row)
+{
+	struct timespec now;
+	struct tm tm;
+	char wall[16];
+	long t = row->time.tv_sec;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	gmtime_r(&now.tv_sec, &tm);
+	strftime(wall, sizeof(wall), "%H:%M:%S", &tm);
+	printf("%s.%03ld %s %s 0x%04x -> 0x%04x (csv %02ld:%02ld:%02ld)\n", wall, now.tv_nsec / 1000000,
+			sd->dev.name, attr_table[id].name, from, to, t / 3600 % 24, t / 60 % 60, t % 60);
+}
+
+/*
+ * An alarm is active while its measurement is beyond its level: below
+ * the undervoltage, undercurrent and cold levels, above the others. The
+ * levels and the mask are read on every row, so that they can be written
+ * while the simulation runs; the alarms of measurements that are not
+ * replayed keep their state.
+ */
+static int compute_alarms(struct snapshot *snap, const struct sample_row *row, int previous)
+{
+	int alarms = 0, mask = snapshot_get(snap, ATTR_MSK_ALARMS);
+
+	for (int bit = 0; bit < NUM_ALARMS; bit++) {
+		enum attr_id meas = alarm_table[bit].meas, lvl = alarm_table[bit].lvl;
+		int c = sample_column(meas), level;
+
+		if (c < 0 || !(row->valid & (1U << c)) || !snapshot_has(snap, lvl)) {
+			alarms |= previous & BIT(bit);
+			continue;
+		}
+		level = snap->raw[lvl];
+		if (attr_table[meas].min_lvl == lvl ? row->raw[c] < level : row->raw[c] > level)
+			alarms |= BIT(bit);
+	}
+	return alarms & mask;
+}
+
+// the input power fails when vin goes below its undervoltage level
+static void compute_power(struct snapshot *snap, const struct sample_row *row, struct status_regs *regs)
+{
+	int c = sample_column(ATTR_MEAS_VIN);
+
+	if (!(row->valid & (1U << c)) || !snapshot_has(snap, ATTR_VIN_UV_LVL))
+		return;
+	if (row->raw[c] < snap->raw[ATTR_VIN_UV_LVL]) {
+		regs->monitor = (regs->monitor & ~MON_POWER_RETURNED) | MON_POWER_FAILED;
+		regs->chrg = (regs->chrg & ~CHRG_STEPDOWN) | CHRG_STEPUP | CHRG_PFO;
+	} else {
+		regs->monitor = (regs->monitor & ~MON_POWER_FAILED) | MON_POWER_RETURNED;
+		regs->chrg = (regs->chrg & ~(CHRG_STEPUP | CHRG_PFO)) | CHRG_STEPDOWN;
+	}
+}
+
+static int set_status(struct sim_device *sd, enum attr_id id, int *reg, int value, const struct sample_row *row)
+{
+	if (*reg == value)
+		return 0;
+	log_change(sd, id, *reg, value, row);
+	*reg = value;
+	return put(sd->fds[id], value);
+}
+
+// write the measurements of a row, then the status registers they lead to
+static int replay_row(struct sim_device *sd, const struct sample_row *row)
+{
+	struct status_regs regs = sd->regs;
+	struct snapshot snap;
+	int err = 0;
+
+	for (int id = 0; id < NUM_ATTRS && err == 0; id++) {
+		int c = sample_column(id);
+
+		if (c >= 0 && (row->valid & (1U << c)))
+			err = put(sd->fds[id], row->raw[c]);
+	}
+	if (err)
+		return throw("simulate: cannot write a fake attribute", err);
+
+	snapshot_init(&snap, &sd->dev, 1);
+	regs.alarms = compute_alarms(&snap, row, sd->regs.alarms);
+	compute_power(&snap, row, &regs);
+	err = set_status(sd, ATTR_ALARM_REG, &sd->regs.alarms, regs.alarms, row);
+	err = err ? err : set_status(sd, ATTR_MON_STATUS, &sd->regs.monitor, regs.monitor, row);
+	err = err ? err : set_status(sd, ATTR_CHRG_STATUS, &sd->regs.chrg, regs.chrg, row);
+	if (err)
+		return throw("simulate: cannot write a fake attribute", err);
+	fflush(stdout);
+	return 0;
+}
+
+static void timespec_add_ns(struct timespec *ts, long long ns)
+{
+	ts->tv_sec += ns / NSEC_PER_SEC;
+	ts->tv_nsec += ns % NSEC_PER_SEC;
+	if (ts->tv_nsec >= NSEC_PER_SEC) {
+		ts->tv_sec++;
+		ts->tv_nsec -= NSEC_PER_SEC;
+	}
+}
+
+/*
+ * Each row is written at its time in the csv, divided by the speed, from
+ * the start of the file; a file that goes past midnight carries on.
+ * Return: number of rows replayed, otherwise -error code.
+ */
+static long replay_file(const char *path, struct sim_device *sds, int ndev, double speed)
+{
+	struct timespec start, next;
+	struct sample_row row;
+	char line[SAMPLE_ROW_MAX];
+	long long first = -1, previous = 0, days = 0;
+	long rows = 0;
+	FILE *file;
+	int err = 0;
+
+	if ((file = fopen(path, "r")) == NULL)
+		return -throw("simulate: cannot open the csv file", errno);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (!stop_simulation && err == 0 && fgets(line, sizeof(line), file) != NULL) {
+		long long t;
+
+		if (sample_parse_row(line, &row))
+			continue;
+		t = row.time.tv_sec * (long long) NSEC_PER_SEC + row.time.tv_nsec;
+		if (first < 0)
+			first = previous = t;
+		if (t < previous)
+			days++;
+		previous = t;
+		t += days * SECONDS_PER_DAY * (long long) NSEC_PER_SEC;
+
+		next = start;
+		timespec_add_ns(&next, (long long) ((t - first) / speed));
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR && !stop_simulation)
+			;
+		if (stop_simulation)
+			break;
+		for (int d = 0; d < ndev && err == 0; d++)
+			err = replay_row(&sds[d], &row);
+		rows++;
+	}
+	fclose(file);
+	return err ? -err : rows;
+}
+
+/**
+ * simulate() - replay csv files on fake ltc3350 devices
+ *
+ * ltc-monitor simulate [--speed X] [--devices N] [--dir D] [--loop] [--keep] csv...
+ * A fake hwmon tree is written in tmpfs, as for bench, and its path is
+ * printed first, as LTC_MONITOR_HWMON_ROOT=path, for the other commands to
+ * run on it. The rows of the csv files written by sample or ltcsensors.py
+ * are then written to the measurements of every device at their pace,
+ * X times faster with --speed, over and over with --loop. The alarm
+ * register and the power status bits follow the levels of the device
+ * (see compute_alarms()); their changes are printed with the wall clock
+ * time they are written at, to measure how long a command takes to report
+ * them. The tree is removed at the end unless --keep is given.
+ * Return: 0 on success, otherwise error code
+*/
+int simulate(int argc, char *argv[])
+{
+	static const struct option options[] = {
+		{ "speed", required_argument, NULL, 'x' },
+		{ "devices", required_argument, NULL, 'n' },
+		{ "dir", required_argument, NULL, 'D' },
+		{ "loop", no_argument, NULL, 'l' },
+		{ "keep", no_argument, NULL, 'k' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct sigaction sa = { .sa_handler = simulate_stop };
+	struct sim_device sds[MAX_DEVICES];
+	const char *base = access("/dev/shm", W_OK) == 0 ? "/dev/shm" : "/tmp";
+	char root[PATH_MAX];
+	double speed = 1;
+	long rows = 0, res = 0;
+	int opt, ndev = 1, created = 0, loop = 0, keep = 0, err = 0, first;
+
+	optind = 1;
+	while ((opt = getopt_long(argc, argv, "x:n:D:lk", options, NULL)) != -1) {
+		switch (opt) {
+		case 'x':
+			speed = strtod(optarg, NULL);
+			break;
+		case 'n':
+			ndev = strtol(optarg, NULL, 10);
+			break;
+		case 'D':
+			base = optarg;
+			break;
+		case 'l':
+			loop = 1;
+			break;
+		case 'k':
+			keep = 1;
+			break;
+		default:
+			return EINVAL;
+		}
+	}
+	if (speed <= 0 || ndev < 1 || ndev > MAX_DEVICES) {
+		fprintf(stderr, "simulate: the speed must be positive, the devices between 1 and %d\n", MAX_DEVICES);
+		return EINVAL;
+	}
+	if (optind >= argc) {
+		fprintf(stderr, "simulate: missing csv file\n");
+		return EINVAL;
+	}
+	first = optind;
+
+	snprintf(root, sizeof(root), "%s/ltc-sim.XXXXXX", base);
+	if (mkdtemp(root) == NULL)
+		return throw("simulate: cannot create the fake tree", errno);
+	for (; created < ndev && err == 0; created++)
+		err = open_device(&sds[created], root, created);
+	if (err)
+		goto out;
+	printf("LTC_MONITOR_HWMON_ROOT=%s\n", root);
+	fflush(stdout);
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	do {
+		long pass = 0;
+
+		for (int i = first; i < argc && !stop_simulation; i++) {
+			if ((res = replay_file(argv[i], sds, ndev, speed)) < 0) {
+				err = -res;
+				goto out;
+			}
+			pass += res;
+		}
+		rows += pass;
+		// files without rows would loop forever
+		if (pass == 0)
+			break;
+	} while (loop && !stop_simulation);
+	fprintf(stderr, "simulate: %ld rows replayed on %d devices\n", rows, ndev);
+
+out:
+	for (int d = 0; d < created; d++) {
+		close_device(&sds[d]);
+		if (!keep)
+			fake_device_remove(&sds[d].dev);
+	}
+	if (!keep)
+		rmdir(root);
+	return err;
+}
@@ -0,0 +1,132 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ltc-monitor.h"
+
+#define ATTR_BIT(id) ((uint64_t) 1 << (id))
+
+void snapshot_init(struct snapshot *snap, const struct ltc_device *dev, int live)
+{
+	memset(snap, 0, sizeof(*snap));
+	snap->dev = dev;
+	snap->live = live;
+}
+
+/*
+ * Unlike read_integer_value() this does not complain: attributes
+ * the device does not expose are simply left out of the snapshot.
+ * The read, where the bus transfer happens, is timed and retried once
+ * on a transient error.
+ */
+static int read_raw(const struct ltc_device *dev, enum attr_id id, int *value)
+{
+	char path[PATH_MAX];
+	char buf[16];
+	char *endptr;
+	ssize_t len;
+	int fd, err;
+
+	snprintf(path, sizeof(path), "%s/%s", dev->path, attr_table[id].name);
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return errno;
+	for (int attempt = 0; ; attempt++) {
+		uint64_t start = stats_start();
+
+		len = pread(fd, buf, sizeof(buf) - 1, 0);
+		err = len < 0 ? errno : len == 0 ? EIO : 0;
+		stats_record(id, STATS_READ, start, err);
+		if (!stats_transient(err) || attempt == STATS_RETRIES)
+			break;
+		stats_retry(id, STATS_READ);
+	}
+	close(fd);
+	if (err)
+		return err;
+	buf[len] = '\0';
+	*value = strtol(buf, &endptr, 10);
+	return endptr == buf ? EINVAL : 0;
+}
+
+// keep the converted value along with the raw one
+static void store(struct snapshot *snap, enum attr_id id, int value)
+{
+	snap->raw[id] = value;
+	snap->conv[id] = attr_from_LSB(id, value);
+	snap->valid |= ATTR_BIT(id);
+}
+
+/**
+ * snapshot_read() - read every attribute of the device
+ * Return: number of attributes read.
+*/
+int snapshot_read(struct snapshot *snap)
+{
+	int count = 0;
+
+	snap->valid = 0;
+	for (int id = 0; id < NUM_ATTRS; id++) {
+		int value;
+
+		if (read_raw(snap->dev, id, &value) == 0) {
+			store(snap, id, value);
+			count++;
+		}
+	}
+	clock_gettime(CLOCK_REALTIME, &snap->time);
+	return count;
+}
+
+/*
+ * Return: 1 if the attribute value is in the snapshot, reading it first
+ * if the snapshot is live.
+*/
+int snapshot_has(struct snapshot *snap, enum attr_id id)
+{
+	int value;
+
+	if (id == ATTR_NONE)
+		return 0;
+	if (!(snap->valid & ATTR_BIT(id)) && snap->live && read_raw(snap->dev, id, &value) == 0)
+		store(snap, id, value);
+	return (snap->valid & ATTR_BIT(id)) != 0;
+}
+
+/*
+ * Return: value of the attribute, -1 if it is not available.
+ * As for read_integer_value(), -1 can also be a valid value.
+*/
+int snapshot_get(struct snapshot *snap, enum attr_id id)
+{
+	return snapshot_has(snap, id) ? snap->raw[id] : -1;
+}
+
+/*
+ * Store a value read elsewhere, so that the snapshot does not read it again.
+*/
+void snapshot_set(struct snapshot *snap, enum attr_id id, int value)
+{
+	store(snap, id, value);
+}
+
+/*
+ * Read an attribute again, whether the snapshot has it or not.
+ * Return: 0 on success, otherwise error code; the attribute is then left
+ * out of the snapshot.
+*/
+int snapshot_update(struct snapshot *snap, enum attr_id id)
+{
+	int value, err;
+
+	if (id == ATTR_NONE)
+		return EINVAL;
+	if ((err = read_raw(snap->dev, id, &value)) == 0) {
+		store(snap, id, value);
+		clock_gettime(CLOCK_REALTIME, &snap->time);
+	} else {
+		snap->valid &= ~ATTR_BIT(id);
+	}
+	return err;
+}
@@ -0,0 +1,191 @@
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ltc-monitor.h"
+
+/*
+ * Log-linear histogram of the access times: below 1 us everything goes in
+ * bucket 0, above that every power of two is split in STATS_SUB linear
+ * buckets, up to about one second in the last one.
+ */
+#define STATS_MIN_SHIFT 10 // 1024 ns
+#define STATS_SUB_BITS 2
+#define STATS_SUB (1 << STATS_SUB_BITS)
+#define STATS_OCTAVES 20
+#define STATS_BUCKETS (STATS_OCTAVES * STATS_SUB + 1)
+
+struct attr_stats {
+	uint64_t count;
+	uint64_t errors;
+	uint64_t retries;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint32_t buckets[STATS_BUCKETS];
+};
+
+// the last row is for the attributes that are not in the registry
+static struct attr_stats stats_table[NUM_ATTRS + 1][STATS_OPS];
+
+static const char *const op_names[STATS_OPS] = {
+	[STATS_READ] = "read",
+	[STATS_WRITE] = "write",
+};
+
+static struct attr_stats *stats_of(enum attr_id id, enum stats_op op)
+{
+	return &stats_table[id == ATTR_NONE ? NUM_ATTRS : id][op];
+}
+
+static int bucket_of(uint64_t ns)
+{
+	int msb, index;
+
+	if (ns < (1 << STATS_MIN_SHIFT))
+		return 0;
+	msb = 63 - __builtin_clzll(ns);
+	index = (msb - STATS_MIN_SHIFT) * STATS_SUB + ((ns >> (msb - STATS_SUB_BITS)) & (STATS_SUB - 1)) + 1;
+	return index < STATS_BUCKETS ? index : STATS_BUCKETS - 1;
+}
+
+// upper bound of a bucket, in nanoseconds
+static uint64_t bucket_limit(int bucket)
+{
+	int octave, sub;
+
+	if (bucket == 0)
+		return 1 << STATS_MIN_SHIFT;
+	octave = (bucket - 1) / STATS_SUB + STATS_MIN_SHIFT;
+	sub = (bucket - 1) % STATS_SUB;
+	return ((uint64_t) (STATS_SUB + sub + 1)) << (octave - STATS_SUB_BITS);
+}
+
+uint64_t stats_start(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * stats_record() - account for one access to an attribute
+ * @start: stats_start() before the access
+ * @err: 0 if the access succeeded
+*/
+void stats_record(enum attr_id id, enum stats_op op, uint64_t start, int err)
+{
+	struct attr_stats *st = stats_of(id, op);
+	uint64_t ns = stats_start() - start;
+
+	st->count++;
+	st->total_ns += ns;
+	if (ns > st->max_ns)
+		st->max_ns = ns;
+	st->buckets[bucket_of(ns)]++;
+	if (err)
+		st->errors++;
+}
+
+void stats_retry(enum attr_id id, enum stats_op op)
+{
+	stats_of(id, op)->retries++;
+}
+
+/*
+ * Errors worth a second attempt: the bus was busy or the transfer
+ * timed out, the device is probably fine.
+ */
+int stats_transient(int err)
+{
+	return err == EAGAIN || err == EINTR || err == ETIMEDOUT || err == EBUSY;
+}
+
+static uint64_t percentile(const struct attr_stats *st, int pct)
+{
+	uint64_t rank = (st->count * pct + 99) / 100, seen = 0;
+
+	for (int b = 0; b < STATS_BUCKETS; b++) {
+		seen += st->buckets[b];
+		if (seen >= rank)
+			return bucket_limit(b) < st->max_ns ? bucket_limit(b) : st->max_ns;
+	}
+	return st->max_ns;
+}
+
+/**
+ * stats_print() - print the access times of every attribute accessed
+ *
+ * Percentiles are the upper bound of their histogram bucket, so they are
+ * at most 25% above the actual value. The share is the part of the total
+ * access time spent on the attribute.
+*/
+void stats_print(FILE *out)
+{
+	uint64_t total = 0;
+
+	for (int id = 0; id <= NUM_ATTRS; id++)
+		for (int op = 0; op < STATS_OPS; op++)
+			total += stats_table[id][op].total_ns;
+
+	fprintf(out, "%-20s %-5s %8s %6s %7s %9s %9s %9s %9s %9s %6s\n", "attribute", "op", "count", "errors",
+			"retries", "mean us", "p50 us", "p90 us", "p99 us", "max us", "share");
+	for (int id = 0; id <= NUM_ATTRS; id++) {
+		for (int op = 0; op < STATS_OPS; op++) {
+			const struct attr_stats *st = &stats_table[id][op];
+
+			if (st->count == 0)
+				continue;
+			fprintf(out, "%-20s %-5s %8llu %6llu %7llu %9.1f %9.1f %9.1f %9.1f %9.1f %5.1f%%\n",
+					id < NUM_ATTRS ? attr_table[id].name : "(other)", op_names[op],
+					(unsigned long long) st->count, (unsigned long long) st->errors,
+					(unsigned long long) st->retries, st->total_ns / 1000.0 / st->count,
+					percentile(st, 50) / 1000.0, percentile(st, 90) / 1000.0,
+					percentile(st, 99) / 1000.0, st->max_ns / 1000.0,
+					total ? st->total_ns * 100.0 / total : 0.0);
+		}
+	}
+}
+
+/**
+ * stats_command() - print the attribute access times
+ *
+ * When the daemon is running, its statistics are printed instead (see
+ * main()). Otherwise every attribute of the devices is read --rounds
+ * times, 10 by default, to measure them.
+ * Return: 0 on success, otherwise error code
+*/
+int stats_command(int argc, char *argv[], struct ltc_device **devs, int ndev)
+{
+	static const struct option options[] = {
+		{ "rounds", required_argument, NULL, 'n' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct snapshot snap;
+	long rounds = 10;
+	int opt;
+
+	optind = 1;
+	while ((opt = getopt_long(argc, argv, "n:", options, NULL)) != -1) {
+		if (opt != 'n')
+			return EINVAL;
+		rounds = strtol(optarg, NULL, 10);
+	}
+	if (rounds <= 0) {
+		fprintf(stderr, "stats: the rounds must be positive\n");
+		return EINVAL;
+	}
+
+	for (long r = 0; r < rounds; r++) {
+		for (int d = 0; d < ndev; d++) {
+			snapshot_init(&snap, devs[d], 0);
+			snapshot_read(&snap);
+		}
+	}
+	stats_print(stdout);
+	return 0;
+}
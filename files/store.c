@@ -0,0 +1,595 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "store.h"
+
+#define NSEC_PER_MSEC 1000000L
+
+static uint64_t zigzag(int64_t v)
+{
+	return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v)
+{
+	return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+static size_t put_varint(uint8_t *p, uint64_t v)
+{
+	size_t n = 0;
+
+	while (v >= 0x80) {
+		p[n++] = (uint8_t) v | 0x80;
+		v >>= 7;
+	}
+	p[n++] = (uint8_t) v;
+	return n;
+}
+
+// Return: bytes read, 0 if the varint runs past end.
+static size_t get_varint(const uint8_t *p, const uint8_t *end, uint64_t *v)
+{
+	size_t n = 0;
+
+	*v = 0;
+	while (p + n < end && n < 10) {
+		*v |= (uint64_t) (p[n] & 0x7f) << (7 * n);
+		if (!(p[n++] & 0x80))
+			return n;
+	}
+	return 0;
+}
+
+static int check_block(const struct store_block *blk)
+{
+	uint64_t total = 0;
+
+	if (memcmp(blk->magic, STORE_BLOCK_MAGIC, 4) != 0 || blk->rows == 0 || blk->rows > STORE_BLOCK_ROWS
+			|| blk->size > STORE_PAYLOAD_MAX)
+		return EINVAL;
+	for (int s = 0; s < STORE_STREAMS; s++)
+		total += blk->streams[s];
+	return total == blk->size ? 0 : EINVAL;
+}
+
+/*
+ * A writer that died in the middle of a block leaves a partial block at the
+ * end of the file: it is cut off, the blocks before it are intact.
+ */
+static int find_end(struct store *store, off_t size)
+{
+	off_t off = sizeof(store->hdr);
+	struct store_block blk;
+
+	while (off + (off_t) sizeof(blk) <= size) {
+		if (pread(store->fd, &blk, sizeof(blk), off) != sizeof(blk) || check_block(&blk) != 0
+				|| off + (off_t) sizeof(blk) + blk.size > size)
+			break;
+		off += sizeof(blk) + blk.size;
+	}
+	if (off != size) {
+		fprintf(stderr, "store: dropping %lld bytes of a partial block\n", (long long) (size - off));
+		if (ftruncate(store->fd, off) < 0)
+			return throw("store: cannot truncate the partial block", errno);
+	}
+	if (lseek(store->fd, off, SEEK_SET) < 0)
+		return throw("store: lseek", errno);
+	return 0;
+}
+
+/**
+ * store_open() - open a telemetry store, creating it if it does not exist
+ * @hz: sampling rate of the writer, 0 to open the store read only
+ *
+ * A writer appends to the end of the store, a reader starts from its
+ * first block.
+ * Return: 0 on success, otherwise error code
+*/
+int store_open(struct store *store, const char *path, uint32_t hz)
+{
+	struct stat st;
+	int err;
+
+	store->writer = hz != 0;
+	store->rows = 0;
+	store->fd = open(path, store->writer ? O_RDWR | O_CREAT | O_CLOEXEC : O_RDONLY | O_CLOEXEC, 0644);
+	if (store->fd < 0)
+		return throw("store: cannot open the store", errno);
+	if (fstat(store->fd, &st) < 0) {
+		err = throw("store: cannot stat the store", errno);
+		goto fail;
+	}
+
+	if (st.st_size == 0 && store->writer) {
+		memset(&store->hdr, 0, sizeof(store->hdr));
+		memcpy(store->hdr.magic, STORE_MAGIC, 4);
+		store->hdr.version = STORE_VERSION;
+		store->hdr.columns = SAMPLE_COLUMNS;
+		store->hdr.hz = hz;
+		if (write(store->fd, &store->hdr, sizeof(store->hdr)) != sizeof(store->hdr)) {
+			err = throw("store: cannot write the header", errno ? errno : EIO);
+			goto fail;
+		}
+		return 0;
+	}
+	if (read(store->fd, &store->hdr, sizeof(store->hdr)) != sizeof(store->hdr)
+			|| memcmp(store->hdr.magic, STORE_MAGIC, 4) != 0 || store->hdr.version != STORE_VERSION
+			|| store->hdr.columns != SAMPLE_COLUMNS) {
+		fprintf(stderr, "store: %s is not a telemetry store\n", path);
+		err = EINVAL;
+		goto fail;
+	}
+	if (store->writer) {
+		if (hz > store->hdr.hz) {
+			store->hdr.hz = hz;
+			pwrite(store->fd, &store->hdr, sizeof(store->hdr), 0);
+		}
+		if ((err = find_end(store, st.st_size)))
+			goto fail;
+	}
+	return 0;
+
+fail:
+	close(store->fd);
+	store->fd = -1;
+	return err;
+}
+
+/**
+ * store_append() - add a row to the store
+ *
+ * Rows are buffered, a block is written when it is full.
+ * Return: 0 on success, otherwise error code
+*/
+int store_append(struct store *store, const struct sample_row *row)
+{
+	uint32_t n = store->rows++;
+
+	store->time[n] = (int64_t) row->time.tv_sec * 1000 + row->time.tv_nsec / NSEC_PER_MSEC;
+	store->valid[n] = row->valid;
+	for (int c = 0; c < SAMPLE_COLUMNS; c++)
+		store->raw[c][n] = row->valid & (1U << c) ? (int32_t) row->raw[c] : 0;
+	return store->rows == STORE_BLOCK_ROWS ? store_flush(store) : 0;
+}
+
+static uint32_t encode_times(struct store *store, uint8_t *p)
+{
+	int64_t delta = 0, prev = store->time[0];
+	uint8_t *start = p;
+
+	for (uint32_t n = 0; n < store->rows; n++) {
+		int64_t d = store->time[n] - prev;
+
+		p += put_varint(p, zigzag(d - delta));
+		delta = d;
+		prev = store->time[n];
+	}
+	return p - start;
+}
+
+static uint32_t encode_valid(struct store *store, uint8_t *p)
+{
+	uint8_t *start = p;
+
+	for (uint32_t n = 0, run; n < store->rows; n += run) {
+		for (run = 1; n + run < store->rows && store->valid[n + run] == store->valid[n]; run++)
+			;
+		p += put_varint(p, store->valid[n]);
+		p += put_varint(p, run);
+	}
+	return p - start;
+}
+
+static uint32_t encode_column(struct store *store, int c, uint8_t *p)
+{
+	int64_t prev = 0;
+	uint8_t *start = p;
+
+	for (uint32_t n = 0; n < store->rows; n++) {
+		if (!(store->valid[n] & (1U << c)))
+			continue;
+		p += put_varint(p, zigzag(store->raw[c][n] - prev));
+		prev = store->raw[c][n];
+	}
+	return p - start;
+}
+
+/**
+ * store_flush() - write the rows buffered as a block
+ *
+ * The block header and its payload go out in one write.
+ * Return: 0 on success, otherwise error code
+*/
+int store_flush(struct store *store)
+{
+	struct store_block *blk = &store->block;
+	uint8_t *p = store->payload;
+	struct iovec iov[2] = {
+		{ blk, sizeof(*blk) },
+		{ store->payload, 0 },
+	};
+	ssize_t len;
+
+	if (store->rows == 0)
+		return 0;
+	memcpy(blk->magic, STORE_BLOCK_MAGIC, 4);
+	blk->rows = store->rows;
+	blk->first = store->time[0];
+	blk->last = store->time[store->rows - 1];
+	p += blk->streams[0] = encode_times(store, p);
+	p += blk->streams[1] = encode_valid(store, p);
+	for (int c = 0; c < SAMPLE_COLUMNS; c++)
+		p += blk->streams[c + 2] = encode_column(store, c, p);
+	blk->size = iov[1].iov_len = p - store->payload;
+	store->rows = 0;
+
+	len = writev(store->fd, iov, 2);
+	if (len != (ssize_t) (sizeof(*blk) + blk->size))
+		return throw("store: cannot write a block", errno ? errno : EIO);
+	return 0;
+}
+
+static int decode_block(struct store *store)
+{
+	const struct store_block *blk = &store->block;
+	const uint8_t *p = store->payload, *end;
+	int64_t delta = 0, t = blk->first;
+	uint64_t v;
+	size_t n;
+
+	end = p + blk->streams[0];
+	for (uint32_t r = 0; r < blk->rows; r++, p += n) {
+		if ((n = get_varint(p, end, &v)) == 0)
+			return EINVAL;
+		delta += unzigzag(v);
+		t += delta;
+		store->time[r] = t;
+	}
+	p = end;
+
+	end = p + blk->streams[1];
+	for (uint32_t r = 0; r < blk->rows; ) {
+		uint64_t mask, run;
+
+		if ((n = get_varint(p, end, &mask)) == 0)
+			return EINVAL;
+		p += n;
+		if ((n = get_varint(p, end, &run)) == 0 || run == 0 || run > blk->rows - r)
+			return EINVAL;
+		p += n;
+		while (run--)
+			store->valid[r++] = mask;
+	}
+	p = end;
+
+	for (int c = 0; c < SAMPLE_COLUMNS; c++) {
+		int64_t value = 0;
+
+		end = p + blk->streams[c + 2];
+		for (uint32_t r = 0; r < blk->rows; r++) {
+			store->raw[c][r] = 0;
+			if (!(store->valid[r] & (1U << c)))
+				continue;
+			if ((n = get_varint(p, end, &v)) == 0)
+				return EINVAL;
+			p += n;
+			value += unzigzag(v);
+			store->raw[c][r] = value;
+		}
+		p = end;
+	}
+	store->rows = blk->rows;
+	return 0;
+}
+
+/**
+ * store_next_block() - read the next block with rows between from and to
+ * @from: unix time in milliseconds
+ * @to: unix time in milliseconds
+ *
+ * The blocks out of the range are skipped without reading their payload.
+ * The rows of the block are then available with store_row(), rows out of
+ * the range included.
+ * Return: 1 if a block was read, 0 at the end of the store, -1 on error.
+*/
+int store_next_block(struct store *store, int64_t from, int64_t to)
+{
+	struct store_block *blk = &store->block;
+
+	for (;;) {
+		ssize_t len = read(store->fd, blk, sizeof(*blk));
+
+		if (len == 0)
+			return 0;
+		if (len != sizeof(*blk) || check_block(blk) != 0)
+			break;
+		if (blk->last < from || blk->first > to) {
+			if (lseek(store->fd, blk->size, SEEK_CUR) < 0)
+				break;
+			continue;
+		}
+		if (read(store->fd, store->payload, blk->size) != blk->size || decode_block(store) != 0)
+			break;
+		return 1;
+	}
+	fprintf(stderr, "store: corrupted block\n");
+	return -1;
+}
+
+void store_row(const struct store *store, uint32_t n, struct sample_row *row)
+{
+	row->time.tv_sec = store->time[n] / 1000;
+	row->time.tv_nsec = (store->time[n] % 1000) * NSEC_PER_MSEC;
+	row->valid = store->valid[n];
+	for (int c = 0; c < SAMPLE_COLUMNS; c++)
+		row->raw[c] = store->raw[c][n];
+}
+
+/*
+ * Return: 0 on success, otherwise error code of the last block written
+ */
+int store_close(struct store *store)
+{
+	int err = 0;
+
+	if (store->fd < 0)
+		return 0;
+	if (store->writer)
+		err = store_flush(store);
+	if (close(store->fd) < 0 && !err)
+		err = throw("store: cannot close the store", errno);
+	store->fd = -1;
+	return err;
+}
+
+/*
+ * The csv files of ltcsensors.py only have the time of the day. The date
+ * is --date, or the day the file was last written: a capture that starts
+ * later in the day than that time started the day before.
+ */
+static int import_csv(struct store *store, const char *path, const char *date, uint64_t *imported)
+{
+	struct sample_row row;
+	char line[SAMPLE_ROW_MAX];
+	time_t day = -1, prev = -1;
+	struct stat st;
+	struct tm tm;
+	FILE *in;
+
+	if ((in = fopen(path, "r")) == NULL)
+		return throw("store: cannot open the csv file", errno);
+	if (date != NULL) {
+		memset(&tm, 0, sizeof(tm));
+		if (strptime(date, "%Y-%m-%d", &tm) == NULL) {
+			fprintf(stderr, "store: the date must be YYYY-MM-DD\n");
+			fclose(in);
+			return EINVAL;
+		}
+		day = timegm(&tm);
+	}
+	fstat(fileno(in), &st);
+
+	while (fgets(line, sizeof(line), in) != NULL) {
+		if (sample_parse_row(line, &row) != 0)
+			continue;
+		if (day == -1)
+			day = st.st_mtime - st.st_mtime % 86400 - (row.time.tv_sec > st.st_mtime % 86400 ? 86400 : 0);
+		// rows go on past midnight
+		if (prev != -1 && row.time.tv_sec < prev)
+			day += 86400;
+		prev = row.time.tv_sec;
+		row.time.tv_sec += day;
+		if (store_append(store, &row) != 0)
+			break;
+		(*imported)++;
+	}
+	fclose(in);
+	return store_flush(store);
+}
+
+static int store_import(int argc, char *argv[])
+{
+	static const struct option options[] = {
+		{ "store", required_argument, NULL, 's' },
+		{ "date", required_argument, NULL, 'D' },
+		{ "hz", required_argument, NULL, 'r' },
+		{ NULL, 0, NULL, 0 }
+	};
+	const char *path = NULL, *date = NULL;
+	struct store *store;
+	uint64_t imported = 0;
+	long hz = 1;
+	int opt, err = 0;
+
+	optind = 1;
+	while ((opt = getopt_long(argc, argv, "s:D:r:", options, NULL)) != -1) {
+		switch (opt) {
+		case 's':
+			path = optarg;
+			break;
+		case 'D':
+			date = optarg;
+			break;
+		case 'r':
+			hz = strtol(optarg, NULL, 10);
+			break;
+		default:
+			return EINVAL;
+		}
+	}
+	if (path == NULL || optind >= argc || hz <= 0) {
+		fprintf(stderr, "store: import --store S [--date YYYY-MM-DD] [--hz N] csv...\n");
+		return EINVAL;
+	}
+	if ((store = malloc(sizeof(*store))) == NULL)
+		return throw("store: cannot allocate the store", ENOMEM);
+	if ((err = store_open(store, path, hz)) == 0) {
+		for (int i = optind; i < argc && !err; i++)
+			err = import_csv(store, argv[i], date, &imported);
+		if (store_close(store) && !err)
+			err = EIO;
+		printf("%llu rows imported\n", (unsigned long long) imported);
+	}
+	free(store);
+	return err;
+}
+
+/*
+ * Rows have the same layout as the ones written by sample. --from and
+ * --to are unix times in seconds.
+ */
+static int store_export(int argc, char *argv[])
+{
+	static const struct option options[] = {
+		{ "from", required_argument, NULL, 'a' },
+		{ "to", required_argument, NULL, 'b' },
+		{ "file", required_argument, NULL, 'f' },
+		{ NULL, 0, NULL, 0 }
+	};
+	int64_t from = INT64_MIN, to = INT64_MAX;
+	char buf[SAMPLE_ROW_MAX];
+	struct sample_row row;
+	char *filename = NULL;
+	struct store *store;
+	FILE *out = stdout;
+	int opt, err, res;
+
+	optind = 1;
+	while ((opt = getopt_long(argc, argv, "a:b:f:", options, NULL)) != -1) {
+		switch (opt) {
+		case 'a':
+			from = strtoll(optarg, NULL, 10) * 1000;
+			break;
+		case 'b':
+			to = strtoll(optarg, NULL, 10) * 1000;
+			break;
+		case 'f':
+			filename = optarg;
+			break;
+		default:
+			return EINVAL;
+		}
+	}
+	if (optind >= argc) {
+		fprintf(stderr, "store: missing store file\n");
+		return EINVAL;
+	}
+	if ((store = malloc(sizeof(*store))) == NULL)
+		return throw("store: cannot allocate the store", ENOMEM);
+	if ((err = store_open(store, argv[optind], 0)) != 0) {
+		free(store);
+		return err;
+	}
+	if (filename != NULL && (out = fopen(filename, "w")) == NULL) {
+		store_close(store);
+		free(store);
+		return throw("store: cannot open output file", errno);
+	}
+
+	fwrite(buf, 1, sample_format_header(buf, sizeof(buf)), out);
+	while ((res = store_next_block(store, from, to)) > 0) {
+		for (uint32_t n = 0; n < store->rows; n++) {
+			if (store->time[n] < from || store->time[n] > to)
+				continue;
+			store_row(store, n, &row);
+			fwrite(buf, 1, sample_format_row(buf, sizeof(buf), &row, store->hdr.hz), out);
+		}
+	}
+
+	if (out != stdout)
+		fclose(out);
+	store_close(store);
+	free(store);
+	return res < 0 ? EINVAL : 0;
+}
+
+// what the store holds, and what it would take as csv
+static int store_info(int argc, char *argv[])
+{
+	uint64_t rows = 0, blocks = 0, bytes = 0, csv = 0, streams[STORE_STREAMS] = { 0 };
+	int64_t first = INT64_MAX, last = INT64_MIN;
+	char buf[SAMPLE_ROW_MAX];
+	struct sample_row row;
+	struct store *store;
+	int err, res;
+
+	if (argc < 2) {
+		fprintf(stderr, "store: missing store file\n");
+		return EINVAL;
+	}
+	if ((store = malloc(sizeof(*store))) == NULL)
+		return throw("store: cannot allocate the store", ENOMEM);
+	if ((err = store_open(store, argv[1], 0)) != 0) {
+		free(store);
+		return err;
+	}
+	bytes = sizeof(store->hdr);
+	csv = sample_format_header(buf, sizeof(buf));
+	while ((res = store_next_block(store, INT64_MIN, INT64_MAX)) > 0) {
+		blocks++;
+		rows += store->rows;
+		bytes += sizeof(store->block) + store->block.size;
+		for (int s = 0; s < STORE_STREAMS; s++)
+			streams[s] += store->block.streams[s];
+		if (store->block.first < first)
+			first = store->block.first;
+		if (store->block.last > last)
+			last = store->block.last;
+		for (uint32_t n = 0; n < store->rows; n++) {
+			store_row(store, n, &row);
+			csv += sample_format_row(buf, sizeof(buf), &row, store->hdr.hz);
+		}
+	}
+	store_close(store);
+
+	printf("%llu rows in %llu blocks, %llu bytes, %.2f bytes per row\n", (unsigned long long) rows,
+			(unsigned long long) blocks, (unsigned long long) bytes, rows ? (double) bytes / rows : 0.0);
+	if (rows) {
+		time_t t = first / 1000;
+		char from[32], to[32];
+
+		strftime(from, sizeof(from), "%Y-%m-%d %H:%M:%S", gmtime(&t));
+		t = last / 1000;
+		strftime(to, sizeof(to), "%Y-%m-%d %H:%M:%S", gmtime(&t));
+		printf("from %s to %s UTC\n", from, to);
+		printf("as csv: %llu bytes, %.1f times larger\n", (unsigned long long) csv, (double) csv / bytes);
+		for (int s = 3; s < STORE_STREAMS; s++)
+			streams[2] += streams[s];
+		printf("timestamps %.2f, valid masks %.2f, values %.2f bytes per row\n", (double) streams[0] / rows,
+				(double) streams[1] / rows, (double) streams[2] / rows);
+	}
+	free(store);
+	return res < 0 ? EINVAL : 0;
+}
+
+/**
+ * store_command() - manage a compressed telemetry store
+ *
+ * ltc-monitor store import --store S [--date YYYY-MM-DD] [--hz N] csv...
+ * ltc-monitor store export S [--from T] [--to T] [--file F]
+ * ltc-monitor store info S
+ * Stores are written by sample --store, or imported from the csv files of
+ * sample and ltcsensors.py.
+ * Return: 0 on success, otherwise error code
+*/
+int store_command(int argc, char *argv[])
+{
+	if (argc >= 2 && strcmp(argv[1], "import") == 0)
+		return store_import(argc - 1, argv + 1);
+	if (argc >= 2 && strcmp(argv[1], "export") == 0)
+		return store_export(argc - 1, argv + 1);
+	if (argc >= 2 && strcmp(argv[1], "info") == 0)
+		return store_info(argc - 1, argv + 1);
+	fprintf(stderr, "store: import, export or info\n");
+	return EINVAL;
+}
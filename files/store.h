@@ -0,0 +1,71 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdint.h>
+
+#include "ltc-monitor.h"
+
+#define STORE_MAGIC "LTCS"
+#define STORE_BLOCK_MAGIC "LTCB"
+#define STORE_VERSION 1
+// about four minutes at 1 Hz: what is lost if the writer dies
+#define STORE_BLOCK_ROWS 256
+// timestamps, valid masks, then one stream per sample column
+#define STORE_STREAMS (SAMPLE_COLUMNS + 2)
+// worst case: 10 bytes per timestamp, 4 per valid run, 5 per value
+#define STORE_PAYLOAD_MAX (STORE_BLOCK_ROWS * (10 + 4 + 5 * SAMPLE_COLUMNS))
+
+/*
+ * Compressed telemetry store: a header followed by blocks appended as
+ * they fill up. All fields are in host byte order.
+ */
+struct store_header {
+	char magic[4];
+	uint16_t version;
+	uint16_t columns; // SAMPLE_COLUMNS
+	uint32_t hz;
+	uint8_t reserved[20];
+};
+
+/*
+ * A block holds up to STORE_BLOCK_ROWS rows, stored column by column: the
+ * payload is the concatenation of its streams, each one a sequence of
+ * varints.
+ * - timestamps, in milliseconds: zig-zag delta of delta, starting from
+ *   the first timestamp with a delta of 0
+ * - valid masks: (mask, run length) pairs
+ * - values, raw register units: zig-zag delta from the previous valid
+ *   value of the column, starting from 0; rows where the column is not
+ *   valid have no value
+ * Readers skip the blocks out of their time range with the header alone.
+ */
+struct store_block {
+	char magic[4];
+	uint32_t rows;
+	int64_t first; // unix time of the first and last rows, in milliseconds
+	int64_t last;
+	uint32_t size; // payload bytes
+	uint32_t streams[STORE_STREAMS]; // bytes of each stream
+};
+
+struct store {
+	int fd;
+	int writer;
+	struct store_header hdr;
+	struct store_block block;
+	// rows of the current block, decoded or waiting to be written
+	int64_t time[STORE_BLOCK_ROWS];
+	uint32_t valid[STORE_BLOCK_ROWS];
+	int32_t raw[SAMPLE_COLUMNS][STORE_BLOCK_ROWS];
+	uint32_t rows;
+	uint8_t payload[STORE_PAYLOAD_MAX];
+};
+
+int store_open(struct store *store, const char *path, uint32_t hz);
+int store_append(struct store *store, const struct sample_row *row);
+int store_flush(struct store *store);
+int store_next_block(struct store *store, int64_t from, int64_t to);
+void store_row(const struct store *store, uint32_t n, struct sample_row *row);
+int store_close(struct store *store);
+
+#endif
@@ -4,6 +4,9 @@ import os
 from time import sleep, gmtime, strftime
 import argparse
 
+HWMON_ROOT = '/sys/class/hwmon'
+DRIVER_NAME = 'ltc3350'
+# used when no hwmon device is bound to the driver
 DIRECTORY = '/sys/bus/i2c/devices/i2c-2/2-0009/hwmon/hwmon4'
 #CSV_FILE = 'dynagate2_1h_capesr2min.csv'
 
@@ -35,15 +38,36 @@ def convert_from_LSB(buf, name):
     return LSB_to_millivolts(value, 2210)
 
 
-def sensors(silent, filename):
-    files = os.listdir(DIRECTORY)
+def find_device(selector):
+    # hwmon devices of the ltc3350 driver, by hwmon index
+    devices = []
+    for entry in os.listdir(HWMON_ROOT) if os.path.isdir(HWMON_ROOT) else []:
+        path = os.path.join(HWMON_ROOT, entry)
+        try:
+            with open(os.path.join(path, 'name')) as f:
+                if f.read().strip() != DRIVER_NAME:
+                    continue
+        except OSError:
+            continue
+        bus = os.path.basename(os.path.realpath(os.path.join(path, 'device')))
+        devices.append((int(entry[5:]), entry, bus, path))
+    devices.sort()
+    if not devices and os.path.isdir(DIRECTORY):
+        devices.append((0, os.path.basename(DIRECTORY), '', DIRECTORY))
+    for i, (_, name, bus, path) in enumerate(devices):
+        if selector is None or selector in (name, bus, path, str(i)):
+            return path
+    return None
+
+def sensors(directory, silent, filename):
+    files = os.listdir(directory)
     sorted_files = sorted(files)
     row = []
     timestamp = strftime("%H:%M:%S", gmtime())
     row.append(timestamp)
 
     for file in sorted_files:
-        file_path = os.path.join(DIRECTORY, file)
+        file_path = os.path.join(directory, file)
         max_name = ""
         min_name = ""
         meas_val = ""
@@ -72,12 +96,12 @@ def sensors(silent, filename):
             continue
 
         row.append(meas_val);
-        max_path = os.path.join(DIRECTORY, max_name)
+        max_path = os.path.join(directory, max_name)
         if os.path.isfile(max_path):
             with open(max_path, 'r') as f:
                 max_val = convert_from_LSB(f.read().strip(), max_name)
 
-        min_path = os.path.join(DIRECTORY, min_name)
+        min_path = os.path.join(directory, min_name)
         if os.path.isfile(min_path):
             with open(min_path, 'r') as f:
                 min_val = convert_from_LSB(f.read().strip(), max_name)
@@ -98,14 +122,19 @@ def sensorsc():
     parser.add_argument('-s', '--silent', action='store_true')
     parser.add_argument('-l', '--length', default=120);
     parser.add_argument('-f', '--file', default="dynagate2_report.csv");
+    parser.add_argument('-d', '--device', help="hwmon name, i2c device, index or path of the ltc3350");
 
     args = parser.parse_args()
+    directory = find_device(args.device)
+    if directory is None:
+        print("No ltc3350 device found")
+        return
 
     with open(args.file, 'w', newline="") as file:
         writer = csv.writer(file)
         writer.writerow(['timestamp', 'dtemp', 'iin', 'gpi', 'vcap', 'vcap1', 'vcap2', 'vcap3', 'vcap4', 'vin', 'vout'])
     for _ in range(int(args.length)):
-        sensors(args.silent, args.file)
+        sensors(directory, args.silent, args.file)
         sleep(1)
         if(not args.silent):        
                 for _ in range(10):